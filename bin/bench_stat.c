@@ -0,0 +1,226 @@
+#include "lconfig.h"
+#include "lctools.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+
+// Internals from lconfig.c.  The benchmark plays the part of the
+// acquisition thread, so no device is needed.
+void init_config(lc_devconf_t* dconf);
+int init_buffer(lc_ringbuf_t* RB, const unsigned int channels,
+        const unsigned int samples_per_read, const unsigned int blocks);
+double* get_write_buffer(lc_ringbuf_t* RB);
+void service_write_buffer(lc_ringbuf_t* RB);
+
+#define BENCH_NSPR  5
+#define BENCH_NCH   4
+#define BENCH_TOL   1e-9    // Largest relative error allowed in mean and var
+
+const unsigned int bench_spr[BENCH_NSPR] = {16, 64, 256, 1024, 4096};
+const unsigned int bench_nch[BENCH_NCH] = {1, 2, 4, 8};
+
+const char help_text[] = \
+"bench_stat [-h] [-n NSAMPLE] [-r REPEAT] [-m MEAN]\n"\
+"\n"\
+"Benchmark LCT_STREAM_STAT() over the samples_per_read block sizes\n"\
+"    16, 64, 256, 1024, 4096\n"\
+"and 1, 2, 4, and 8 analog channels.  Synthetic blocks are published to the\n"\
+"ring buffer just as the acquisition thread would publish them, so no device\n"\
+"is needed.  Only the time spent in LCT_STREAM_STAT() is counted, and the\n"\
+"best of REPEAT runs is reported in nanoseconds per sample per channel.\n"\
+"\n"\
+"The samples are a small uniform noise on a large offset, which is the\n"\
+"hard case for a one-pass variance.  The aggregated mean and variance of\n"\
+"every channel are compared against a two-pass calculation over the same\n"\
+"calibrated samples, and the largest relative error is reported.  If it\n"\
+"exceeds 1e-9, bench_stat exits with an error.\n"\
+"\n"\
+"-h\n"\
+"  Display this help text and exit immediately.\n"\
+"\n"\
+"-m MEAN\n"\
+"  The offset of the raw samples.  The default is 1000.\n"\
+"\n"\
+"-n NSAMPLE\n"\
+"  The number of samples per channel in each run.  The default is 100000.\n"\
+"\n"\
+"-r REPEAT\n"\
+"  The number of runs of each case.  The default is 3.\n"\
+"\n"\
+"(c)2026 Christopher R. Martin\n";
+
+
+/* RUN
+ * Aggregate NBLOCK blocks of SAMPLES_PER_READ samples with CHANNELS analog
+ * channels.  When REF is not NULL, the calibrated samples of each channel
+ * are stored there (NBLOCK * SAMPLES_PER_READ per channel).  Returns the
+ * time spent in LCT_STREAM_STAT() in seconds or a negative number on error.
+ */
+double run(lc_devconf_t *dconf, lct_stat_t stat[], unsigned int channels,
+        unsigned int samples_per_read, unsigned int nblock, double mean,
+        double *ref){
+    unsigned int block, row, ch, seed = 12345;
+    unsigned int nref = nblock * samples_per_read;
+    double *data, seconds = 0.;
+    struct timespec t0, t1;
+    int err;
+
+    dconf->naich = channels;
+    if(init_buffer(&dconf->RB, channels, samples_per_read, 2)){
+        fprintf(stderr, "BENCH_STAT: Failed to allocate the buffer.\n");
+        return -1.;
+    }
+    lct_stat_init(stat, channels);
+    for(block=0; block<nblock; block++){
+        data = get_write_buffer(&dconf->RB);
+        for(row=0; row<samples_per_read; row++){
+            for(ch=0; ch<channels; ch++){
+                // A linear congruential generator keeps the runs identical
+                seed = seed * 1664525u + 1013904223u;
+                data[row*channels + ch] = mean + ch + 1e-3 * (seed >> 8) / (1u << 24);
+                if(ref)
+                    ref[ch*nref + block*samples_per_read + row] =
+                            (data[row*channels + ch] - dconf->aich[ch].calzero) *
+                            dconf->aich[ch].calslope;
+            }
+        }
+        service_write_buffer(&dconf->RB);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        err = lct_stream_stat(dconf, stat, channels);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if(err){
+            fprintf(stderr, "BENCH_STAT: LCT_STREAM_STAT() failed.\n");
+            lc_stream_clean(dconf);
+            return -1.;
+        }
+        seconds += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+    }
+    lc_stream_clean(dconf);
+    return seconds;
+}
+
+
+/* CHECK
+ * Return the largest relative error in the mean and variance of STAT
+ * compared to a two-pass calculation over the calibrated samples in REF.
+ */
+double check(lct_stat_t stat[], unsigned int channels, double *ref,
+        unsigned int nref){
+    unsigned int ch, ii;
+    double mean, var, err, worst = 0.;
+
+    for(ch=0; ch<channels; ch++){
+        mean = 0.;
+        for(ii=0; ii<nref; ii++)
+            mean += ref[ch*nref + ii];
+        mean /= nref;
+        var = 0.;
+        for(ii=0; ii<nref; ii++)
+            var += (ref[ch*nref + ii] - mean) * (ref[ch*nref + ii] - mean);
+        var /= nref;
+        if(stat[ch].n != nref)
+            return INFINITY;
+        err = fabs(stat[ch].mean - mean) / fabs(mean);
+        worst = err > worst ? err : worst;
+        err = fabs(stat[ch].var - var) / var;
+        worst = err > worst ? err : worst;
+    }
+    return worst;
+}
+
+
+int main(int argc, char *argv[]){
+    int ch, repeat = 3, nsample = 100000, ii, fail = 0;
+    unsigned int ispr, inch, nblock, nref, channels;
+    double mean = 1000., seconds, best, worst;
+    lc_devconf_t dconf;
+    lct_stat_t stat[LCONF_MAX_NAICH];
+    double *ref;
+
+    // Parse command-line options
+    while((ch = getopt(argc, argv, "hn:r:m:")) >= 0){
+        switch(ch){
+        case 'h':
+            printf("%s",help_text);
+            return 0;
+        case 'n':
+            if(1 != sscanf(optarg, "%d", &nsample) || nsample <= 0){
+                fprintf(stderr, "BENCH_STAT: -n requires a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'r':
+            if(1 != sscanf(optarg, "%d", &repeat) || repeat <= 0){
+                fprintf(stderr, "BENCH_STAT: -r requires a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'm':
+            if(1 != sscanf(optarg, "%lf", &mean)){
+                fprintf(stderr, "BENCH_STAT: -m requires a number.\n");
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "BENCH_STAT: Unrecognized option: %c\n", (char) ch);
+            return -1;
+        }
+    }
+
+    // A stream of analog channels with calibrations like lcstat.conf
+    init_config(&dconf);
+    for(ii=0; ii<LCONF_MAX_NAICH; ii++){
+        dconf.aich[ii].channel = ii;
+        dconf.aich[ii].calslope = ii%2 ? 10. : 4.8624;
+        dconf.aich[ii].calzero = ii%2 ? 0. : .04;
+    }
+    dconf.distream = 0;
+
+    printf("ns per sample per channel (largest relative error in mean, var)\n");
+    printf("%6s", "spr");
+    for(inch=0; inch<BENCH_NCH; inch++)
+        printf("  %15u ch", bench_nch[inch]);
+    printf("\n");
+    for(ispr=0; ispr<BENCH_NSPR; ispr++){
+        nblock = (nsample + bench_spr[ispr] - 1) / bench_spr[ispr];
+        nref = nblock * bench_spr[ispr];
+        printf("%6u", bench_spr[ispr]);
+        for(inch=0; inch<BENCH_NCH; inch++){
+            channels = bench_nch[inch];
+            ref = malloc(nref * channels * sizeof(double));
+            if(!ref){
+                fprintf(stderr, "BENCH_STAT: Failed to allocate the reference.\n");
+                return -1;
+            }
+            // The first run is checked against the two-pass calculation
+            if(run(&dconf, stat, channels, bench_spr[ispr], nblock, mean, ref) < 0){
+                free(ref);
+                return -1;
+            }
+            worst = check(stat, channels, ref, nref);
+            free(ref);
+            best = -1.;
+            for(ii=0; ii<repeat; ii++){
+                seconds = run(&dconf, stat, channels, bench_spr[ispr], nblock, mean, NULL);
+                if(seconds < 0)
+                    return -1;
+                if(best < 0 || seconds < best)
+                    best = seconds;
+            }
+            printf("  %8.3f (%7.1e)", 1e9 * best / nref / channels, worst);
+            if(!(worst <= BENCH_TOL))
+                fail = 1;
+        }
+        printf("\n");
+    }
+    if(fail){
+        fprintf(stderr, "BENCH_STAT: The relative error exceeded %.0e.\n", BENCH_TOL);
+        return -1;
+    }
+    return 0;
+}
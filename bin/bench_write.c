@@ -0,0 +1,248 @@
+#include "lconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+
+// Ring buffer internals from lconfig.c.  The benchmark plays the part of
+// the acquisition thread, so no device is needed.
+int init_buffer(lc_ringbuf_t* RB, const unsigned int channels,
+        const unsigned int samples_per_read, const unsigned int blocks);
+double* get_write_buffer(lc_ringbuf_t* RB);
+void service_write_buffer(lc_ringbuf_t* RB);
+
+#define BENCH_SAMPLE    0   // The old writer: one fwrite() per sample
+#define BENCH_BLOCK     1   // LC_DATAFILE_WRITE() from a double buffer
+#define BENCH_FLOAT     2   // LC_DATAFILE_WRITE() from an LC_RB_FLOAT buffer
+#define BENCH_N         3
+
+const char *bench_names[] = {"per-sample", "block", "block (float)"};
+
+const char config_default[] = "wscan.conf";
+const char output_default[] = "/dev/null";
+
+const char help_text[] = \
+"bench_write [-h] [-c CONFIG] [-s SAMPLES_PER_READ] [-n NSAMPLE] [-r REPEAT]\n"\
+"            [-o OUTPUT]\n"\
+"\n"\
+"Benchmark the binary data file writer.  Blocks of synthetic samples are\n"\
+"published to the ring buffer just as the acquisition thread would publish\n"\
+"them, and each one is written to OUTPUT by\n"\
+"  per-sample    the old writer, which converted and wrote one float at a\n"\
+"                time\n"\
+"  block         LC_DATAFILE_WRITE() with a double buffer\n"\
+"  block (float) LC_DATAFILE_WRITE() with an LC_RB_FLOAT buffer\n"\
+"Only the time spent in the writer is counted.  The best of REPEAT runs is\n"\
+"reported in MB/s of file output.  Before timing, the three writers are run\n"\
+"once into temporary files to confirm that their output is identical.\n"\
+"No device connection is made.\n"\
+"\n"\
+"-c CONFIG\n"\
+"  The configuration file that defines the stream channels.  The default\n"\
+"is \"wscan.conf\".\n"\
+"\n"\
+"-h\n"\
+"  Display this help text and exit immediately.\n"\
+"\n"\
+"-n NSAMPLE\n"\
+"  The number of samples per channel to write in each run.  The default is\n"\
+"the NSAMPLE in the configuration file.\n"\
+"\n"\
+"-o OUTPUT\n"\
+"  The file to write.  The default is /dev/null, so the file system is\n"\
+"not part of the measurement.\n"\
+"\n"\
+"-r REPEAT\n"\
+"  The number of runs of each writer.  The default is 5.\n"\
+"\n"\
+"-s SAMPLES_PER_READ\n"\
+"  The number of samples per channel in each block.  The default is\n"\
+"LCONF_SAMPLES_PER_READ.\n"\
+"\n"\
+"(c)2026 Christopher R. Martin\n";
+
+
+/* WRITE_SAMPLE
+ * The binary writer as it was before blocks were written at once
+ */
+int write_sample(lc_devconf_t *dconf, FILE *ff){
+    int err, index;
+    unsigned int channels, samples_per_read;
+    double *data = NULL;
+    float ftemp;
+
+    err = lc_stream_read(dconf, &data, &channels, &samples_per_read);
+    if(data){
+        for(index=0; index<channels*samples_per_read; index++){
+            ftemp = (float) data[index];
+            fwrite(&ftemp, sizeof(ftemp), 1, ff);
+        }
+    }
+    return err;
+}
+
+
+/* RUN
+ * Publish NBLOCK blocks of SAMPLES_PER_READ samples per channel, and write
+ * each one to FF with the writer, METHOD.  Returns the time spent writing in
+ * seconds or a negative number on error.
+ */
+double run(lc_devconf_t *dconf, int method, unsigned int samples_per_read,
+        unsigned int nblock, FILE *ff){
+    unsigned int channels, block, index;
+    double *data, seconds = 0.;
+    struct timespec t0, t1;
+    int err;
+
+    channels = lc_nistream(dconf);
+    if(lc_stream_pool(dconf, samples_per_read,
+                method == BENCH_FLOAT ? LC_RB_FLOAT : 0) ||
+            init_buffer(&dconf->RB, channels, samples_per_read, 2)){
+        fprintf(stderr, "BENCH_WRITE: Failed to allocate the buffer.\n");
+        return -1.;
+    }
+    for(block=0; block<nblock; block++){
+        // Synthetic data; the last channel is a digital word if there is one
+        data = get_write_buffer(&dconf->RB);
+        for(index=0; index<channels*samples_per_read; index++)
+            data[index] = dconf->distream && (index % channels == channels-1) ?
+                    (double) ((block * samples_per_read + index) & 0xFFFF) :
+                    1e-3 * ((block * 7919 + index * 104729) % 20001) - 10.;
+        service_write_buffer(&dconf->RB);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if(method == BENCH_SAMPLE)
+            err = write_sample(dconf, ff);
+        else
+            err = lc_datafile_write(dconf, ff);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if(err){
+            fprintf(stderr, "BENCH_WRITE: The writer failed.\n");
+            lc_stream_clean(dconf);
+            return -1.;
+        }
+        seconds += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+    }
+    fflush(ff);
+    lc_stream_clean(dconf);
+    return seconds;
+}
+
+
+int main(int argc, char *argv[]){
+    int ch, method, repeat = 5, ii;
+    int samples_per_read = LCONF_SAMPLES_PER_READ, nsample = -1;
+    unsigned int nblock;
+    char *config = (char *) config_default;
+    char *output = (char *) output_default;
+    lc_devconf_t dconf;
+    FILE *ff, *check[BENCH_N];
+    double seconds, best[BENCH_N], mbytes;
+    long bytes;
+    int ca, cb;
+
+    // Parse command-line options
+    while((ch = getopt(argc, argv, "hc:s:n:r:o:")) >= 0){
+        switch(ch){
+        case 'h':
+            printf("%s",help_text);
+            return 0;
+        case 'c':
+            config = optarg;
+            break;
+        case 's':
+            if(1 != sscanf(optarg, "%d", &samples_per_read) || samples_per_read <= 0){
+                fprintf(stderr, "BENCH_WRITE: -s requires a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'n':
+            if(1 != sscanf(optarg, "%d", &nsample) || nsample <= 0){
+                fprintf(stderr, "BENCH_WRITE: -n requires a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'r':
+            if(1 != sscanf(optarg, "%d", &repeat) || repeat <= 0){
+                fprintf(stderr, "BENCH_WRITE: -r requires a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "BENCH_WRITE: Unrecognized option: %c\n", (char) ch);
+            return -1;
+        }
+    }
+
+    if(lc_load_config(&dconf, 1, config)){
+        fprintf(stderr, "BENCH_WRITE: Failed to load the configuration file: %s\n", config);
+        return -1;
+    }
+    if(lc_nistream(&dconf) < 1){
+        fprintf(stderr, "BENCH_WRITE: The configuration has no stream channels.\n");
+        return -1;
+    }
+    dconf.dataformat = LC_DF_BIN;
+    if(nsample <= 0)
+        nsample = dconf.nsample;
+    nblock = (nsample + samples_per_read - 1) / samples_per_read;
+    bytes = (long) nblock * samples_per_read * lc_nistream(&dconf) * sizeof(float);
+    mbytes = bytes * 1e-6;
+
+    // Confirm that the writers agree
+    for(method=0; method<BENCH_N; method++){
+        check[method] = tmpfile();
+        if(!check[method] || run(&dconf, method, samples_per_read, nblock, check[method]) < 0){
+            fprintf(stderr, "BENCH_WRITE: The %s writer failed.\n", bench_names[method]);
+            return -1;
+        }
+        rewind(check[method]);
+    }
+    for(method=1; method<BENCH_N; method++){
+        rewind(check[0]);
+        do{
+            ca = fgetc(check[0]);
+            cb = fgetc(check[method]);
+        }while(ca == cb && ca != EOF);
+        if(ca != cb){
+            fprintf(stderr, "BENCH_WRITE: The %s writer does not match the %s writer.\n",
+                    bench_names[method], bench_names[BENCH_SAMPLE]);
+            return -1;
+        }
+    }
+    for(method=0; method<BENCH_N; method++)
+        fclose(check[method]);
+
+    ff = fopen(output, "wb");
+    if(!ff){
+        fprintf(stderr, "BENCH_WRITE: Failed to open the output file: %s\n", output);
+        return -1;
+    }
+    printf("%d channels, %d samples per read, %u blocks (%.3f MB) per run\n",
+            lc_nistream(&dconf), samples_per_read, nblock, mbytes);
+    for(method=0; method<BENCH_N; method++){
+        best[method] = -1.;
+        for(ii=0; ii<repeat; ii++){
+            rewind(ff);
+            seconds = run(&dconf, method, samples_per_read, nblock, ff);
+            if(seconds < 0){
+                fclose(ff);
+                return -1;
+            }
+            if(best[method] < 0 || seconds < best[method])
+                best[method] = seconds;
+        }
+        printf("  %-14s %10.1f MB/s  (%.3f ms)\n", bench_names[method],
+                mbytes / best[method], 1e3 * best[method]);
+    }
+    printf("  block/per-sample speedup: %.1fx, float: %.1fx\n",
+            best[BENCH_SAMPLE] / best[BENCH_BLOCK],
+            best[BENCH_SAMPLE] / best[BENCH_FLOAT]);
+    fclose(ff);
+    return 0;
+}
@@ -29,6 +29,7 @@
 #include <LabJackM.h>   // duh
 #include <stdint.h>     // being careful about bit widths
 #include <sys/sysinfo.h>    // for ram overload checking
+#include <sys/mman.h>   // for the persistent buffer pool
 #include "lconfig.h"
 #include "lcmap.h"
 
@@ -114,6 +115,10 @@ static const char lc_font_cyan[] =  LC_FONT_CYAN;
 // Bold font
 static const char lc_font_bold[] =  LC_FONT_BOLD;
 
+// Register names for the LC_EF_REG_XXX indices
+static const char *lc_ef_regnames[LC_EF_NREG] = {
+    "DIO%d_EF_READ_A", "DIO%d_EF_READ_B", "DIO%d_EF_CONFIG_A",
+    "DIO%d_EF_CONFIG_B", "DIO%d_EF_CONFIG_C", "DIO%d_EF_ENABLE"};
 
 
 #define SHOW_PARAM "    %-18s : "
@@ -137,6 +142,84 @@ double difftime_ms(struct timeval *a, struct timeval *b){
     return ((double)((a->tv_sec - b->tv_sec)*1000)) - ((double)(a->tv_usec - b->tv_usec))/1000;
 }
 
+// Powers of ten used by sprint_e6(); populated on the first call
+#define E6_PMIN -310
+#define E6_PMAX 330
+static long double e6_pow10[E6_PMAX - E6_PMIN + 1];
+static int e6_init = 0;
+
+// Write VALUE into BUF exactly as sprintf(BUF, "%.6e", VALUE) would, but 
+// without the overhead of parsing a format string.  Values close enough to
+// a rounding boundary that the scaling error could matter, as well as zero,
+// infinite, NaN, and subnormal values, are passed on to snprintf().  BUF must
+// have room for at least LCONF_E6_MAX characters.  Returns the number of 
+// characters written, not including the terminating null.
+int sprint_e6(char *buf, double value){
+    long double y, frac;
+    unsigned long m;
+    double a;
+    int e, k, ii;
+    char *c;
+    
+    if(!e6_init){
+        for(k=E6_PMIN; k<=E6_PMAX; k++)
+            e6_pow10[k - E6_PMIN] = powl(10.0L, k);
+        e6_init = 1;
+    }
+    
+    a = fabs(value);
+    if(!isfinite(value) || a < 1e-300 || a > 1e300)
+        return snprintf(buf, LCONF_E6_MAX, "%.6e", value);
+    
+    // Scale the value to a 7-digit integer.  The exponent from log10() can be
+    // off by one near powers of ten, so check the result.
+    e = (int) floor(log10(a));
+    y = a * e6_pow10[6 - e - E6_PMIN];
+    if(y < 1e6L){
+        e--;
+        y = a * e6_pow10[6 - e - E6_PMIN];
+    }else if(y >= 1e7L){
+        e++;
+        y = a * e6_pow10[6 - e - E6_PMIN];
+    }
+    m = (unsigned long) y;
+    frac = y - m;
+    // Too close to call?  Let the library work it out from the exact value.
+    if(fabsl(frac - 0.5L) < 1e-6L)
+        return snprintf(buf, LCONF_E6_MAX, "%.6e", value);
+    if(frac > 0.5L)
+        m++;
+    if(m >= 10000000){
+        m /= 10;
+        e++;
+    }
+    
+    c = buf;
+    if(signbit(value))
+        *c++ = '-';
+    *c++ = '0' + m / 1000000;
+    *c++ = '.';
+    for(ii=6; ii>0; ii--){
+        c[ii-1] = '0' + m % 10;
+        m /= 10;
+    }
+    c += 6;
+    *c++ = 'e';
+    if(e < 0){
+        *c++ = '-';
+        e = -e;
+    }else
+        *c++ = '+';
+    if(e >= 100){
+        *c++ = '0' + e / 100;
+        e %= 100;
+    }
+    *c++ = '0' + e / 10;
+    *c++ = '0' + e % 10;
+    *c = '\0';
+    return c - buf;
+}
+
 void strlower(char* target){
     char *a;
     unsigned int N = 0;
@@ -319,6 +402,8 @@ void init_config(lc_devconf_t* dconf){
     // Flexible IO
     dconf->nefch = 0;
     dconf->effrequency = 0.;
+    dconf->efroll = 0;
+    dconf->efdiv = 0;
     for(efnum=0; efnum<LCONF_MAX_NEFCH; efnum++){
         dconf->efch[efnum].channel = -1;
         dconf->efch[efnum].signal = LC_EF_NONE;
@@ -341,6 +426,20 @@ void init_config(lc_devconf_t* dconf){
         dconf->comch[comnum].rate = -1;
     }
     dconf->RB.buffer=NULL;
+    dconf->RB.flags = 0;
+    dconf->RB.size_bytes = 0;
+    dconf->RB.nalloc = 0;
+    dconf->RB.touch_ms = 0.;
+    dconf->RB.blocks = 0;
+    dconf->RB.wstage = NULL;
+    dconf->RB.rstage = NULL;
+    dconf->RB.rstage_block = 0;
+    dconf->RB.stage_samples = 0;
+    // Acquisition thread
+    dconf->sthread_active = 0;
+    dconf->sthread_run = 0;
+    dconf->sthread_err = LCONF_NOERR;
+    dconf->scontinuous = 0;
 }
 
 
@@ -367,19 +466,134 @@ int test_digital(lc_devconf_t *dconf){
 }
 
 
+// The size of a single sample in the buffer
+unsigned int sample_bytes(lc_ringbuf_t* RB){
+    return (RB->flags & LC_RB_FLOAT) ? sizeof(float) : sizeof(double);
+}
+
+// Release the buffer memory regardless of the pool settings
+void free_buffer(lc_ringbuf_t* RB){
+    // Free the staging blocks used by compact buffers
+    if(RB->wstage){
+        free(RB->wstage);
+        RB->wstage = NULL;
+    }
+    if(RB->rstage){
+        free(RB->rstage);
+        RB->rstage = NULL;
+    }
+    RB->stage_samples = 0;
+    if(RB->buffer){
+        // Pool buffers are mapped directly so they can be locked and backed
+        // by huge pages.  Others come from malloc().
+        if(RB->flags & LC_RB_POOL){
+            if(RB->flags & LC_RB_MLOCK)
+                munlock(RB->buffer, RB->size_bytes);
+            munmap(RB->buffer, RB->size_bytes);
+        }else
+            free(RB->buffer);
+        RB->buffer = NULL;
+    }
+    RB->size_bytes = 0;
+}
+
+// Allocate BYTES of buffer memory.  Pool buffers are pre-faulted, and the
+// time required is recorded so the application can confirm the cost is only
+// paid once.
+int alloc_buffer(lc_ringbuf_t* RB, long unsigned int bytes){
+    struct sysinfo sinf;
+    struct timeval t0, t1;
+    void *buffer;
+
+    // Do some sanity checking on the buffer size
+    sysinfo(&sinf);
+    if(sinf.freeram * 0.9 < bytes){
+        print_error("INIT_BUFFER: Not enough available memory: aborting!\n");
+        RB->buffer = NULL;
+        return LCONF_ERROR;
+    }
+    
+    if(!(RB->flags & LC_RB_POOL)){
+        RB->buffer = malloc(bytes);
+        RB->size_bytes = bytes;
+        RB->nalloc++;
+        return RB->buffer ? LCONF_NOERR : LCONF_ERROR;
+    }
+    
+    buffer = MAP_FAILED;
+    // Try for explicit huge pages first; fall back to transparent huge pages
+    if(RB->flags & LC_RB_HUGE){
+        bytes = (bytes + LCONF_HUGEPAGE_BYTES - 1) / LCONF_HUGEPAGE_BYTES * LCONF_HUGEPAGE_BYTES;
+        buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if(buffer == MAP_FAILED){
+        buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(buffer == MAP_FAILED){
+            print_error("INIT_BUFFER: Failed to map %lu bytes for the buffer pool.\n", bytes);
+            RB->buffer = NULL;
+            return LCONF_ERROR;
+        }
+        if(RB->flags & LC_RB_HUGE)
+            madvise(buffer, bytes, MADV_HUGEPAGE);
+    }
+    RB->buffer = buffer;
+    RB->size_bytes = bytes;
+    RB->nalloc++;
+    
+    // Touch every page now so that the stream doesn't fault them in later
+    gettimeofday(&t0, NULL);
+    if(RB->flags & LC_RB_MLOCK){
+        if(mlock(buffer, bytes)){
+            print_warning("INIT_BUFFER::WARNING:: Failed to lock the buffer pool in RAM.\n"\
+                    "Check the RLIMIT_MEMLOCK limit (ulimit -l).\n");
+            RB->flags &= ~LC_RB_MLOCK;
+        }
+    }
+    memset(buffer, 0, bytes);
+    gettimeofday(&t1, NULL);
+    RB->touch_ms = (t1.tv_sec - t0.tv_sec)*1e3 + (t1.tv_usec - t0.tv_usec)*1e-3;
+    return LCONF_NOERR;
+}
+
 // Initialization declares the buffer memory and initializes all
 // internal variables to describe the buffer's size and read/write oeprations
+// When the buffer belongs to a pool, memory from a prior stream is reused if
+// it is large enough.
 int init_buffer(lc_ringbuf_t* RB,    // Ring buffer struct to initialize
                 const unsigned int channels, // The number of channels in the stream
                 const unsigned int samples_per_read, // The samples (scans) per R/W block
                 const unsigned int blocks){ // The number of R/W blocks to buffer
     
-    struct sysinfo sinf;
     long unsigned int bytes;
 
+    bytes = ((long unsigned int) samples_per_read) * channels * blocks * sample_bytes(RB);
     if(RB->buffer){
-        print_error("lc_ringbuf_t: Buffer not free!\n");
-        return LCONF_ERROR;
+        if(!(RB->flags & LC_RB_POOL)){
+            print_error("lc_ringbuf_t: Buffer not free!\n");
+            return LCONF_ERROR;
+        // If the pool is too small, start over
+        }else if(RB->size_bytes < bytes || 
+                ((RB->flags & LC_RB_FLOAT) && RB->stage_samples < samples_per_read * channels))
+            free_buffer(RB);
+    }
+    
+    if(!RB->buffer){
+        if(alloc_buffer(RB, bytes))
+            return LCONF_ERROR;
+        // Compact buffers need a block of doubles on either side: one for
+        // LJM to write into, and one to present to the reader.
+        if(RB->flags & LC_RB_FLOAT){
+            RB->stage_samples = samples_per_read * channels;
+            RB->wstage = malloc(RB->stage_samples * sizeof(double));
+            RB->rstage = malloc(RB->stage_samples * sizeof(double));
+            if(!RB->wstage || !RB->rstage){
+                print_error("INIT_BUFFER: Failed to allocate the staging blocks.\n");
+                free_buffer(RB);
+                return LCONF_ERROR;
+            }
+        }
     }
 
     RB->samples_per_read = samples_per_read;
@@ -387,93 +601,117 @@ int init_buffer(lc_ringbuf_t* RB,    // Ring buffer struct to initialize
     RB->samples_streamed = 0;
     RB->channels = channels;
     RB->blocksize_samples = samples_per_read * channels;
+    RB->blocks = blocks;
     RB->size_samples = RB->blocksize_samples * blocks;
-    RB->read = 0;
-    RB->write = 0;
-    // Do some sanity checking on the buffer size
-    sysinfo(&sinf);
-    bytes = RB->size_samples * sizeof(double);
-    if(sinf.freeram * 0.9 < bytes){
-        print_error("INIT_BUFFER: Not enough available memory: aborting!\n");
-        RB->buffer = NULL;
-        return LCONF_ERROR;
-    }
-    RB->buffer = malloc(bytes);
+    RB->blocks_read = 0;
+    RB->blocks_written = 0;
+    RB->rstage_block = 0;
     return LCONF_NOERR;
 }
 
+// The block counts are shared between the acquisition thread and the 
+// application thread.  Each is only ever advanced by one of them, so it is 
+// enough to publish them with release/acquire ordering.
 int isempty_buffer(lc_ringbuf_t* RB){
-    return (RB->read == RB->write);
+    return (__atomic_load_n(&RB->blocks_written, __ATOMIC_ACQUIRE) == 
+            __atomic_load_n(&RB->blocks_read, __ATOMIC_ACQUIRE));
 }
 
 int isfull_buffer(lc_ringbuf_t* RB){
-    return (RB->read == RB->size_samples);
+    return (__atomic_load_n(&RB->blocks_written, __ATOMIC_ACQUIRE) - 
+            __atomic_load_n(&RB->blocks_read, __ATOMIC_ACQUIRE) >= RB->blocks);
+}
+
+// Returns a pointer to the start of block INDEX in the buffer memory
+void* get_block(lc_ringbuf_t* RB, unsigned long index){
+    return (char*)RB->buffer + 
+        (index % RB->blocks) * RB->blocksize_samples * sample_bytes(RB);
 }
 
 // Returns a pointer to the start of the next block to be written
+// Compact buffers are written through the staging block
 double* get_write_buffer(lc_ringbuf_t* RB){
-    if(RB->buffer == NULL)
+    if(RB->buffer == NULL || RB->blocks == 0)
         return NULL;
-    return &RB->buffer[RB->write];
+    if(RB->flags & LC_RB_FLOAT)
+        return RB->wstage;
+    return get_block(RB, RB->blocks_written);
 }
 
 // Writing to the buffer is done externally by the LJM module, but after the
 // data is written, the buffer variables need to be advanced appropriately.
 void service_write_buffer(lc_ringbuf_t* RB){
-    // advance the write index
-    RB->write += RB->blocksize_samples;
-    RB->samples_streamed += RB->samples_per_read;
-    // Check for wrapping
-    if(RB->write + RB->blocksize_samples > RB->size_samples)
-        RB->write = 0;
-    // If the buffer was just filled
-    if(RB->write == RB->read)
-        RB->read = RB->size_samples;
+    unsigned int index;
+    float *block;
+    
+    // Narrow the staged samples into the buffer
+    if(RB->flags & LC_RB_FLOAT){
+        block = get_block(RB, RB->blocks_written);
+        for(index=0; index<RB->blocksize_samples; index++)
+            block[index] = (float) RB->wstage[index];
+    }
+    __atomic_store_n(&RB->samples_streamed, 
+            RB->samples_streamed + RB->samples_per_read, __ATOMIC_RELEASE);
+    // If the buffer was already full, the oldest block was just overwritten.
+    // This is only permitted when the reader is in the same thread.
+    if(isfull_buffer(RB))
+        RB->blocks_read++;
+    // Publish the new block
+    __atomic_store_n(&RB->blocks_written, RB->blocks_written + 1, __ATOMIC_RELEASE);
 }
 
 // Returns a pointer to the start of the next block to be read
 // returns NULL if the buffer is empty
+// Compact buffers are widened into the staging block.  A block that is 
+// peeked and then read is only widened once.
 double* get_read_buffer(lc_ringbuf_t* RB){
-    if(RB->buffer == NULL)
+    unsigned int index;
+    float *block;
+    
+    if(RB->buffer == NULL || isempty_buffer(RB))
         return NULL;
-    // if the buffer is full
-    if(RB->read == RB->size_samples)
-        return &RB->buffer[RB->write];
-    // if the buffer is empty
-    else if(RB->read == RB->write)
+    if(RB->flags & LC_RB_FLOAT){
+        if(RB->rstage_block != RB->blocks_read + 1){
+            block = get_block(RB, RB->blocks_read);
+            for(index=0; index<RB->blocksize_samples; index++)
+                RB->rstage[index] = block[index];
+            RB->rstage_block = RB->blocks_read + 1;
+        }
+        return RB->rstage;
+    }
+    return get_block(RB, RB->blocks_read);
+}
+
+// Returns a pointer to the next compact block to be read without widening it
+// returns NULL if the buffer is empty or is not compact
+float* get_read_float(lc_ringbuf_t* RB){
+    if(RB->buffer == NULL || !(RB->flags & LC_RB_FLOAT) || isempty_buffer(RB))
         return NULL;
-    // Normal operation
-    else
-        return &RB->buffer[RB->read];
+    return get_block(RB, RB->blocks_read);
 }
 
 // Updates the buffer's read index once a read operation is complete.
 void service_read_buffer(lc_ringbuf_t *RB){
-    // if the buffer is full
-    if(RB->read == RB->size_samples)
-        RB->read = RB->write;
     // If the buffer is empty
-    else if(RB->read == RB->write)
+    if(isempty_buffer(RB))
         return;
-    RB->read += RB->blocksize_samples;
     RB->samples_read += RB->samples_per_read;
-    // Check for wrapping
-    if(RB->read + RB->blocksize_samples > RB->size_samples)
-        RB->read = 0;
+    // Release the block back to the writer
+    __atomic_store_n(&RB->blocks_read, RB->blocks_read + 1, __ATOMIC_RELEASE);
 }
 
 // Free the buffer's memory
+// Pool buffers are only reset so the memory can be used again.
 void clean_buffer(lc_ringbuf_t* RB){
-    if(RB->buffer){
-        free(RB->buffer);
-        RB->buffer = NULL;
-    }
+    if(!(RB->flags & LC_RB_POOL))
+        free_buffer(RB);
     RB->samples_per_read = 0;
     RB->channels = 0;
     RB->blocksize_samples = 0;
+    RB->blocks = 0;
     RB->size_samples = 0;
-    RB->read = 0;
-    RB->write = 0;
+    RB->blocks_read = 0;
+    RB->blocks_written = 0;
 }
 
 
@@ -586,7 +824,7 @@ void lc_diochannels(const lc_devconf_t* dconf, int *min, int *max){
 int lc_load_config(lc_devconf_t* dconf, const unsigned int devmax, const char* filename){
     int devnum=-1, ainum=-1, aonum=-1, efnum=-1, comnum=-1;
     int itemp, itemp2, itemp3, itemp4;
-    float ftemp;
+    double ftemp;
     char param[LCONF_MAX_STR], value[LCONF_MAX_STR];
     char metatype;
     char ctemp;
@@ -691,7 +929,7 @@ Found \"%s\"\n", param);
         // The SAMPLEHZ parameter
         //
         }else if(streq(param,"samplehz")){
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal SAMPLEHZ value \"%s\". Expected float.\n",value);
                 loadfail();
             }
@@ -700,7 +938,7 @@ Found \"%s\"\n", param);
         // The SETTLEUS parameter
         //
         }else if(streq(param,"settleus")){
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal SETTLEUS value \"%s\". Expected float.\n",value);
                 loadfail();
             }
@@ -760,7 +998,7 @@ Found \"%s\"\n", param);
                 print_error("LOAD: Cannot set analog input parameters before the first AIchannel parameter.\n");
                 loadfail();
             }
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal AIrange number \"%s\". Expected a float.\n",value);
                 loadfail();
             }
@@ -826,7 +1064,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog input parameters before the first AIchannel parameter.\n");
                 loadfail();
             // Make sure the coefficient is a valid float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal AIcalslope number \"%s\". Expected float.\n",value);
                 loadfail();
             }
@@ -840,7 +1078,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog input parameters before the first AIchannel parameter.\n");
                 loadfail();
             // Make sure the offset is a valid float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal AIcaloffset number \"%s\". Expected float.\n",value);
                 loadfail();
             }
@@ -955,7 +1193,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog output parameters before the first AOchannel parameter.\n");
                 loadfail();
             // Convert the string into a float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: AOfrequency expected float, but found: %s\n", value);
                 loadfail();
             }else if(ftemp<=0){
@@ -971,7 +1209,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog output parameters before the first AOchannel parameter.\n");
                 loadfail();
             // Convert the string into a float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: AOamplitude expected float, but found: %s\n", value);
                 loadfail();
             }
@@ -985,7 +1223,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog output parameters before the first AOchannel parameter.\n");
                 loadfail();
             // Convert the string into a float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: AOoffset expected float, but found: %s\n", value);
                 loadfail();
             }else if(ftemp<0. || ftemp>5.){
@@ -1002,7 +1240,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
                 print_error("LOAD: Cannot set analog output parameters before the first AOchannel parameter.\n");
                 loadfail();
             // Convert the string into a float
-            }else if(sscanf(value,"%f",&ftemp)!=1){
+            }else if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: AOduty expected float but found: %s\n", value);
                 loadfail();
             }else if(ftemp<0. || ftemp>1.){
@@ -1037,7 +1275,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
         // TRIGLEVEL parameter
         //
         }else if(streq(param,"triglevel")){
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: TRIGlevel expected a floating point voltage but found: %s\n", 
                     value);
                 loadfail();
@@ -1069,7 +1307,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
         // EFFREQUENCY parameter
         //
         }else if(streq(param,"effrequency")){
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Got illegal EFfrequency: %s\n",value);
                 loadfail(); 
             }else if(ftemp <= 0.){
@@ -1175,7 +1413,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
         // EFusec
         //
         }else if(streq(param,"efusec")){
-            if(sscanf(value,"%f",&ftemp)==1){
+            if(sscanf(value,"%lf",&ftemp)==1){
                 dconf[devnum].efch[efnum].time = ftemp;
             }else{
                 print_error("LOAD: Illegal EF time parameter. Found: %s\n",value);
@@ -1185,7 +1423,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
         // EFdegrees
         //
         }else if(streq(param,"efdegrees")){
-            if(sscanf(value,"%f",&ftemp)==1){
+            if(sscanf(value,"%lf",&ftemp)==1){
                 dconf[devnum].efch[efnum].phase = ftemp;
             }else{
                 print_error("LOAD: Illegal EF phase parameter. Found: %s\n",value);
@@ -1195,7 +1433,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
         // EFDUTY
         //
         }else if(streq(param,"efduty")){
-            if(sscanf(value,"%f",&ftemp)!=1){
+            if(sscanf(value,"%lf",&ftemp)!=1){
                 print_error("LOAD: Illegal EF duty cycle. Found: %s\n",value);
                 loadfail();
             }else if(ftemp<0. || ftemp>1.){
@@ -1260,7 +1498,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
             if(comnum<0){
                 print_error("LOAD: Cannot set digital communication parameters before the first COMchannel parameter.\n");
                 loadfail();
-            }else if(sscanf(value, "%f", &ftemp)!=1){
+            }else if(sscanf(value, "%lf", &ftemp)!=1){
                 print_error("LOAD: The COMRATE parameter expects a numerical data rate in bits per second.\n    Received : %s\n", value);
                 loadfail();
             }
@@ -1356,7 +1594,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
             lc_put_meta_int(dconf, &param[4], itemp);
         // META float configuration
         }else if(strncmp(param,"flt:",4)==0){
-            sscanf(value,"%f",&ftemp);
+            sscanf(value,"%lf",&ftemp);
             lc_put_meta_flt(dconf, &param[4], ftemp);
         // META string configuration
         }else if(strncmp(param,"str:",4)==0){
@@ -1368,7 +1606,7 @@ even channels they serve.  (e.g. AI0/AI1)\n", itemp, dconf[devnum].aich[ainum].c
             sscanf(value,"%d",&itemp);
             lc_put_meta_int(dconf, param, itemp);
         }else if(metatype == 'f'){
-            sscanf(value,"%f",&ftemp);
+            sscanf(value,"%lf",&ftemp);
             lc_put_meta_flt(dconf, param, ftemp);
         }else if(metatype == 's'){
             lc_put_meta_str(dconf, param, value);
@@ -1699,6 +1937,8 @@ int lc_open(lc_devconf_t* dconf){
 
 int lc_close(lc_devconf_t* dconf){
     int err;
+    // Make sure the acquisition thread is not still using the device
+    lc_stream_thread_stop(dconf);
     if(lc_isopen(dconf)){
         err = LJM_Close(dconf->handle);
         if(err){
@@ -1710,8 +1950,9 @@ int lc_close(lc_devconf_t* dconf){
     dconf->handle = -1;
     dconf->connection_act = -1;
     dconf->device_act = -1;
-    // Clean up the buffer
+    // Clean up the buffer; the pool goes too
     clean_buffer(&dconf->RB);
+    free_buffer(&dconf->RB);
     return err;
 }
 
@@ -1730,7 +1971,7 @@ int lc_upload_config(lc_devconf_t* dconf){
     // Registers for analog output
     int aonum,naoch;
     // Registers for ef configuration
-    int efnum,nefch;
+    int efnum,nefch,regnum;
     unsigned int ef_clk_roll, ef_clk_div;
     // Channel range registers
     int minch, maxch;
@@ -2129,11 +2370,24 @@ int lc_upload_config(lc_devconf_t* dconf){
         // and store it in the effrequency parameter.
         dconf->effrequency = 1e6 * LCONF_CLOCK_MHZ / ef_clk_roll / ef_clk_div;
     }
+    // Keep the clock settings for lc_update_ef()
+    dconf->efroll = ef_clk_roll;
+    dconf->efdiv = ef_clk_div;
     
     // Configure the EF channels
     for(efnum=0; efnum<nefch; efnum++){
         channel = dconf->efch[efnum].channel;
 
+        // Resolve the registers used by lc_update_ef()
+        for(regnum=0; regnum<LC_EF_NREG; regnum++){
+            sprintf(stemp, lc_ef_regnames[regnum], channel);
+            if(LJM_NameToAddress(stemp, &dconf->efch[efnum].reg[regnum], 
+                    &dconf->efch[efnum].regtype[regnum])){
+                print_error("UPLOAD: Failed to find the address of register %s\n", stemp);
+                uploadfail();
+            }
+        }
+
         // Disable the EF channel
         sprintf(stemp, "DIO%d_EF_ENABLE", channel);
         err = err ? err : LJM_eWriteName(handle, stemp, 0);
@@ -2672,140 +2926,151 @@ void lc_show_config(lc_devconf_t* dconf){
 
 
 int lc_update_ef(lc_devconf_t* dconf){
-    int handle, channel, efnum, itemp1, itemp2;
+    int handle, efnum, itemp1, itemp2, errorAddress;
     double ftemp, ftemp1, ftemp2;
-    char stemp[LCONF_MAX_STR];
     unsigned int ef_clk_roll, ef_clk_div;
+    lc_efconf_t *ef;
+    // Read and write transactions
+    int raddr[2*LCONF_MAX_NEFCH], rtype[2*LCONF_MAX_NEFCH];
+    double rvalue[2*LCONF_MAX_NEFCH];
+    int waddr[3*LCONF_MAX_NEFCH], wtype[3*LCONF_MAX_NEFCH];
+    double wvalue[3*LCONF_MAX_NEFCH];
+    int nread = 0, nwrite = 0;
     int err = 0;
 
-    handle = dconf->handle;
+// Queue a register read or write by its LC_EF_REG_XXX index
+#define ef_read(REG) {raddr[nread] = ef->reg[REG]; \
+        rtype[nread] = ef->regtype[REG]; nread++;}
+#define ef_write(REG, VALUE) {waddr[nwrite] = ef->reg[REG]; \
+        wtype[nwrite] = ef->regtype[REG]; wvalue[nwrite] = (VALUE); nwrite++;}
 
-    // Get the roll value
-    err = err ? err : LJM_eReadName(handle, "DIO_EF_CLOCK0_ROLL_VALUE", &ftemp);
-    ef_clk_roll = (unsigned int) ftemp;
-    // Get the divisor
-    err = err ? err : LJM_eReadName(handle, "DIO_EF_CLOCK0_DIVISOR", &ftemp);
-    ef_clk_div = (unsigned int) ftemp;
+    if(dconf->nefch == 0)
+        return LCONF_NOERR;
     
-    // Configure the EF channels
+    handle = dconf->handle;
+    ef_clk_roll = dconf->efroll;
+    ef_clk_div = dconf->efdiv;
+    if(ef_clk_roll == 0 || ef_clk_div == 0){
+        print_error("EF_UPDATE: The configuration has not been uploaded.\n");
+        return LCONF_ERROR;
+    }
+    
+    // Build the read transaction for the input channels and the write
+    // transaction for the outputs.
     for(efnum=0; efnum<dconf->nefch; efnum++){
-        channel = dconf->efch[efnum].channel;
-        switch(dconf->efch[efnum].signal){
+        ef = &dconf->efch[efnum];
+        switch(ef->signal){
         // Pulse-width modulation
         case LC_EF_PWM:
-            // PWM input
-            if(dconf->efch[efnum].direction==LC_EF_INPUT){
-                // Get the time high
-                sprintf(stemp, "DIO%d_EF_READ_A", channel);
-                err = err ? err : LJM_eReadName( handle, stemp, &ftemp);
-                // Get the time low
-                sprintf(stemp, "DIO%d_EF_READ_B", channel);
-                err = err ? err : LJM_eReadName( handle, stemp, &ftemp1);
-                ftemp2 = ftemp + ftemp1;
-
-                dconf->efch[efnum].counts = (unsigned int) ftemp2;
-                dconf->efch[efnum].time = ftemp2 * ef_clk_div / LCONF_CLOCK_MHZ;
-                dconf->efch[efnum].phase = 0.;
-                if(dconf->efch[efnum].edge==LC_EDGE_FALLING){
-                    dconf->efch[efnum].duty = ftemp1 / ftemp2;
-                }else{
-                    dconf->efch[efnum].duty = ftemp / ftemp2;
-                }
-
+            // PWM input: time high and time low
+            if(ef->direction==LC_EF_INPUT){
+                ef_read(LC_EF_REG_READ_A);
+                ef_read(LC_EF_REG_READ_B);
             // PWM output
             }else{
                 // Calculate the start index
                 // Unwrap the phase first (lazy method)
-                while(dconf->efch[efnum].phase<0.)
-                    dconf->efch[efnum].phase += 360.;
-                itemp1 = ef_clk_roll * (dconf->efch[efnum].phase / 360.);
+                while(ef->phase<0.)
+                    ef->phase += 360.;
+                itemp1 = ef_clk_roll * (ef->phase / 360.);
                 itemp1 %= ef_clk_roll;
                 // Calculate the stop index
-                itemp2 = ef_clk_roll * dconf->efch[efnum].duty;
+                itemp2 = ef_clk_roll * ef->duty;
                 itemp2 = (((long int) itemp1) + ((long int) itemp2))%ef_clk_roll;
-                if(dconf->efch[efnum].edge==LC_EDGE_FALLING){
-                    // Write the start index
-                    sprintf(stemp, "DIO%d_EF_CONFIG_B", channel);
-                    err = err ? err : LJM_eWriteName( handle, stemp, itemp2);
-                    // Write the stop index
-                    sprintf(stemp, "DIO%d_EF_CONFIG_A", channel);
-                    err = err ? err : LJM_eWriteName( handle, stemp, itemp1);
+                if(ef->edge==LC_EDGE_FALLING){
+                    // Write the start and stop indices
+                    ef_write(LC_EF_REG_CONFIG_B, itemp2);
+                    ef_write(LC_EF_REG_CONFIG_A, itemp1);
                 }else{
-                    // Write the start index
-                    sprintf(stemp, "DIO%d_EF_CONFIG_B", channel);
-                    err = err ? err : LJM_eWriteName( handle, stemp, itemp1);
-                    // Write the stop index
-                    sprintf(stemp, "DIO%d_EF_CONFIG_A", channel);
-                    err = err ? err : LJM_eWriteName( handle, stemp, itemp2);
+                    ef_write(LC_EF_REG_CONFIG_B, itemp1);
+                    ef_write(LC_EF_REG_CONFIG_A, itemp2);
                 }
-                sprintf(stemp, "DIO%d_EF_ENABLE", channel);
-                err = err ? err : LJM_eWriteName( handle, stemp, 1);
+                ef_write(LC_EF_REG_ENABLE, 1);
             }
         break;
         case LC_EF_COUNT:
             // If this is a counter input
-            if(dconf->efch[efnum].direction == LC_EF_INPUT){
-                sprintf(stemp, "DIO%d_EF_READ_A", channel);
-                err = err ? err : LJM_eReadName( handle, stemp, &ftemp);
-                dconf->efch[efnum].counts = (unsigned int) ftemp;
-                dconf->efch[efnum].time = 0.;
-                dconf->efch[efnum].duty = 0.;
-                dconf->efch[efnum].phase = 0.;
+            if(ef->direction == LC_EF_INPUT){
+                ef_read(LC_EF_REG_READ_A);
             // If this is a pulse output and there are counts to output
-            }else if(dconf->efch[efnum].counts){
-                sprintf(stemp, "DIO%d_EF_CONFIG_C", channel);
-                err = err ? err : LJM_eWriteName( handle, stemp, dconf->efch[efnum].counts);
+            }else if(ef->counts){
+                ef_write(LC_EF_REG_CONFIG_C, ef->counts);
                 // Zero the counts so redundant calls do not generate redundant outputs
-                dconf->efch[efnum].counts = 0;
+                ef->counts = 0;
                 // We used the time parameter to record whether the channel was
                 // already enabled.  If 1, then we need to enable now.
-                if(dconf->efch[efnum].time){
-                    sprintf(stemp, "DIO%d_EF_ENABLE", channel);
-                    err = err ? err : LJM_eWriteName( handle, stemp, 1);
-                    dconf->efch[efnum].time = 0;
+                if(ef->time){
+                    ef_write(LC_EF_REG_ENABLE, 1);
+                    ef->time = 0;
                 }
             }
         break;
         case LC_EF_FREQUENCY:
-            sprintf(stemp, "DIO%d_EF_READ_A", channel);
-            err = err ? err : LJM_eReadName( handle, stemp, &ftemp);
-            dconf->efch[efnum].counts = (unsigned int) ftemp;
-            dconf->efch[efnum].time = ftemp * ef_clk_div / LCONF_CLOCK_MHZ;
-            dconf->efch[efnum].duty = 0.;
-            dconf->efch[efnum].phase = 0.;
-        break;
         case LC_EF_PHASE:
-            sprintf(stemp, "DIO%d_EF_READ_A", channel);
-            err = err ? err : LJM_eReadName( handle, stemp, &ftemp);
-            dconf->efch[efnum].counts = (unsigned int) ftemp;
-            dconf->efch[efnum].time = ftemp * ef_clk_div / LCONF_CLOCK_MHZ;
-            dconf->efch[efnum].duty = 0.;
-            dconf->efch[efnum].phase = 0.;
-        break;
         case LC_EF_QUADRATURE:
-            sprintf(stemp, "DIO%d_EF_READ_A", channel);
-            err = err ? err : LJM_eReadName( handle, stemp, &ftemp);
-            dconf->efch[efnum].counts = (unsigned int) ftemp;
-            dconf->efch[efnum].time = 0;
-            dconf->efch[efnum].duty = 0.;
-            dconf->efch[efnum].phase = 0.;
+            ef_read(LC_EF_REG_READ_A);
         break;
         default:
             // No AOsignal
         break;
         }
-        if(err){
-            print_error( "EF_UPDATE: Failed while working on EF channel %d\n.", channel);
-            break;
-        }
     }
-
+#undef ef_read
+#undef ef_write
+
+    // Do the transactions
+    if(nread)
+        err = LJM_eReadAddresses(handle, nread, raddr, rtype, rvalue, &errorAddress);
+    if(nwrite)
+        err = err ? err : LJM_eWriteAddresses(handle, nwrite, waddr, wtype, wvalue, &errorAddress);
     if(err){
         print_error("LCONFIG: Error updating Flexible IO parameters.\n");
+        print_error("EF_UPDATE: Failed at register address %d.\n", errorAddress);
         LJM_ErrorToString(err, err_str);
         print_error("%s\n",err_str);
         return LCONF_ERROR;
     }
+    
+    // Distribute the measurements in the same order they were requested
+    nread = 0;
+    for(efnum=0; efnum<dconf->nefch; efnum++){
+        ef = &dconf->efch[efnum];
+        if(ef->direction != LC_EF_INPUT)
+            continue;
+        switch(ef->signal){
+        case LC_EF_PWM:
+            ftemp = rvalue[nread++];
+            ftemp1 = rvalue[nread++];
+            ftemp2 = ftemp + ftemp1;
+            ef->counts = (unsigned int) ftemp2;
+            ef->time = ftemp2 * ef_clk_div / LCONF_CLOCK_MHZ;
+            ef->phase = 0.;
+            if(ef->edge==LC_EDGE_FALLING){
+                ef->duty = ftemp1 / ftemp2;
+            }else{
+                ef->duty = ftemp / ftemp2;
+            }
+        break;
+        case LC_EF_COUNT:
+        case LC_EF_QUADRATURE:
+            ftemp = rvalue[nread++];
+            ef->counts = (unsigned int) ftemp;
+            ef->time = 0.;
+            ef->duty = 0.;
+            ef->phase = 0.;
+        break;
+        case LC_EF_FREQUENCY:
+        case LC_EF_PHASE:
+            ftemp = rvalue[nread++];
+            ef->counts = (unsigned int) ftemp;
+            ef->time = ftemp * ef_clk_div / LCONF_CLOCK_MHZ;
+            ef->duty = 0.;
+            ef->phase = 0.;
+        break;
+        default:
+        break;
+        }
+    }
     return LCONF_NOERR;
 }
 
@@ -3220,26 +3485,19 @@ void lc_stream_status(lc_devconf_t* dconf,
         unsigned int *samples_waiting){
 
     if(dconf->RB.buffer){
-        *samples_streamed = dconf->RB.samples_streamed;
+        *samples_streamed = __atomic_load_n(&dconf->RB.samples_streamed, __ATOMIC_ACQUIRE);
         *samples_read = dconf->RB.samples_read;
-        // Case out the read and write status
-        if(dconf->RB.read == dconf->RB.size_samples)
-            *samples_waiting = dconf->RB.size_samples / dconf->RB.channels;
-        // If read has wrapped around the end of the buffer
-        else if(dconf->RB.write < dconf->RB.read)
-            *samples_waiting = (dconf->RB.size_samples -\
-                dconf->RB.read + dconf->RB.write)/\
-                dconf->RB.channels;
-        else
-            *samples_waiting = (dconf->RB.write-dconf->RB.read)/\
-                dconf->RB.channels;
+        *samples_waiting = (__atomic_load_n(&dconf->RB.blocks_written, __ATOMIC_ACQUIRE) -\
+                dconf->RB.blocks_read) * dconf->RB.samples_per_read;
     }
 }
 
 
 
 int lc_stream_iscomplete(lc_devconf_t* dconf){
-    return (dconf->RB.samples_streamed > dconf->nsample);
+    if(dconf->scontinuous)
+        return 0;
+    return (__atomic_load_n(&dconf->RB.samples_streamed, __ATOMIC_ACQUIRE) > dconf->nsample);
 }
 
 
@@ -3252,6 +3510,53 @@ int lc_stream_isfull(lc_devconf_t* dconf){
 }
 
 
+// The number of R/W blocks needed in the buffer.  This is calculated from
+// the larger of the pretrigger buffer size and the number of samples plus 1.
+unsigned int stream_blocks(lc_devconf_t* dconf, unsigned int samples_per_read){
+    unsigned int blocks;
+    blocks = dconf->trigpre > dconf->nsample ? 
+                dconf->trigpre : dconf->nsample;
+    return (blocks/samples_per_read) + 1;
+}
+
+
+void lc_stream_continuous(lc_devconf_t* dconf, int enable){
+    dconf->scontinuous = (enable != 0);
+}
+
+
+int lc_stream_pool(lc_devconf_t* dconf, int samples_per_read, unsigned int flags){
+    if(samples_per_read <= 0)
+        samples_per_read = LCONF_SAMPLES_PER_READ;
+    
+    if(dconf->RB.buffer && dconf->RB.blocks){
+        print_error("STREAM_POOL: Cannot configure the buffer pool while a stream is using it.\n");
+        return LCONF_ERROR;
+    }
+    // Start from scratch with the new settings
+    free_buffer(&dconf->RB);
+    dconf->RB.flags = flags | LC_RB_POOL;
+    if(init_buffer(&dconf->RB, 
+                lc_nistream(dconf), 
+                samples_per_read, 
+                stream_blocks(dconf, samples_per_read))){
+        print_error("STREAM_POOL: Failed to allocate the buffer pool.\n");
+        return LCONF_ERROR;
+    }
+    // Leave the buffer reset and ready for LC_STREAM_START()
+    clean_buffer(&dconf->RB);
+    return LCONF_NOERR;
+}
+
+
+void lc_stream_pool_status(lc_devconf_t* dconf, 
+        unsigned int *nalloc, double *touch_ms, unsigned long *bytes){
+    *nalloc = dconf->RB.nalloc;
+    *touch_ms = dconf->RB.touch_ms;
+    *bytes = dconf->RB.size_bytes;
+}
+
+
 int lc_stream_start(lc_devconf_t* dconf, int samples_per_read){
     int ainum,aonum,efnum,index,err=0;
     int stlist[LCONF_MAX_STCH];
@@ -3326,9 +3631,7 @@ int lc_stream_start(lc_devconf_t* dconf, int samples_per_read){
     }
 
     // Determine the number of R/W blocks in the buffer
-    blocks = dconf->trigpre > dconf->nsample ? 
-                dconf->trigpre : dconf->nsample;
-    blocks = (blocks/samples_per_read) + 1;
+    blocks = stream_blocks(dconf, samples_per_read);
 
     // Configure the ring buffer
     // The number of buffer R/W blocks is calculated from the pretrigger
@@ -3361,7 +3664,10 @@ int lc_stream_start(lc_devconf_t* dconf, int samples_per_read){
 }
 
 
-int lc_stream_service(lc_devconf_t* dconf){
+// Read a single block from the device into the ring buffer and tend the 
+// trigger.  This is the work of LC_STREAM_SERVICE(), and it is executed 
+// either by the application thread or by the acquisition thread.
+int stream_read_block(lc_devconf_t* dconf){
     int dev_backlog, ljm_backlog, size, err;
     int index, this;
     double ftemp;
@@ -3479,6 +3785,80 @@ int lc_stream_service(lc_devconf_t* dconf){
 }
 
 
+// The acquisition thread loop
+// Read blocks until the stream is complete, the application asks us to 
+// stop, or there is an error.  Never overwrite unread data.
+void* stream_thread(void *arg){
+    lc_devconf_t *dconf = (lc_devconf_t*) arg;
+    
+    while(__atomic_load_n(&dconf->sthread_run, __ATOMIC_ACQUIRE) && 
+            !lc_stream_iscomplete(dconf)){
+        // If the buffer is full, wait for the reader to catch up
+        if(isfull_buffer(&dconf->RB)){
+            usleep(LCONF_THREAD_POLL_US);
+        }else if(stream_read_block(dconf)){
+            __atomic_store_n(&dconf->sthread_err, LCONF_ERROR, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    __atomic_store_n(&dconf->sthread_run, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+int lc_stream_service(lc_devconf_t* dconf){
+    // If the acquisition thread is doing the reading, just wait for data
+    if(dconf->sthread_active){
+        while(isempty_buffer(&dconf->RB) && 
+                __atomic_load_n(&dconf->sthread_run, __ATOMIC_ACQUIRE))
+            usleep(LCONF_THREAD_POLL_US);
+        return __atomic_load_n(&dconf->sthread_err, __ATOMIC_ACQUIRE);
+    }
+    return stream_read_block(dconf);
+}
+
+
+int lc_stream_thread_start(lc_devconf_t* dconf){
+    int err;
+    
+    if(dconf->sthread_active){
+        print_error("STREAM_THREAD_START: The acquisition thread is already running.\n");
+        return LCONF_ERROR;
+    }else if(dconf->RB.buffer == NULL || dconf->RB.blocks == 0){
+        print_error("STREAM_THREAD_START: The stream has not been started.\n");
+        return LCONF_ERROR;
+    }else if(dconf->trigchannel >= 0 && dconf->trigchannel < LCONF_TRIG_EFOFFSET){
+        print_error("STREAM_THREAD_START: Software triggers are not supported by the acquisition thread.\n");
+        return LCONF_ERROR;
+    }
+    
+    dconf->sthread_err = LCONF_NOERR;
+    dconf->sthread_run = 1;
+    err = pthread_create(&dconf->sthread, NULL, stream_thread, dconf);
+    if(err){
+        print_error("STREAM_THREAD_START: Failed to create the acquisition thread: %s\n", strerror(err));
+        dconf->sthread_run = 0;
+        return LCONF_ERROR;
+    }
+    dconf->sthread_active = 1;
+    return LCONF_NOERR;
+}
+
+
+int lc_stream_thread_stop(lc_devconf_t* dconf){
+    if(!dconf->sthread_active)
+        return LCONF_NOERR;
+    __atomic_store_n(&dconf->sthread_run, 0, __ATOMIC_RELEASE);
+    pthread_join(dconf->sthread, NULL);
+    dconf->sthread_active = 0;
+    if(dconf->sthread_err){
+        print_error("STREAM_THREAD_STOP: The acquisition thread reported an error.\n");
+        return LCONF_ERROR;
+    }
+    return LCONF_NOERR;
+}
+
+
 int lc_stream_read(lc_devconf_t* dconf,
     double **data, unsigned int *channels, unsigned int *samples_per_read){
     
@@ -3492,8 +3872,49 @@ int lc_stream_read(lc_devconf_t* dconf,
 }
 
 
+int lc_stream_peek(lc_devconf_t* dconf,
+    double **data, unsigned int *channels, unsigned int *samples_per_read){
+    
+    (*data) = get_read_buffer(&dconf->RB);
+    (*channels) = dconf->RB.channels;
+    (*samples_per_read) = dconf->RB.samples_per_read;
+    if(*data)
+        return LCONF_NOERR;
+    return LCONF_ERROR;
+}
+
+
+int lc_stream_read_float(lc_devconf_t* dconf,
+    const float **data, unsigned int *channels, unsigned int *samples_per_read){
+    
+    (*data) = get_read_float(&dconf->RB);
+    (*channels) = dconf->RB.channels;
+    (*samples_per_read) = dconf->RB.samples_per_read;
+    if(*data){
+        service_read_buffer(&dconf->RB);
+        return LCONF_NOERR;
+    }
+    return LCONF_ERROR;
+}
+
+
+int lc_stream_peek_float(lc_devconf_t* dconf,
+    const float **data, unsigned int *channels, unsigned int *samples_per_read){
+    
+    (*data) = get_read_float(&dconf->RB);
+    (*channels) = dconf->RB.channels;
+    (*samples_per_read) = dconf->RB.samples_per_read;
+    if(*data)
+        return LCONF_NOERR;
+    return LCONF_ERROR;
+}
+
+
 int lc_stream_stop(lc_devconf_t* dconf){
     int err;
+    // Halt the acquisition thread before the stream is pulled out from 
+    // under it.
+    lc_stream_thread_stop(dconf);
     err = LJM_eStreamStop(dconf->handle);
     
     // Deactivate the stream trigger (if it was active)
@@ -3532,27 +3953,52 @@ int lc_datafile_init(lc_devconf_t* dconf, FILE* FF){
 
 
 int lc_datafile_write(lc_devconf_t* dconf, FILE* FF){
-    int err,index,row,ainum;
+    int err,index,row,ainum,count,size;
     unsigned int channels, samples_per_read;
     double *data = NULL;
-    float ftemp;
+    const float *fdata = NULL;
+    float fblock[LCONF_BIN_CHUNK];
+    char cblock[LCONF_ASCII_CHUNK];
+
+    // Compact buffers are already in the binary file format, so the block
+    // can be written straight from the buffer.
+    if(dconf->dataformat == LC_DF_BIN && (dconf->RB.flags & LC_RB_FLOAT)){
+        err = lc_stream_read_float(dconf, &fdata, &channels, &samples_per_read);
+        if(fdata)
+            fwrite(fdata, sizeof(float), channels*samples_per_read, FF);
+        return err;
+    }
 
     err = lc_stream_read(dconf,&data,&channels,&samples_per_read);
     if(data){
         // Write using the ascii format
         if(dconf->dataformat == LC_DF_ASCII){
             index = 0;
-            // Write data one element at a time.
+            count = 0;
+            // Format the data into a character block, and only write when
+            // it is nearly full.
             for(row=0; row<samples_per_read; row++){
-                for(ainum=0; ainum<channels-1; ainum++)
-                    fprintf(FF, "%.6e\t", data[ index++ ]);
-                fprintf(FF, "%.6e\n", data[ index++ ]);
+                for(ainum=0; ainum<channels; ainum++){
+                    if(count > LCONF_ASCII_CHUNK - LCONF_E6_MAX - 1){
+                        fwrite(cblock, 1, count, FF);
+                        count = 0;
+                    }
+                    count += sprint_e6(&cblock[count], data[ index++ ]);
+                    cblock[count++] = (ainum < channels-1) ? '\t' : '\n';
+                }
             }
+            fwrite(cblock, 1, count, FF);
         // Write using binary format
+        // Convert to float in chunks and write each chunk at once
         }else if(dconf->dataformat == LC_DF_BIN){
-            for(index=0; index<channels*samples_per_read; index++){
-                ftemp = (float) data[index];
-                fwrite(&ftemp, sizeof(ftemp), 1, FF);
+            size = channels*samples_per_read;
+            for(index=0; index<size; index+=count){
+                count = size - index;
+                if(count > LCONF_BIN_CHUNK)
+                    count = LCONF_BIN_CHUNK;
+                for(row=0; row<count; row++)
+                    fblock[row] = (float) data[index + row];
+                fwrite(fblock, sizeof(float), count, FF);
             }
         }
     }
@@ -3561,3 +4007,114 @@ int lc_datafile_write(lc_devconf_t* dconf, FILE* FF){
 
 
 
+int lc_archive_open(lc_devconf_t* dconf, lc_archive_t* ar, const char* filename){
+    ar->nentry = 0;
+    ar->active = 0;
+    ar->entry = NULL;
+    ar->FF = fopen(filename, "wb");
+    if(!ar->FF){
+        print_error("ARCHIVE_OPEN: Failed to create the archive: %s\n", filename);
+        return LCONF_ERROR;
+    }
+    ar->maxentry = LCONF_AR_NENTRY;
+    ar->entry = malloc(ar->maxentry * sizeof(lc_arentry_t));
+    if(!ar->entry){
+        print_error("ARCHIVE_OPEN: Failed to allocate the index table.\n");
+        fclose(ar->FF);
+        ar->FF = NULL;
+        return LCONF_ERROR;
+    }
+    return lc_datafile_init(dconf, ar->FF);
+}
+
+
+int lc_archive_begin(lc_archive_t* ar, const int* index, const double* pos){
+    lc_arentry_t *entry;
+    struct timeval now;
+    int ii;
+    
+    if(!ar->FF){
+        print_error("ARCHIVE_BEGIN: The archive is not open.\n");
+        return LCONF_ERROR;
+    }else if(ar->active){
+        print_error("ARCHIVE_BEGIN: The last record was not ended.\n");
+        return LCONF_ERROR;
+    }
+    // Grow the index table if necessary
+    if(ar->nentry >= ar->maxentry){
+        entry = realloc(ar->entry, 2 * ar->maxentry * sizeof(lc_arentry_t));
+        if(!entry){
+            print_error("ARCHIVE_BEGIN: Failed to grow the index table.\n");
+            return LCONF_ERROR;
+        }
+        ar->entry = entry;
+        ar->maxentry *= 2;
+    }
+    entry = &ar->entry[ar->nentry];
+    for(ii=0; ii<3; ii++){
+        entry->index[ii] = index ? index[ii] : 0;
+        entry->pos[ii] = pos ? pos[ii] : 0.;
+    }
+    entry->reserved = 0;
+    gettimeofday(&now, NULL);
+    entry->time = now.tv_sec + 1e-6*now.tv_usec;
+    entry->offset = ftell(ar->FF);
+    entry->bytes = 0;
+    entry->nsample = 0;
+    ar->active = 1;
+    return LCONF_NOERR;
+}
+
+
+int lc_archive_write(lc_devconf_t* dconf, lc_archive_t* ar){
+    unsigned int samples_per_read;
+    
+    if(!ar->active){
+        print_error("ARCHIVE_WRITE: No record has been started.\n");
+        return LCONF_ERROR;
+    }
+    samples_per_read = dconf->RB.samples_per_read;
+    if(lc_datafile_write(dconf, ar->FF))
+        return LCONF_ERROR;
+    ar->entry[ar->nentry].nsample += samples_per_read;
+    return LCONF_NOERR;
+}
+
+
+int lc_archive_end(lc_archive_t* ar){
+    if(!ar->active){
+        print_error("ARCHIVE_END: No record has been started.\n");
+        return LCONF_ERROR;
+    }
+    ar->entry[ar->nentry].bytes = ftell(ar->FF) - ar->entry[ar->nentry].offset;
+    ar->nentry++;
+    ar->active = 0;
+    return LCONF_NOERR;
+}
+
+
+int lc_archive_close(lc_archive_t* ar){
+    lc_arfooter_t footer;
+    int err = LCONF_NOERR;
+    
+    if(!ar->FF)
+        return LCONF_ERROR;
+    // Keep a record that was still in progress
+    if(ar->active)
+        lc_archive_end(ar);
+    
+    footer.index_offset = ftell(ar->FF);
+    footer.nentry = ar->nentry;
+    footer.entry_bytes = sizeof(lc_arentry_t);
+    memcpy(footer.magic, LCONF_AR_MAGIC, sizeof(footer.magic));
+    if(fwrite(ar->entry, sizeof(lc_arentry_t), ar->nentry, ar->FF) != ar->nentry ||
+            fwrite(&footer, sizeof(footer), 1, ar->FF) != 1){
+        print_error("ARCHIVE_CLOSE: Failed to write the archive index.\n");
+        err = LCONF_ERROR;
+    }
+    fclose(ar->FF);
+    ar->FF = NULL;
+    free(ar->entry);
+    ar->entry = NULL;
+    return err;
+}
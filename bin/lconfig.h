@@ -34,10 +34,12 @@ $chmod a+x your_exec.bin
 #define __LCONFIG
 
 #include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <LabJackM.h>
 
 
-#define LCONF_VERSION 4.08   // Track modifications in the header
+#define LCONF_VERSION 4.16   // Track modifications in the header
 /*
 These change logs follow the convention below:
 **LCONF_VERSION
@@ -197,6 +199,52 @@ with init_data_file() and write_data_file() utilities.
 - Transitioned to enumerated meta parameter types isntead of character values
 - Added LC_DEL_META() and LC_GET_META_TYPE()
 - Changed the behavior of LC_GET_META_XXX() to raise an error on incorrect type
+
+** 4.09
+10/2026
+- Replaced the ring buffer read/write indices with running block counts so
+    that the buffer can be shared lock-free by one producer and one consumer.
+- Added LC_STREAM_THREAD_START() and LC_STREAM_THREAD_STOP() to move 
+    LJM_eStreamRead() calls into a dedicated acquisition thread.
+
+** 4.10
+10/2026
+- Added LC_STREAM_POOL() and LC_STREAM_POOL_STATUS() so the ring buffer can 
+    be allocated once and reused by repeated stream start/stop cycles.
+
+** 4.11
+10/2026
+- Added LC_STREAM_CONTINUOUS() for streams that run until they are stopped.
+
+** 4.12
+10/2026
+- Added the LC_RB_FLOAT buffer flag to store stream samples as floats.
+- LC_DATAFILE_WRITE() writes binary data in blocks instead of one sample at
+    a time.
+- LC_DATAFILE_WRITE() formats ASCII data itself instead of calling fprintf()
+    for every sample.  The output is unchanged.
+- Added the LC_ARCHIVE_XXX() functions for writing many data streams with a
+    shared header and a trailing index into a single file.
+
+** 4.13
+10/2026
+- LC_LOAD_CONFIG() parses floating point parameters in double precision.
+    Meta values and calibrations no longer lose digits in the round trip.
+
+** 4.14
+10/2026
+- Added LC_STREAM_PEEK() to inspect a block before it is written.
+
+** 4.15
+10/2026
+- LC_UPLOAD_CONFIG() resolves the EF channel register addresses and keeps
+    the EF clock roll value and divisor.  LC_UPDATE_EF() uses them to do
+    its work in one read and one write transaction.
+
+** 4.16
+10/2026
+- Added LC_STREAM_READ_FLOAT() and LC_STREAM_PEEK_FLOAT() so that LC_RB_FLOAT
+    buffers can be read without widening the samples to double.
 */
 
 #define TWOPI 6.283185307179586
@@ -220,7 +268,12 @@ with init_data_file() and write_data_file() utilities.
 #define LCONF_BACKLOG_THRESHOLD 1024 // raise a warning if the backlog exceeds this number.
 #define LCONF_CLOCK_MHZ 80.0    // Clock frequency in MHz
 #define LCONF_SAMPLES_PER_READ 64  // Data read/write block size
+#define LCONF_BIN_CHUNK 1024    // Samples converted per binary file write
+#define LCONF_ASCII_CHUNK 8192  // Characters formatted per ASCII file write
+#define LCONF_E6_MAX 24         // Longest "%.6e" string, with margin
 #define LCONF_TRIG_EFOFFSET  2000    // Offset in trigger channel number for hardware trigger
+#define LCONF_THREAD_POLL_US 500    // Polling interval for the acquisition thread and its consumer
+#define LCONF_HUGEPAGE_BYTES 0x200000   // Huge page size used to round buffer pool allocations
 
 #define LCONF_SE_NCH 199    // single-ended negative channel number
 
@@ -297,6 +350,15 @@ typedef enum __lc_dataformat_t__ {
     LC_DF_BIN = 1,
 } lc_dataformat_t;
 
+// Indices into the EF channel register table (see LC_EFCONF_T)
+#define LC_EF_REG_READ_A    0
+#define LC_EF_REG_READ_B    1
+#define LC_EF_REG_CONFIG_A  2
+#define LC_EF_REG_CONFIG_B  3
+#define LC_EF_REG_CONFIG_C  4
+#define LC_EF_REG_ENABLE    5
+#define LC_EF_NREG          6
+
 // Flexible Input/Output configuration struct
 // This includes everything needed to configure an extended feature EF channel
 typedef struct __lc_efconf_t__ {
@@ -326,6 +388,10 @@ typedef struct __lc_efconf_t__ {
     double phase;       // Phase parameters (degrees)
     unsigned int counts; // Pulse count
     char label[LCONF_MAX_STR];
+    // Register addresses and types resolved by lc_upload_config() so that
+    // lc_update_ef() does not have to look them up by name.
+    int reg[LC_EF_NREG];
+    int regtype[LC_EF_NREG];
 } lc_efconf_t;
 
 // Digital Communications Configuration Structure
@@ -375,16 +441,42 @@ typedef struct __lc_meta_t__ {
 // Ring Buffer structure
 // The LCONF ring buffer supports reading and writing in R/W blocks that mimic
 // the T7 stream read block.  
+//
+// Rather than read and write indices, the buffer keeps running counts of the 
+// blocks written and read.  The block being written or read is the count 
+// modulo the number of blocks.  The buffer is empty when the counts are equal
+// and full when they differ by BLOCKS.  The writer (producer) only ever 
+// advances BLOCKS_WRITTEN and the reader (consumer) only ever advances 
+// BLOCKS_READ, so the two may safely run in separate threads without a lock.
+// The one exception is that a single-threaded writer will discard the oldest
+// block when the buffer is full.
+// Ring buffer pool flags (see LC_STREAM_POOL)
+#define LC_RB_POOL      0x01    // Keep the buffer memory between streams
+#define LC_RB_MLOCK     0x02    // Lock the buffer memory in RAM
+#define LC_RB_HUGE      0x04    // Back the buffer with huge pages if possible
+#define LC_RB_FLOAT     0x08    // Store samples as float instead of double
+
 typedef struct __lc_ringbuf_t__ {
     unsigned int size_samples;      // length of the buffer array (NOT per channel)
     unsigned int blocksize_samples; // size of each read/write block
+    unsigned int blocks;            // number of read/write blocks in the buffer
     unsigned int samples_per_read;  // samples per channel in each block
     unsigned int samples_read;      // number of samples read since streaming began
     unsigned int samples_streamed;  // number of samples streamed from the T7
     unsigned int channels;          // channels in the stream
-    unsigned int read;              // beginning index of the next read block
-    unsigned int write;             // beginning index of the next write block
-    double* buffer;                 // the buffer array
+    unsigned long blocks_read;      // running count of blocks read
+    unsigned long blocks_written;   // running count of blocks written
+    void* buffer;                   // the buffer array (double or float)
+    // Buffer memory management
+    unsigned int flags;             // LC_RB_XXX pool flags
+    unsigned long size_bytes;       // bytes allocated to the buffer array
+    unsigned int nalloc;            // number of allocations since configuration
+    double touch_ms;                // time spent pre-faulting the last pool allocation
+    // Staging blocks for compact (LC_RB_FLOAT) buffers
+    double* wstage;                 // block written by LJM
+    double* rstage;                 // block presented to the reader
+    unsigned long rstage_block;     // block count+1 held in rstage (0 if none)
+    unsigned int stage_samples;     // length of each staging block
 } lc_ringbuf_t;
 
 // Enumerated type for specifying a device conneciton
@@ -445,6 +537,8 @@ typedef struct __lc_devconf_t__ {
     unsigned int naoch;             // number of configured analog output channels
     // Flexible Input/output
     double effrequency;            // flexible input/output frequency
+    unsigned int efroll;           // EF clock 0 roll value (set on upload)
+    unsigned int efdiv;            // EF clock 0 divisor (set on upload)
     lc_efconf_t efch[LCONF_MAX_NEFCH]; // flexible digital input/output
     unsigned int nefch;            // how many of the EF are configured?
     // Communication
@@ -462,9 +556,51 @@ typedef struct __lc_devconf_t__ {
     // Meta & filestream
     lc_meta_t meta[LCONF_MAX_META];  // *meta parameters
     lc_ringbuf_t RB;                  // ring buffer
+    // Acquisition thread
+    pthread_t sthread;              // acquisition thread handle
+    int sthread_active;             // has the thread been started (and not joined)?
+    int sthread_run;                // cleared to stop the thread; cleared by the thread on exit
+    int sthread_err;                // error status reported by the thread
+    int scontinuous;                // stream until stopped; ignore nsample
 } lc_devconf_t;
 
 
+// ARCHIVE ENTRY AND INDEX TYPES
+//  An archive is a data file with many data records.  It begins with the 
+// usual configuration header and timestamp written by LC_DATAFILE_INIT().
+// The data of each record follow one after the other, and the file ends
+// with an index table of lc_arentry_t structs followed by an 
+// lc_arfooter_t.  Both are written in the machine's native byte order.
+//
+#define LCONF_AR_MAGIC  "LCARCH01"  // Identifies the archive footer
+#define LCONF_AR_NENTRY 256         // Initial length of the index table
+
+typedef struct __lc_arentry_t__ {
+    int32_t index[3];               // Grid indices (x,y,z) of the record
+    int32_t reserved;               // Padding; always zero
+    double pos[3];                  // Position (x,y,z) of the record
+    double time;                    // Unix time when the record began
+    uint64_t offset;                // File offset to the start of the data
+    uint64_t bytes;                 // Length of the data in bytes
+    uint64_t nsample;               // Samples per channel in the data
+} lc_arentry_t;
+
+typedef struct __lc_arfooter_t__ {
+    uint64_t index_offset;          // File offset to the index table
+    uint32_t nentry;                // Number of entries in the index table
+    uint32_t entry_bytes;           // sizeof(lc_arentry_t)
+    char magic[8];                  // LCONF_AR_MAGIC (not null-terminated)
+} lc_arfooter_t;
+
+typedef struct __lc_archive_t__ {
+    FILE *FF;                       // The open archive file
+    lc_arentry_t *entry;            // The index table
+    unsigned int nentry;            // Number of entries written
+    unsigned int maxentry;          // Allocated length of the index table
+    int active;                     // Is a record in progress?
+} lc_archive_t;
+
+
 /*
 .
 .   Prototypes
@@ -1090,6 +1226,10 @@ the appropriate EF channel member variables.
 The clock frequency will NOT be updated.  To change the EFfrequency parameter,
 upload_config() should be re-called.  This will halt acquisition and re-start 
 it.
+
+The register addresses and the clock settings are cached by upload_config(),
+so all of the measurements are read in one transaction, and all of the 
+outputs are written in one transaction.
 */
 int lc_update_ef(lc_devconf_t* dconf);
 
@@ -1184,7 +1324,8 @@ void lc_stream_status(lc_devconf_t* dconf,
 
 /* LC_STREAM_ISCOMPLETE
 Returns 1 to indicate that at least dconf->nsample samples per channel
-have been streamed from the T7.  Returns a 0 otherwise.
+have been streamed from the T7.  Returns a 0 otherwise.  Continuous streams
+(see LC_STREAM_CONTINUOUS) are never complete.
 */
 int lc_stream_iscomplete(lc_devconf_t* dconf);
 
@@ -1216,6 +1357,60 @@ int lc_stream_start(lc_devconf_t* dconf,   // Device array and number
             int samples_per_read);    // how many samples per call to read_data_stream
 
 
+/* LC_STREAM_POOL
+LC_STREAM_POOL_STATUS
+By default, LC_STREAM_START() allocates the ring buffer and LC_STREAM_CLEAN()
+frees it.  Applications that start and stop many short streams can call 
+LC_STREAM_POOL() once before the first stream to allocate a persistent buffer
+instead.  Thereafter, LC_STREAM_START() reuses the memory as long as it is 
+large enough, and LC_STREAM_CLEAN() only resets the buffer.  The memory is 
+released by LC_CLOSE().
+
+SAMPLES_PER_READ should be the same value that will be passed to 
+LC_STREAM_START().  The pool is sized for the current NSAMPLE, TRIGPRE, and 
+stream channel settings, so it should be called after they are final.  The
+FLAGS are a bitwise OR of 
+    LC_RB_MLOCK - Lock the buffer in RAM so it can never be paged out.  This 
+                is subject to the RLIMIT_MEMLOCK limit.  If it fails, a warning
+                is printed and the buffer is used unlocked.
+    LC_RB_HUGE  - Request huge pages for the buffer.  Explicit huge pages are
+                tried first, then transparent huge pages.
+    LC_RB_FLOAT - Store the samples in the buffer as single-precision floats.
+                This halves the memory required for NSAMPLE samples.  Float
+                is already the precision of binary data files, and the
+                16-bit digital input word is represented exactly.  The 
+                samples are still presented as doubles by LC_STREAM_READ(),
+                one block at a time, at the cost of a conversion pass.  
+                LC_STREAM_READ_FLOAT() and LC_DATAFILE_WRITE() (for binary
+                files) use the float block directly.
+or 0.  Pool memory is pre-faulted when it is allocated, so the stream does not
+pay for page faults.
+
+LC_STREAM_POOL_STATUS() reports NALLOC, the number of times the buffer has
+been allocated, TOUCH_MS, the time spent pre-faulting the most recent 
+allocation in milliseconds, and BYTES, the size of the allocation.  An 
+application can check NALLOC before and after a loop to confirm that no
+allocations occurred.
+*/
+int lc_stream_pool(lc_devconf_t* dconf, int samples_per_read, unsigned int flags);
+
+void lc_stream_pool_status(lc_devconf_t* dconf, 
+        unsigned int *nalloc, double *touch_ms, unsigned long *bytes);
+
+/* LC_STREAM_CONTINUOUS
+Normally, a stream is complete when NSAMPLE samples per channel have been 
+collected.  When ENABLE is non-zero, LC_STREAM_ISCOMPLETE() always returns 0
+so the stream runs until LC_STREAM_STOP() is called.  NSAMPLE still sets the
+size of the ring buffer, so the application must read the data as they 
+arrive.  That is best done with the acquisition thread 
+(LC_STREAM_THREAD_START), which waits for space in the buffer.  Without the
+thread, the oldest unread data are overwritten when the buffer is full.
+
+Continuous streaming should be set before LC_STREAM_START(), and it remains
+in effect until it is disabled.
+*/
+void lc_stream_continuous(lc_devconf_t* dconf, int enable);
+
 /*LC_STREAM_SERVICE
 Service an active data stream by reading another block of data an checking for
 trigger events (if a software trigger has been configured).  This is a blocking
@@ -1277,6 +1472,74 @@ if(data){
 int lc_stream_read(lc_devconf_t* dconf, double **data, 
         unsigned int *channels, unsigned int *samples_per_read);
 
+/*LC_STREAM_PEEK
+Returns the same block that LC_STREAM_READ() would, but the block is not 
+released, so the next call to LC_STREAM_READ() or LC_DATAFILE_WRITE() will 
+return it again.  This lets the application inspect the data before they 
+are written to a file.  The data pointer is only valid until the next read
+operation.
+*/
+int lc_stream_peek(lc_devconf_t* dconf, double **data, 
+        unsigned int *channels, unsigned int *samples_per_read);
+
+/*LC_STREAM_READ_FLOAT
+LC_STREAM_PEEK_FLOAT
+These work just like LC_STREAM_READ() and LC_STREAM_PEEK(), but DATA points
+to the single-precision block in a compact (LC_RB_FLOAT) buffer, so there is
+no pass to widen the samples to double.  They return LCONF_ERROR and set 
+DATA to NULL if the buffer was not allocated with LC_RB_FLOAT or if it is 
+empty.  The block is only valid until the acquisition thread (or the next
+LC_STREAM_SERVICE()) could overwrite it, so it should be used before the 
+next read operation.
+*/
+int lc_stream_read_float(lc_devconf_t* dconf, const float **data, 
+        unsigned int *channels, unsigned int *samples_per_read);
+
+int lc_stream_peek_float(lc_devconf_t* dconf, const float **data, 
+        unsigned int *channels, unsigned int *samples_per_read);
+
+/*LC_STREAM_THREAD_START
+LC_STREAM_THREAD_STOP
+Once a stream has been started by LC_STREAM_START(), LC_STREAM_THREAD_START()
+launches a dedicated acquisition thread that reads blocks from the T7 into the
+ring buffer as they arrive.  The application thread is then free to consume 
+the data with LC_STREAM_READ() or LC_DATAFILE_WRITE() while the device is 
+still streaming.  The acquisition thread is the only writer and the 
+application is the only reader, so no locks are needed.
+
+While the thread is active, LC_STREAM_SERVICE() no longer reads from the 
+device.  Instead, it blocks until new data are available in the buffer or 
+until the thread has exited, and it returns the thread's error status.  This
+means that the familiar loop still works:
+
+lc_stream_start(&dconf, -1);
+lc_stream_thread_start(&dconf);
+while(!lc_stream_iscomplete(&dconf) || !lc_stream_isempty(&dconf)){
+    if(lc_stream_service(&dconf))
+        ... handle the error ...
+    while(!lc_stream_isempty(&dconf))
+        lc_datafile_write(&dconf, FF);
+}
+lc_stream_stop(&dconf);
+
+The thread exits on its own once NSAMPLE samples have been streamed, or when
+LC_STREAM_THREAD_STOP() is called.  Unlike the single-threaded service, the
+acquisition thread never overwrites data that have not been read; if the 
+buffer is full, it waits for the application to catch up, and the LJM 
+backlog grows in the meantime.
+
+Software triggers are not supported in threaded mode, because the pre-trigger
+buffer is maintained by discarding blocks, which is the reader's job.  
+Hardware triggers work normally.
+
+LC_STREAM_THREAD_STOP() signals the thread to halt and waits for it to exit.
+It is called automatically by LC_STREAM_STOP().  Both functions return 
+LCONF_ERROR on failure, and LC_STREAM_THREAD_STOP() also returns LCONF_ERROR
+if the thread reported an error while reading.
+*/
+int lc_stream_thread_start(lc_devconf_t* dconf);
+int lc_stream_thread_stop(lc_devconf_t* dconf);
+
 /*STOP_STREAM
 Halt an active stream on device devnum.
 */
@@ -1290,7 +1553,8 @@ of the buffer status registers, but it
 /*STREAM_CLEAN
 De-allocates the memory assigned to the internal ring-buffer.  This is 
 not automatically done by LC_STREAM_STOP so that data will be available
-after the collection process has completed.
+after the collection process has completed.  If the buffer was allocated by
+LC_STREAM_POOL(), it is reset instead of de-allocated.
  */
 int lc_stream_clean(lc_devconf_t* dconf);
 
@@ -1315,6 +1579,54 @@ be empty unless there are also prior calls to SERVICE_DATA_STREAM.
 int lc_datafile_write(lc_devconf_t* dconf, FILE *FF);
 
 
+/*LC_ARCHIVE_OPEN
+LC_ARCHIVE_BEGIN
+LC_ARCHIVE_WRITE
+LC_ARCHIVE_END
+LC_ARCHIVE_CLOSE
+An archive collects many data records (like the points of a scan) in a single
+file that shares one configuration header.  LC_ARCHIVE_OPEN() creates the 
+file and writes the header with LC_DATAFILE_INIT(), so the meta parameters
+should be set first.  
+
+Each record begins with LC_ARCHIVE_BEGIN(), which stamps the record with the
+grid INDEX and position POS (both x,y,z) and the current time.  Either may be
+NULL, in which case zeros are recorded.  LC_ARCHIVE_WRITE() is used in place 
+of LC_DATAFILE_WRITE() to append a block from the ring buffer to the record.  
+LC_ARCHIVE_END() closes the record.  The data are written in the device's
+data format, so binary records are NSAMPLE rows of float with one column per
+channel.
+
+LC_ARCHIVE_CLOSE() writes the index table and the footer and closes the 
+file.  If the application exits without closing the archive, the data are
+still in the file, but the index will be missing.
+
+lc_archive_t ar;
+lc_archive_open(&dconf, &ar, "scan.lca");
+for( each point ){
+    lc_stream_start(&dconf, -1);
+    ...
+    lc_archive_begin(&ar, index, pos);
+    while(!lc_stream_isempty(&dconf))
+        lc_archive_write(&dconf, &ar);
+    lc_archive_end(&ar);
+    lc_stream_clean(&dconf);
+}
+lc_archive_close(&ar);
+
+All return LCONF_NOERR on success and LCONF_ERROR on failure.
+*/
+int lc_archive_open(lc_devconf_t* dconf, lc_archive_t* ar, const char* filename);
+
+int lc_archive_begin(lc_archive_t* ar, const int* index, const double* pos);
+
+int lc_archive_write(lc_devconf_t* dconf, lc_archive_t* ar);
+
+int lc_archive_end(lc_archive_t* ar);
+
+int lc_archive_close(lc_archive_t* ar);
+
+
 
 
 #endif
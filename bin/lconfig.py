@@ -12,7 +12,8 @@ the data.  You COULD open the whitespace separated variable files with
 excel, but why volunteer for pain and suffering?
 
 The load() function is the primary tool for opening configuration and
-data files.
+data files.  Archives with many data records (written by lc_archive_XXX())
+are opened with the LArchive class.
 
 >>> c = load('/path/to/file.conf')
 
@@ -26,6 +27,7 @@ import json
 import matplotlib.pyplot as plt
 import struct
 import time
+import copy
 
 __version__ = '4.06'
 
@@ -603,6 +605,12 @@ corresponds to a channel, and each row is a sample.  When distreaming
 is active, the digital channel is always last.  The analog channels
 appear in the same order in which they were ligsted in the configuration.
 
+When the data are loaded from a binary file, they are not read into 
+memory.  Instead, the file is mapped as a read-only float32 array, and the
+calibrations are applied when the data are used.  The `get_channel()` 
+method only converts the channel requested.  The `data` array is built
+(as float64 with the calibrations applied) the first time it is accessed.
+
 .timestamp      Time when the data collection began
 Once populated, the timestamp is a `time.time_struct` instance converted
 from the timestamp embedded in the data file.
@@ -664,7 +672,6 @@ the second identifies the channel.  This also supports slicing.
 # second channel (index 1).
 """
     def __init__(self, config, data, cal=True):
-        self.data = None
         self.timestamp = None
         self.filename = ''
         self.cal = False
@@ -674,14 +681,22 @@ the second identifies the channel.  This also supports slicing.
         self._dbits = None
         self._bylabel = {}
         self._byainum = {}
+        # The raw data, as they were passed in, and the data array built
+        # from them.  The calibration is pending until _data is built.
+        self._raw = None
+        self._data = None
+        self._calpend = False
         
         self.config = config
-        # format the data array
-        self.data = np.array(data, dtype=float)
+        # Arrays (like memory-mapped files) are kept without a copy
+        if isinstance(data, np.ndarray):
+            self._raw = data
+        else:
+            self._raw = np.array(data, dtype=float)
         # Check for correct shape
         nch = config.nistream()
-        if self.data.shape[1] != nch:
-            raise Exception('LData: %d channels configured, but %d channels found in data'%(nch, self.data.shape[1]))
+        if self._raw.ndim != 2 or self._raw.shape[1] != nch:
+            raise Exception('LData: %d channels configured, but %d channels found in data'%(nch, self._raw.shape[-1]))
         # Apply calibration
         if cal:
             self.apply_cal()
@@ -696,7 +711,7 @@ the second identifies the channel.  This also supports slicing.
 
 
     def __str__(self):
-        out = '<LData %d samples x %d channels>'%(self.data.shape[0], self.data.shape[1])
+        out = '<LData %d samples x %d channels>'%(self._raw.shape[0], self._raw.shape[1])
 
     def __getitem__(self, varg):
         N = len(varg)
@@ -722,26 +737,43 @@ the second identifies the channel.  This also supports slicing.
         return self.data[index,ch]
         
     def __len__(self):
-        return self.data.shape[0]
+        return self._raw.shape[0]
+        
+    @property
+    def data(self):
+        """The 2D data array.  It is built from the raw data on first access."""
+        if self._data is None:
+            self._data = np.array(self._raw, dtype=float)
+            if self._calpend:
+                for ii,aich in enumerate(self.config.aich):
+                    self._data[:,ii] -= aich.aicalzero
+                    self._data[:,ii] *= aich.aicalslope
+                self._calpend = False
+        return self._data
         
     def ndata(self):
         """Returns the number of samples in the data set"""
-        return self.data.shape[0]
+        return self._raw.shape[0]
         
     def nch(self):
         """Returns the number of channels in the data set"""
-        return self.data.shape[1]
+        return self._raw.shape[1]
         
     def apply_cal(self):
         """apply_cal()  Applies calibrations to the data
     If the `cal` member is `False`, the `apply_cal()` method applies 
 the appropriate calibration to each channel and sets `cal` to `True`.
+If the data array has not been built yet, the calibration is deferred 
+until it is.
 """
         if self.cal:
             return
-        for ii,aich in enumerate(self.config.aich):
-            self.data[:,ii] -= aich.aicalzero
-            self.data[:,ii] *= aich.aicalslope
+        if self._data is None:
+            self._calpend = True
+        else:
+            for ii,aich in enumerate(self.config.aich):
+                self._data[:,ii] -= aich.aicalzero
+                self._data[:,ii] *= aich.aicalslope
         self.cal = True
 
 
@@ -760,14 +792,16 @@ If distream was not set, then this `dibits()` returns with an error.
         if not self.config.distream:
             raise Exception('DBITS: The digital input stream was not configured for this data set.')
         
-        ndata = self.data.shape[0]
+        ndata = self._raw.shape[0]
         
-        # If the conversion hasn't already been performed, do it    
+        # If the conversion hasn't already been performed, do it.  The
+        # digital channel is never calibrated, so use the raw data.  The
+        # low 16 bits of each word are unpacked least significant first.
         if self._dbits is None:
-            self._dbits = np.zeros((ndata,16), dtype=bool)
-            for ii in range(ndata):
-                for jj in range(16):
-                    self._dbits[ii, jj] = bool(int(self.data[ii, -1]) & 1<<jj)
+            words = np.asarray(self._raw[:,-1]).astype(np.int64).astype('<u2')
+            self._dbits = np.unpackbits(
+                    words.view(np.uint8).reshape(ndata, 2), 
+                    axis=1, bitorder='little').astype(bool)
         
         if dich is None:
             return self._dbits
@@ -863,7 +897,16 @@ See the get_index() for a detailed description of the arguments
 See the class documentation for other operations that can be performed
 with the item retrieval [] notation.
 """
-        return self.data[:,self.get_index(target=target, ainum=ainum)]
+        ai = self.get_index(target=target, ainum=ainum)
+        # If the data array is already built, use it
+        if self._data is not None:
+            return self._data[:,ai]
+        # Otherwise, only convert the one channel
+        y = np.array(self._raw[:,ai], dtype=float)
+        if self._calpend and ai < len(self.config.aich):
+            y -= self.config.aich[ai].aicalzero
+            y *= self.config.aich[ai].aicalslope
+        return y
             
     
     def get_config(self, target=None, ainum=None):
@@ -895,7 +938,7 @@ they want the effects to be permanent.
 """
         if self._time is None:
             T = 1./self.config.samplehz
-            N = self.data.shape[0]
+            N = self._raw.shape[0]
             self._time = np.arange(0.,N*T,T)
         return self._time
 
@@ -1058,59 +1101,30 @@ corresponding to the last of the three successive 0 samples.
         elif edge == 'falling':
             edge_mode = -1
 
-        # The filter is applied with a state machine that looks for 
-        # sequences of bits with the same value.  Each bit with the same
-        # value as the last causes the series counter to be incremented
-        # Once the counter is the same size (or larger) than the 
-        # debounce filter, the appropriate index register is updated to
-        # point to the current sample.
-        series_count = 0
-        # The index registers track the last potential edge index.  For
-        # example, the rising_index is updated once `debounce` low bits
-        # in a row have been added. It is not recorded as a transition 
-        # until `debounce` high bits have also been detected.  If more
-        # low bits are found first, then it will be updated before it is
-        # ever recorded.
-        falling_index = None
-        rising_index = None
-        # The output is a list of indices.  It starts empty.
-        out = []
-        # Pretend the last sample was the same as the first
-        xlast = x[0]
-        # Parse the array one element at a time
-        for ii,xi in enumerate(x):
-            # If this sample is the same as the last, increment the 
-            # series counter.  If not, return it to 1 to begin a new
-            # series.
-            if xi == xlast:
-                series_count += 1
-            else:
-                series_count = 1
-            # If the series counter is high enough, update the indices
-            if series_count >= debounce:
-                # If this sample is high, this could be a falling edge
-                if xi:
-                    falling_index = ii
-                    # If there was a candidate rising edge, then it is
-                    # now officially an edge event. Record it if the 
-                    # edge mode is appropriate
-                    if rising_index is not None and edge_mode >= 0:
-                        out.append(rising_index)
-                        rising_index = None
-                # If this sample is low, this could be a rising edge
-                else:
-                    rising_index = ii
-                    # If there was a candidate falling edge, then it is
-                    # now officially an edge event. Record it if the 
-                    # edge mode is appropriate
-                    if falling_index is not None and edge_mode <= 0:
-                        out.append(falling_index)
-                        falling_index = None
-                        
-                # Check for a fully populated array
-                if count is not None and len(out) >= count:
-                    break
-        return np.array(out, dtype=int)
+        x = np.asarray(x, dtype=bool)
+        if x.size == 0:
+            return np.array([], dtype=int)
+        # Break the array into series of samples with the same value.
+        # Only series at least `debounce` long are eligible to mark an 
+        # edge.  Shorter series are ignored altogether.
+        change = np.flatnonzero(x[1:] != x[:-1]) + 1
+        starts = np.concatenate(([0], change))
+        ends = np.concatenate((change, [x.size])) - 1
+        keep = (ends - starts + 1) >= debounce
+        ends = ends[keep]
+        value = x[starts[keep]]
+        # An edge occurs wherever two successive eligible series differ.  
+        # The index is the last sample of the first series.
+        jj = np.flatnonzero(value[1:] != value[:-1])
+        out = ends[jj]
+        if edge_mode > 0:
+            out = out[~value[jj]]
+        elif edge_mode < 0:
+            out = out[value[jj]]
+        # Enforce the maximum count
+        if count is not None:
+            out = out[:max(count,0)]
+        return out.astype(int)
 
 
     def get_events(self, aich, level=0., edge='any', tstart=None, 
@@ -1241,6 +1255,35 @@ filter; all transitions will be reported.
         return indices
         
 
+def _parse_ascii(text, nch):
+    """Parse ASCII data into a 2D array with nch columns
+data = _parse_ascii(text, nch)
+"""
+    data = np.array(text.split(), dtype=float)
+    nline = text.count(b'\n') + (not text.endswith(b'\n') and bool(text.strip()))
+    if data.size != nline * nch:
+        # Find the offending line for the error message
+        for thisline in text.decode('utf-8').splitlines():
+            if len(thisline.split()) != nch:
+                raise Exception('LOAD: Line does not have the correct number of samples:\n' + thisline)
+    return data.reshape(-1, nch)
+
+
+def _map_binary(filename, offset, size, nch):
+    """Map binary float data into a read-only 2D array with nch columns
+data = _map_binary(filename, offset, size, nch)
+
+The data are SIZE bytes long, starting OFFSET bytes into the file.
+"""
+    nrow = size // (4*nch)
+    if size % (4*nch):
+        print('LOAD: WARNING: last data line was not complete.')
+    if nrow == 0:
+        return np.zeros((0,nch), dtype=np.float32)
+    return np.memmap(filename, dtype=np.float32, mode='r', 
+            offset=offset, shape=(nrow,nch))
+
+
 def load(filename, data=True, cal=True):
     """load(filename, data=True, cal=True)
     
@@ -1321,29 +1364,114 @@ instances, use the in-line help on them or their methods.
                 
             # If text/ascii
             if dconf.dataformat.getvalue() == 0:
-                data_temp = []
-                thisline = ff.readline().decode('utf-8')
-                while thisline:
-                    samples = [float(s) for s in thisline.split()]
-                    if len(samples) != nch:
-                        raise Exception('LOAD: Line does not have the correct number of samples:\n' + thisline)
-                    data_temp.append(samples)
-                    thisline = ff.readline().decode('utf-8')
-            # If binary format
+                data_temp = _parse_ascii(ff.read(), nch)
+            # If binary format, map the file instead of reading it
             else:
-                data_temp = []
-                samples = []
-                s = ff.read(4)
-                while s:
-                    samples.append(struct.unpack('f',s)[0])
-                    if len(samples) == nch:
-                        data_temp.append(samples)
-                        samples = []
-                    s = ff.read(4)
-                if samples:
-                    print('LOAD: WARNING: last data line was not complete.')
+                data_temp = _map_binary(filename, ff.tell(), 
+                        os.path.getsize(filename) - ff.tell(), nch)
             DATA = LData(dconf, data_temp, cal=cal)
             DATA.timestamp = timestamp
             out.append(DATA)
     return out
         
+
+
+
+class LArchive:
+    """LArchive - reader for archives written by lc_archive_XXX()
+    
+An archive holds many data records (like the points of a scan) that share
+a single configuration header.  The index table at the end of the file 
+lists the grid indices, position, start time, file offset, and number of 
+samples of each record, so any record can be loaded without reading the 
+others.
+
+>>> ar = LArchive('scan.lca')
+>>> len(ar)
+# returns the number of records
+>>> c, d = ar[3]
+# returns the DevConf and LData of the fourth record
+
+Each record is returned with its own copy of the configuration.  The x, y,
+and z meta parameters are set to the record's position so that the pair
+can be used just like the result of load() on an individual data file.
+Iterating over an archive yields the (DevConf, LData) pairs in order.
+
+Class members
+=======================
+.filename       The archive file
+.config         The shared DevConf configuration from the header
+.timestamp      The time the archive was opened, from the header
+.entries        A numpy structured array with the index table.  Its 
+                fields are 'index' (x,y,z), 'pos' (x,y,z), 'time' (unix
+                time), 'offset' and 'bytes' (in the file), and 'nsample'.
+"""
+    # These must agree with lc_arentry_t and lc_arfooter_t in lconfig.h
+    entry_dtype = np.dtype([
+            ('index', np.int32, (3,)),
+            ('reserved', np.int32),
+            ('pos', np.float64, (3,)),
+            ('time', np.float64),
+            ('offset', np.uint64),
+            ('bytes', np.uint64),
+            ('nsample', np.uint64)])
+    _footer = struct.Struct('=QII8s')
+    _magic = b'LCARCH01'
+    
+    def __init__(self, filename, cal=True):
+        self.filename = os.path.abspath(filename)
+        self.cal = cal
+        self.timestamp = None
+        [self.config] = load(self.filename, data=False)
+        
+        with open(self.filename, 'rb') as ff:
+            # Read the timestamp from the header
+            thisline = ff.readline()
+            while thisline and not thisline.startswith(b'#:'):
+                thisline = ff.readline()
+            thisline = thisline.decode('utf-8').strip()
+            try:
+                self.timestamp = time.strptime(thisline, '#: %a %b %d %H:%M:%S %Y')
+            except:
+                print('WARNING: Failed to convert the timestamp.')
+                print(thisline)
+            # Read the footer and the index table
+            ff.seek(-self._footer.size, 2)
+            offset, nentry, entry_bytes, magic = self._footer.unpack(ff.read(self._footer.size))
+            if magic != self._magic:
+                raise Exception('LArchive: The archive index is missing. Was the archive closed?\n' + self.filename)
+            if entry_bytes != self.entry_dtype.itemsize:
+                raise Exception('LArchive: Index entries are %d bytes, but %d were expected.'%(entry_bytes, self.entry_dtype.itemsize))
+            ff.seek(offset)
+            self.entries = np.fromfile(ff, dtype=self.entry_dtype, count=nentry)
+    
+    def __len__(self):
+        return len(self.entries)
+        
+    def __str__(self):
+        return '<LArchive %d records: %s>'%(len(self.entries), self.filename)
+        
+    def __iter__(self):
+        for ii in range(len(self.entries)):
+            yield self[ii]
+    
+    def __getitem__(self, ii):
+        entry = self.entries[ii]
+        nch = self.config.nistream()
+        # If text/ascii
+        if self.config.dataformat.getvalue() == 0:
+            with open(self.filename, 'rb') as ff:
+                ff.seek(int(entry['offset']))
+                data = _parse_ascii(ff.read(int(entry['bytes'])), nch)
+        else:
+            data = _map_binary(self.filename, int(entry['offset']), 
+                    int(entry['bytes']), nch)
+        # Give the record its own configuration with its position
+        conf = copy.deepcopy(self.config)
+        conf.meta_values['x'] = float(entry['pos'][0])
+        conf.meta_values['y'] = float(entry['pos'][1])
+        conf.meta_values['z'] = float(entry['pos'][2])
+        DATA = LData(conf, data, cal=self.cal)
+        DATA.timestamp = time.localtime(entry['time'])
+        DATA.filename = self.filename
+        return conf, DATA
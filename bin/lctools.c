@@ -1,8 +1,12 @@
+#define _GNU_SOURCE     // for pthread_setaffinity_np()
 #include "lctools.h"
 #include "lconfig.h"
 #include "lcmap.h"
 
 #include <math.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
 
 
 /*
@@ -386,106 +390,317 @@ void lct_stat_init(lct_stat_t stat[], unsigned int channels){
 
 /* LCT_STREAM_STAT
 .   Read in a single block of data from the buffer and aggregate statistics
-.   on the data.  
+.   on the data.  Each channel is calibrated and accumulated in a single 
+.   pass, and the block statistics are merged with the prior statistics.
 */
 int lct_stream_stat(lc_devconf_t *dconf, lct_stat_t values[], unsigned int maxchannels){
-    double *data = NULL, *this = NULL;
-    unsigned int channels, samples_per_read, err, ii;
-    lct_diter_t diter;
+    double *data = NULL, *this, *last;
+    double slope, zero, shift, x, y, mean, m2, delta,
+        sum_a, sum_b, sumsq_a, sumsq_b, max_a, max_b, min_a, min_b;
+    unsigned int channels, samples_per_read, nch, err, ii, n;
     
     // Get data.  Are there any?
     // If not, return with an error.
-    if(err = lc_stream_read(dconf, &data, &channels, &samples_per_read))
+    if((err = lc_stream_read(dconf, &data, &channels, &samples_per_read)))
         return err;
-    else if(!data)
+    else if(!data || !samples_per_read)
         return LCONF_ERROR;
         
     // Are the number of channels legal?
-    if(maxchannels > 0 && channels > maxchannels){
+    nch = channels;
+    if(maxchannels > 0 && nch > maxchannels){
         fprintf(stderr, "LCT_STREAM_STAT: The device is configured with more channels than the application allows.\n");
-        channels = maxchannels;
+        nch = maxchannels;
     }
-        
-    // First apply the calibration to the channels
-    lct_cal_inplace(dconf, data, channels*samples_per_read);
     
     // Loop through the channels
-    for(ii=0; ii<channels; ii++){
-        // initialize an iterator for this channel
-        if(lct_diter_init(dconf, &diter, data, channels*samples_per_read, ii)){
-            fprintf(stderr, "LCT_STREAM_STAT: Failed to initialize the channel iterator for channel %d\n", ii);
-            return LCONF_ERROR;
+    for(ii=0; ii<nch; ii++){
+        // The analog inputs come first, and the digital input stream (if 
+        // any) is not calibrated.
+        if(ii < dconf->naich){
+            slope = dconf->aich[ii].calslope;
+            zero = dconf->aich[ii].calzero;
+        }else{
+            slope = 1.;
+            zero = 0.;
         }
-        // Modify the prior statistics to receive in-place calculation
-        // Adjust the variance to be mean squre
-        values[ii].var += values[ii].mean*values[ii].mean;
-        // Re-scale by the number of samples so new samples can simply be added
-        values[ii].var *= values[ii].n;
-        values[ii].mean *= values[ii].n;
-
-        while(this = lct_diter_next(&diter)){
-            values[ii].n ++;
-            values[ii].mean += *this;
-            values[ii].var += (*this) * (*this);
-            values[ii].max = (*this) > values[ii].max ? (*this) : values[ii].max;
-            values[ii].min = (*this) < values[ii].min ? (*this) : values[ii].min;
+        // The first sample is used as a shift so the sums of squares do 
+        // not lose precision when the mean is large.
+        shift = slope * (data[ii] - zero);
+        sum_a = sum_b = sumsq_a = sumsq_b = 0.;
+        max_a = max_b = min_a = min_b = shift;
+        // Alternate samples are accumulated separately (a and b) so that
+        // consecutive additions do not have to wait on one another.
+        this = &data[ii];
+        last = &data[ii + (samples_per_read & ~1u) * channels];
+        for(; this < last; this += 2*channels){
+            x = slope * (this[0] - zero);
+            y = slope * (this[channels] - zero);
+            max_a = x > max_a ? x : max_a;
+            min_a = x < min_a ? x : min_a;
+            max_b = y > max_b ? y : max_b;
+            min_b = y < min_b ? y : min_b;
+            x -= shift;
+            y -= shift;
+            sum_a += x;
+            sumsq_a += x*x;
+            sum_b += y;
+            sumsq_b += y*y;
         }
-        // Clean up the intermediate values struct
-        values[ii].mean /= values[ii].n;
-        values[ii].var /= values[ii].n;
-        values[ii].var = values[ii].var - values[ii].mean*values[ii].mean;
-
+        if(samples_per_read & 1){
+            x = slope * (this[0] - zero);
+            max_a = x > max_a ? x : max_a;
+            min_a = x < min_a ? x : min_a;
+            x -= shift;
+            sum_a += x;
+            sumsq_a += x*x;
+        }
+        sum_a += sum_b;
+        sumsq_a += sumsq_b;
+        max_a = max_b > max_a ? max_b : max_a;
+        min_a = min_b < min_a ? min_b : min_a;
+        
+        // Block statistics
+        mean = shift + sum_a / samples_per_read;
+        m2 = sumsq_a - sum_a * sum_a / samples_per_read;
+        m2 = m2 > 0. ? m2 : 0.;
+        // Merge them with the prior statistics
+        n = values[ii].n + samples_per_read;
+        delta = mean - values[ii].mean;
+        values[ii].var = (values[ii].var * values[ii].n + m2 + 
+                delta * delta * values[ii].n * samples_per_read / n) / n;
+        values[ii].mean += delta * samples_per_read / n;
+        values[ii].n = n;
+        values[ii].max = max_a > values[ii].max ? max_a : values[ii].max;
+        values[ii].min = min_a < values[ii].min ? min_a : values[ii].min;
     }
     return LCONF_NOERR;
 }
 
 
+/* LCT_QUANT_INIT
+.   Initialize an array of LCT_QUANT_T structs with no samples.
+*/
+void lct_quant_init(lct_quant_t quant[], unsigned int channels){
+    unsigned int ii;
+    for(ii=0; ii<channels; ii++){
+        quant[ii].n = 0;
+        quant[ii].nskip = 0;
+        quant[ii].min = INFINITY;
+        quant[ii].max = -INFINITY;
+        quant[ii].lo = 0.;
+        quant[ii].width = 0.;
+        memset(quant[ii].count, 0, sizeof(quant[ii].count));
+    }
+}
+
+// Add a value to the histogram, and widen the histogram if it is out of range
+void lct_quant_bin(lct_quant_t *quant, double value){
+    unsigned int ii;
+    
+    while(value < quant->lo || value >= quant->lo + LCT_QUANT_NBIN*quant->width){
+        // Merge pairs of bins.  When the value is below the histogram, the
+        // old bins move to the upper half.
+        if(value < quant->lo){
+            for(ii=LCT_QUANT_NBIN-1; ii>=LCT_QUANT_NBIN/2; ii--)
+                quant->count[ii] = quant->count[2*ii-LCT_QUANT_NBIN] + 
+                        quant->count[2*ii-LCT_QUANT_NBIN+1];
+            for(ii=0; ii<LCT_QUANT_NBIN/2; ii++)
+                quant->count[ii] = 0;
+            quant->lo -= LCT_QUANT_NBIN*quant->width;
+        }else{
+            for(ii=0; ii<LCT_QUANT_NBIN/2; ii++)
+                quant->count[ii] = quant->count[2*ii] + quant->count[2*ii+1];
+            for(ii=LCT_QUANT_NBIN/2; ii<LCT_QUANT_NBIN; ii++)
+                quant->count[ii] = 0;
+        }
+        quant->width *= 2;
+    }
+    ii = (value - quant->lo) / quant->width;
+    quant->count[ii < LCT_QUANT_NBIN ? ii : LCT_QUANT_NBIN-1] ++;
+}
+
+/* LCT_QUANT_ADD
+.   Add a sample to the LCT_QUANT_T struct.  The first LCT_QUANT_EXACT 
+.   samples are kept.  When there are more, the histogram is built from the
+.   range of the samples so far.  Non-finite samples are only counted.
+*/
+void lct_quant_add(lct_quant_t *quant, double value){
+    unsigned int ii;
+    
+    // An infinite value would widen the histogram forever, and NaN has no bin
+    if(!isfinite(value)){
+        quant->nskip++;
+        return;
+    }
+    if(value < quant->min)
+        quant->min = value;
+    if(value > quant->max)
+        quant->max = value;
+    
+    if(quant->n < LCT_QUANT_EXACT){
+        quant->value[quant->n++] = value;
+        return;
+    }else if(quant->n == LCT_QUANT_EXACT){
+        // Span the samples, so the maximum lands in the last bin
+        quant->lo = quant->min;
+        quant->width = (quant->max - quant->min) / (LCT_QUANT_NBIN - 1);
+        if(quant->width <= 0.)
+            quant->width = fabs(quant->min) * 1e-9 + 1e-300;
+        for(ii=0; ii<LCT_QUANT_EXACT; ii++)
+            lct_quant_bin(quant, quant->value[ii]);
+    }
+    lct_quant_bin(quant, value);
+    quant->n++;
+}
+
+// Comparison function for sorting the exact samples
+int lct_quant_cmp(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* LCT_QUANT
+.   Return the quantile, P, of the samples aggregated into QUANT.
+*/
+double lct_quant(lct_quant_t *quant, double p){
+    double rank, frac, value;
+    unsigned int ii, cumulative;
+
+    if(quant->n == 0)
+        return 0.;
+    p = p < 0. ? 0. : (p > 1. ? 1. : p);
+    rank = p * (quant->n - 1);
+    
+    // Interpolate between the sorted samples
+    if(quant->n <= LCT_QUANT_EXACT){
+        qsort(quant->value, quant->n, sizeof(double), lct_quant_cmp);
+        ii = (unsigned int) rank;
+        frac = rank - ii;
+        if(ii+1 >= quant->n)
+            return quant->value[quant->n-1];
+        return (1.-frac)*quant->value[ii] + frac*quant->value[ii+1];
+    }
+    
+    // Find the bin containing the rank.  The samples in each bin are 
+    // treated as if they were evenly spaced across it.
+    cumulative = 0;
+    for(ii=0; ii<LCT_QUANT_NBIN-1; ii++){
+        if(cumulative + quant->count[ii] > rank)
+            break;
+        cumulative += quant->count[ii];
+    }
+    value = quant->lo + quant->width * 
+            (ii + (rank - cumulative + 0.5) / quant->count[ii]);
+    if(value < quant->min)
+        return quant->min;
+    else if(value > quant->max)
+        return quant->max;
+    return value;
+}
+
+
+
+/* Helper: add microseconds to a timespec
+*/
+void lct_timespec_add(struct timespec *ts, long us){
+    ts->tv_nsec += (us % 1000000) * 1000;
+    ts->tv_sec += us / 1000000;
+    if(ts->tv_nsec >= 1000000000){
+        ts->tv_nsec -= 1000000000;
+        ts->tv_sec += 1;
+    }else if(ts->tv_nsec < 0){
+        ts->tv_nsec += 1000000000;
+        ts->tv_sec -= 1;
+    }
+}
+
+/* Helper: the time from B to A in microseconds
+*/
+double lct_timespec_us(struct timespec *a, struct timespec *b){
+    return (a->tv_sec - b->tv_sec) * 1e6 + (a->tv_nsec - b->tv_nsec) * 1e-3;
+}
+
 
 int lct_idle_init(lct_idle_t *idle, unsigned int interval_us, unsigned int resolution_us){
-    if(clock_gettime(CLOCK_REALTIME, &idle->next))
+    if(clock_gettime(CLOCK_MONOTONIC, &idle->next))
         return -1;
     idle->interval_us = interval_us;
     idle->resolution_us = resolution_us;
-    idle->next.tv_nsec += interval_us * 1000;
-    if(idle->next.tv_nsec > 1e9){
-        idle->next.tv_nsec -= 1e9;
-        idle->next.tv_sec += 1;
-    }
+    idle->overrun = 0;
+    idle->late_sum = 0.;
+    lct_quant_init(&idle->late, 1);
+    lct_timespec_add(&idle->next, interval_us);
     return 0;
 }
     
 int lct_idle(lct_idle_t *idle){
-    struct timespec now;
-    int wait_us;
-
-    if(clock_gettime(CLOCK_REALTIME, &now))
+    struct timespec now, wake;
+    double late_us;
+    int err;
+
+    // Sleep until the deadline (less the polling margin).  The deadline is 
+    // absolute, so an interrupted sleep can just be resumed.
+    wake = idle->next;
+    lct_timespec_add(&wake, -(long)idle->resolution_us);
+    while((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)) == EINTR);
+    if(err)
         return -1;
-    // Wait a nominal period
-    wait_us = idle->next.tv_sec - now.tv_sec;
-    wait_us *= 1e6;
-    wait_us += (idle->next.tv_nsec - now.tv_nsec)/1000 - 5*idle->resolution_us;
+    // Poll through the margin
+    do{
+        if(clock_gettime(CLOCK_MONOTONIC, &now))
+            return -1;
+    }while(lct_timespec_us(&now, &idle->next) < 0.);
     
-    if(wait_us > 0)
-        usleep(wait_us);
+    late_us = lct_timespec_us(&now, &idle->next);
+    idle->late_sum += late_us;
+    lct_quant_add(&idle->late, late_us);
+    // Increment the next deadline.  If entire periods have been missed,
+    // skip them so the loop does not try to catch up.
+    lct_timespec_add(&idle->next, idle->interval_us);
+    if(idle->interval_us && late_us >= idle->interval_us){
+        idle->overrun += (unsigned int)(late_us / idle->interval_us);
+        lct_timespec_add(&idle->next, 
+                (long)(late_us / idle->interval_us) * idle->interval_us);
+    }
+    return 0;
+}
+
+
+unsigned int lct_idle_stat(lct_idle_t *idle, double *min, double *mean, 
+        double *max, double *p99){
+    unsigned int n = idle->late.n;
+    if(min)
+        *min = n ? idle->late.min : 0.;
+    if(mean)
+        *mean = n ? idle->late_sum / n : 0.;
+    if(max)
+        *max = n ? idle->late.max : 0.;
+    if(p99)
+        *p99 = lct_quant(&idle->late, 0.99);
+    return n;
+}
+
+
+int lct_idle_rt(int priority, int cpu){
+    struct sched_param param;
+    cpu_set_t cpuset;
+    int err = 0;
     
-    while(1){
-        if(clock_gettime(CLOCK_REALTIME, &now))
-            return -1;
-        // If the timer has expired
-        if(now.tv_sec > idle->next.tv_sec || \
-                (now.tv_sec == idle->next.tv_sec && now.tv_nsec > idle->next.tv_nsec)){
-            // Increment the next expiration
-            idle->next.tv_nsec += idle->interval_us * 1000;
-            if(idle->next.tv_nsec > 1e9){
-                idle->next.tv_nsec -= 1e9;
-                idle->next.tv_sec += 1;
-            }
-            // All done
-            return 0;
+    if(priority > 0){
+        param.sched_priority = priority;
+        if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)){
+            fprintf(stderr, "LCT_IDLE_RT: Failed to set SCHED_FIFO priority %d.\n", priority);
+            err = -1;
         }
-        // If the timer has not expired, wait
-        usleep(idle->resolution_us);
     }
-    // This should never be executed!
-    return -1;
+    if(cpu >= 0){
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset)){
+            fprintf(stderr, "LCT_IDLE_RT: Failed to pin the thread to CPU %d.\n", cpu);
+            err = -1;
+        }
+    }
+    return err;
 }
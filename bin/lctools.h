@@ -25,6 +25,16 @@ sequences for the Linux console environment.
 
 CHANGELOG
 
+v1.6    10/2026
+- IDLE sleeps to absolute deadlines and records lateness statistics
+- Added IDLE_STAT and IDLE_RT
+
+v1.5    10/2026
+- STREAM_STAT calibrates and aggregates in one pass with pairwise merging
+
+v1.4    10/2026
+- Added streaming quantiles (LCT_QUANT_T)
+
 v1.3    3/2021
 - Added idle
 
@@ -58,7 +68,11 @@ v1.0	9/2019		ORIGINAL RELEASE
  *                          *
  ****************************/
 
-#define LCT_VERSION 1.3
+#define LCT_VERSION 1.6
+
+// Streaming quantiles
+#define LCT_QUANT_EXACT 64      // Samples kept exactly before binning
+#define LCT_QUANT_NBIN  512     // Histogram bins once the samples are binned
 
 
 
@@ -345,9 +359,11 @@ void lct_stat_init(lct_stat_t stat[], unsigned int channels);
 .   Read in a single block of data from the buffer and aggregate statistics
 .   on the data.  LCT_STREAM_STAT() should be called in place of the 
 .   LC_STREAM_READ() function.  LCT_STREAM_STAT calls LC_STREAM_READ()
-.   to access data in the buffer directly.  If data are ready, they are
-.   calibrated in place using the LCT_CAL_INPLACE() function before
-.   statistics are aggregated.
+.   to access data in the buffer directly.  If data are ready, each 
+.   channel is calibrated and aggregated in a single pass, and the buffer 
+.   is not modified.  The statistics of each block are merged with 
+.   the prior statistics using the pairwise update of Chan et al., so the
+.   mean and variance remain accurate over long runs.
 .
 .   The LCT_STAT_T VALUES struct contains the aggregated mean, maximum,
 .   minimum, and standard deviation.  Each element of the VALUES array
@@ -369,13 +385,69 @@ void lct_stat_init(lct_stat_t stat[], unsigned int channels);
 int lct_stream_stat(lc_devconf_t *dconf, lct_stat_t values[], unsigned int maxchannels);
 
 
+/* LCT_QUANT_T
+.   Aggregates the distribution of a data set in constant memory so that the
+.   median and other quantiles can be estimated without keeping every sample.
+.       n : number of samples aggregated into the quant struct
+.       nskip : number of non-finite samples that were rejected
+.       min : the lowest value
+.       max : the highest value
+.       lo : the lower edge of the histogram
+.       width : the histogram bin width
+.       value : the samples themselves while n <= LCT_QUANT_EXACT
+.       count : the histogram bin counts once n > LCT_QUANT_EXACT
+.
+.   The first LCT_QUANT_EXACT samples are kept, so quantiles of small data 
+.   sets are exact.  When there are more, the samples are sorted into a 
+.   histogram with LCT_QUANT_NBIN bins spanning the data.  When a new sample
+.   falls outside the histogram, the bin width is doubled by merging adjacent
+.   bins until it fits.  The bin width is typically between one and two times
+.   (max - min) / LCT_QUANT_NBIN, and the quantiles are interpolated within
+.   a bin, so their error is no more than about one bin width.
+*/
+typedef struct __lct_quant_t__ {
+    unsigned int n;
+    unsigned int nskip;
+    double min;
+    double max;
+    double lo;
+    double width;
+    double value[LCT_QUANT_EXACT];
+    unsigned int count[LCT_QUANT_NBIN];
+} lct_quant_t;
+
+/* LCT_QUANT_INIT
+.   Initialize an array of CHANNELS LCT_QUANT_T structs with no samples.
+*/
+void lct_quant_init(lct_quant_t quant[], unsigned int channels);
+
+/* LCT_QUANT_ADD
+.   Add the sample, VALUE, to the LCT_QUANT_T struct.  NaN and infinite 
+.   values cannot be binned, so they are not added; they are only counted in
+.   NSKIP.
+*/
+void lct_quant_add(lct_quant_t *quant, double value);
+
+/* LCT_QUANT
+.   Return the quantile, P, (between 0 and 1) of the samples aggregated into
+.   QUANT.  P=0.5 is the median.  When there are LCT_QUANT_EXACT or fewer 
+.   samples, the result is interpolated between the sorted samples the same 
+.   way numpy.quantile() and numpy.median() do.  Otherwise, it is interpolated
+.   in the histogram.  Returns 0 if there are no samples.
+*/
+double lct_quant(lct_quant_t *quant, double p);
+
+
 
 
 
 typedef struct __lct_idle_t__ {
-    struct timespec next;
-    unsigned int interval_us;
-    unsigned int resolution_us;
+    struct timespec next;       // The next deadline (CLOCK_MONOTONIC)
+    unsigned int interval_us;   // Loop period
+    unsigned int resolution_us; // Busy-wait margin before each deadline
+    unsigned int overrun;       // Number of deadlines missed entirely
+    double late_sum;            // Sum of the lateness (us) for the mean
+    lct_quant_t late;           // Lateness (us) of each wakeup
 } lct_idle_t;
 
 
@@ -383,19 +455,30 @@ typedef struct __lct_idle_t__ {
 .  LCT_IDLE
 .   Initialize the idle struct to set up a recurring blocking function to 
 .   establish idle time.  This is intended to be used along with LCT_IDLE()
-.   to insert idle time so that a loop executes somewhat regularly.  The
+.   to insert idle time so that a loop executes regularly.  The
 .   LCT_IDLE_INIT() function should be called immediately before the loop is
 .   started and the LCT_IDLE() function should be placed at the end of the 
 .   loop.
 .
-.   INTERVAL_US is the approximate target loop execution period in 
-.   microseconds.
+.   INTERVAL_US is the target loop execution period in microseconds.  The
+.   deadlines are absolute (the first is INTERVAL_US after LCT_IDLE_INIT()
+.   and each is INTERVAL_US after the last), so the loop period does not 
+.   drift with the loop execution time or with the wakeup latency.  If a 
+.   loop iteration takes so long that entire periods are missed, the missed
+.   deadlines are skipped and counted in the OVERRUN member.
+.
+.   RESOLUTION_US is the margin before each deadline that is spent polling 
+.   the clock instead of sleeping.  When it is zero, LCT_IDLE() sleeps until
+.   the deadline with CLOCK_NANOSLEEP().  A small margin (tens of us) trades
+.   processor time for lower wakeup jitter.
 .
-.   RESOLUTION_US is the approximate duration for which the process should 
-.   sleep between checks for timer expiration.
+.   The lateness of every wakeup past its deadline is recorded in the LATE 
+.   member in microseconds, so the loop timing can be checked with 
+.   LCT_IDLE_STAT() or with LCT_QUANT() directly.  Both return 0 on success
+.   and -1 on failure.
 
 lct_idle_t myidle;
-lct_idle_init(&myidle, 1000);
+lct_idle_init(&myidle, 1000, 0);
 while(1){
     ... Do something with variable execution time ...
     lct_idle(&myidle);
@@ -404,4 +487,23 @@ while(1){
 int lct_idle_init(lct_idle_t *idle, unsigned int interval_us, unsigned int resolution_us);
 int lct_idle(lct_idle_t *idle);
 
+/* LCT_IDLE_STAT
+.   Retrieve the minimum, mean, maximum, and 99th percentile lateness of the 
+.   wakeups in microseconds.  Any of the pointers may be NULL.  The p99 is 
+.   estimated from a histogram once there are more than LCT_QUANT_EXACT 
+.   wakeups.  Returns the number of wakeups recorded.
+*/
+unsigned int lct_idle_stat(lct_idle_t *idle, double *min, double *mean, 
+        double *max, double *p99);
+
+/* LCT_IDLE_RT
+.   Request real-time scheduling for the calling thread.  When PRIORITY is
+.   greater than zero, the thread is moved to the SCHED_FIFO policy at that
+.   priority (1-99).  When CPU is not negative, the thread is pinned to that 
+.   processor.  Both normally require elevated privileges (CAP_SYS_NICE or 
+.   an rtprio limit), so a failure is reported to stderr and -1 is returned,
+.   but the idle functions work either way.  Returns 0 on success.
+*/
+int lct_idle_rt(int priority, int cpu);
+
 #endif
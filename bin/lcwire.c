@@ -0,0 +1,924 @@
+/*
+  This file is part of the LCONFIG laboratory configuration system.
+
+    LCONFIG is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LCONFIG is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LCONFIG.  If not, see <https://www.gnu.org/licenses/>.
+
+    Authored by C.Martin crm28@psu.edu
+*/
+
+#include "lcwire.h"
+#include "lconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define LCW_NDATA_INIT  0x10000     // Initial length of the data array (rows)
+#define LCW_NROT_INIT   256         // Initial length of the wire-0 edge array
+#define LCW_STR         128         // Meta parameter name length
+
+
+/*....................................
+.
+.   Helper functions
+.
+......................................*/
+
+// Rearrange V so that V[K] is the value that would be there if V were
+// sorted.  All values before K are less than or equal to it, and all values
+// after K are greater than or equal to it.
+double select_k(double *v, unsigned int n, unsigned int k){
+    unsigned int lo, hi, ii, jj;
+    double pivot, temp;
+
+    lo = 0;
+    hi = n-1;
+    while(lo < hi){
+        pivot = v[lo + (hi-lo)/2];
+        ii = lo;
+        jj = hi;
+        while(ii <= jj){
+            while(v[ii] < pivot)
+                ii++;
+            while(v[jj] > pivot)
+                jj--;
+            if(ii <= jj){
+                temp = v[ii];
+                v[ii] = v[jj];
+                v[jj] = temp;
+                ii++;
+                if(jj == 0)
+                    break;
+                jj--;
+            }
+        }
+        if(k <= jj)
+            hi = jj;
+        else if(k >= ii)
+            lo = ii;
+        else
+            break;
+    }
+    return v[k];
+}
+
+// The median of N values in V, calculated the same way as numpy.median().
+// V is rearranged in the process.
+double median_n(double *v, unsigned int n){
+    unsigned int ii;
+    double a, b;
+
+    b = select_k(v, n, n/2);
+    if(n % 2)
+        return b;
+    // The other middle value is the largest of the lower half
+    a = v[0];
+    for(ii=1; ii<n/2; ii++)
+        if(v[ii] > a)
+            a = v[ii];
+    return (a + b)/2;
+}
+
+
+/*....................................
+.
+.   Angle Bins
+.
+......................................*/
+
+int lcw_ntheta(double theta_min, double theta_max, double theta_step){
+    double n;
+    n = ceil((theta_max - (theta_min + 0.5*theta_step)) / theta_step);
+    return n > 0 ? (int) n : 0;
+}
+
+
+void lcw_theta(double theta_min, double theta_max, double theta_step,
+        double *theta){
+    int J, ntheta;
+    double start, delta;
+
+    ntheta = lcw_ntheta(theta_min, theta_max, theta_step);
+    // numpy.arange() calculates the first two values, and then fills the
+    // rest using the difference between them.
+    start = theta_min + 0.5*theta_step;
+    if(ntheta > 0)
+        theta[0] = start;
+    if(ntheta > 1)
+        theta[1] = start + theta_step;
+    delta = (start + theta_step) - start;
+    for(J=2; J<ntheta; J++)
+        theta[J] = start + J*delta;
+}
+
+
+/*....................................
+.
+.   Reduction
+.
+......................................*/
+
+unsigned int lcw_edges(const double *dword, unsigned int ndata,
+        unsigned int stride, unsigned int dibit, long *edges){
+    unsigned int ii, nedges;
+    int this, last;
+
+    nedges = 0;
+    if(ndata < 2)
+        return 0;
+    last = ((long) dword[0] >> dibit) & 1;
+    // The last sample is excluded, just like get_dievents()
+    for(ii=1; ii<ndata-1; ii++){
+        this = ((long) dword[ii*stride] >> dibit) & 1;
+        if(this != last)
+            edges[nedges++] = ii-1;
+        last = this;
+    }
+    return nedges;
+}
+
+
+void lcw_order_radii(double *r, unsigned int nwire, int ccw){
+    unsigned int ii;
+    double temp;
+
+    if(ccw || nwire < 2)
+        return;
+    // Reverse
+    for(ii=0; ii<nwire/2; ii++){
+        temp = r[ii];
+        r[ii] = r[nwire-1-ii];
+        r[nwire-1-ii] = temp;
+    }
+    // Move the last to the front
+    temp = r[nwire-1];
+    for(ii=nwire-1; ii>0; ii--)
+        r[ii] = r[ii-1];
+    r[0] = temp;
+}
+
+
+const char * lcw_strerror(int err){
+    switch(err){
+    case LCW_NOERR:
+        return "No error";
+    case LCW_ERR_EDGES:
+        return "Too few photo-reflector edges";
+    case LCW_ERR_SPEED:
+        return "The disc speed changes by more than 1%";
+    case LCW_ERR_BIN:
+        return "Wire angle bin out of range";
+    case LCW_ERR_MEM:
+        return "Memory allocation failed";
+    }
+    return "Unknown error";
+}
+
+
+int lcw_reduce(const double *current, unsigned int ndata,
+        const long *edges, unsigned int nedges, unsigned int nwire,
+        double theta_min, double theta_max, double theta_step,
+        double *median, int *count, int *ccw){
+    long edges_dI[4], I, dI, Izero, Imin, Imax, temp, ii, J;
+    long *rot_I, *rot_dI, *bin;
+    double dtheta, theta, *values;
+    unsigned int nrot, irot, iwire, ntheta, nbin, first, nvalue, kk;
+    unsigned long *start;
+    int pass, err;
+
+    ntheta = lcw_ntheta(theta_min, theta_max, theta_step);
+    nbin = nwire * ntheta;
+    memset(count, 0, nbin * sizeof(int));
+    for(kk=0; kk<nbin; kk++)
+        median[kk] = 0.;
+
+    // (1) Determine the disc direction and identify the wire-0 edge
+    // The longest of the first four intervals is the disc transit, and
+    // the narrow stripe tells us which side of the wide stripe to use.
+    if(nedges < 5)
+        return LCW_ERR_EDGES;
+    for(kk=0; kk<4; kk++)
+        edges_dI[kk] = edges[kk+1] - edges[kk];
+    first = 0;
+    for(kk=1; kk<4; kk++)
+        if(edges_dI[kk] > edges_dI[first])
+            first = kk;
+    if(edges_dI[(first+1)%4] > edges_dI[(first+3)%4]){
+        first = (first+2)%4;
+        *ccw = 1;
+    }else{
+        first = (first+3)%4;
+        *ccw = 0;
+    }
+
+    // (2) Down-select the wire-0 edges and the samples per rotation
+    nrot = (nedges - first + 3)/4;
+    if(nrot < 2)
+        return LCW_ERR_EDGES;
+    rot_I = malloc(nrot * sizeof(long));
+    rot_dI = malloc(nrot * sizeof(long));
+    if(!rot_I || !rot_dI){
+        free(rot_I);
+        free(rot_dI);
+        return LCW_ERR_MEM;
+    }
+    for(irot=0; irot<nrot; irot++)
+        rot_I[irot] = edges[first + 4*irot];
+    for(irot=0; irot<nrot-1; irot++)
+        rot_dI[irot] = rot_I[irot+1] - rot_I[irot];
+    rot_dI[nrot-1] = rot_dI[nrot-2];
+    // The disc speed must be steady
+    Imin = rot_dI[0];
+    Imax = rot_dI[0];
+    for(irot=1; irot<nrot; irot++){
+        if(rot_dI[irot] < Imin)
+            Imin = rot_dI[irot];
+        if(rot_dI[irot] > Imax)
+            Imax = rot_dI[irot];
+    }
+    if((double)Imax / (double)Imin > LCW_SPEED_TOL){
+        free(rot_I);
+        free(rot_dI);
+        return LCW_ERR_SPEED;
+    }
+
+    // (3) Bin the samples in the window around each wire.  This is done in
+    // two passes.  The first counts the samples in each bin, and the second
+    // sorts them into a single array grouped by bin.
+    err = LCW_NOERR;
+    values = NULL;
+    bin = NULL;
+    start = malloc((nbin+1) * sizeof(unsigned long));
+    if(!start){
+        free(rot_I);
+        free(rot_dI);
+        return LCW_ERR_MEM;
+    }
+    for(pass=0; pass<2 && !err; pass++){
+        // The first "rotation" is the partial one before the first edge.
+        for(irot=0; irot<=nrot && !err; irot++){
+            I = rot_I[irot ? irot-1 : 0];
+            dI = rot_dI[irot ? irot-1 : 0];
+            // Calculate the angle rotated between each sample
+            dtheta = 2*M_PI / dI;
+            // If rotation is backwards, dtheta is negative
+            if(*ccw)
+                dtheta = -dtheta;
+            for(iwire=0; iwire<nwire; iwire++){
+                // Izero, Imin, and Imax are the data indices where the
+                // wire angle is zero, theta_min, and theta_max.
+                if(irot == 0){
+                    Izero = I - ((nwire-iwire)*dI) / nwire;
+                    Imin = Izero + (long)(theta_min / dtheta);
+                    Imax = Izero + (long)(theta_max / dtheta);
+                    Imin = Imin > 0 ? Imin : 0;
+                    Imax = Imax > 0 ? Imax : 0;
+                }else{
+                    Izero = I + (iwire*dI) / nwire;
+                    Imin = Izero + (long)(theta_min / dtheta);
+                    Imax = Izero + (long)(theta_max / dtheta);
+                    Imin = Imin < (long)ndata-1 ? Imin : (long)ndata-1;
+                    Imax = Imax < (long)ndata-1 ? Imax : (long)ndata-1;
+                }
+                if(*ccw){
+                    temp = Imin;
+                    Imin = Imax;
+                    Imax = temp;
+                }
+                if(Imax > (long)ndata){
+                    err = LCW_ERR_BIN;
+                    break;
+                }
+                for(ii=Imin; ii<Imax; ii++){
+                    // Calculate the sample angle and its bin
+                    theta = (ii-Izero) * dtheta;
+                    J = (long) floor((theta - theta_min)/theta_step);
+                    // Negative bins wrap around like python list indices
+                    if(J < 0)
+                        J += ntheta;
+                    if(J < 0 || J >= ntheta){
+                        err = LCW_ERR_BIN;
+                        break;
+                    }
+                    J += iwire*ntheta;
+                    if(pass == 0)
+                        count[J]++;
+                    else
+                        values[bin[J]++] = current[ii];
+                }
+            }
+        }
+        // Allocate the grouped values at the end of the first pass
+        if(pass == 0 && !err){
+            start[0] = 0;
+            for(kk=0; kk<nbin; kk++)
+                start[kk+1] = start[kk] + count[kk];
+            values = malloc((start[nbin] + 1) * sizeof(double));
+            bin = malloc(nbin * sizeof(long));
+            if(!values || !bin)
+                err = LCW_ERR_MEM;
+            else
+                for(kk=0; kk<nbin; kk++)
+                    bin[kk] = start[kk];
+        }
+    }
+
+    // (4) Calculate the medians
+    if(!err){
+        for(kk=0; kk<nbin; kk++){
+            nvalue = count[kk];
+            if(nvalue)
+                median[kk] = median_n(&values[start[kk]], nvalue);
+        }
+    }
+    free(rot_I);
+    free(rot_dI);
+    free(start);
+    free(values);
+    free(bin);
+    return err;
+}
+
+
+/*....................................
+.
+.   Block-wise Reduction
+.
+......................................*/
+
+// Write the WireData records for NWIRE wires and NTHETA angles.  The radii
+// must already be in the order of the results.  Returns the number of 
+// records written.
+int write_records(FILE *ff, const double *r, unsigned int nwire,
+        double x, double y, const double *theta, unsigned int ntheta,
+        const double *median){
+    double record[5];
+    unsigned int iwire, J;
+    int nrecord = 0;
+
+    record[1] = x;
+    record[2] = y;
+    for(iwire=0; iwire<nwire; iwire++){
+        record[0] = r[iwire];
+        for(J=0; J<ntheta; J++){
+            record[3] = theta[J];
+            record[4] = median[iwire*ntheta + J];
+            nrecord += fwrite(record, sizeof(double), 5, ff) == 5;
+        }
+    }
+    return nrecord;
+}
+
+
+// Bin samples IMIN to IMAX-1 for wire IWIRE.  IZERO is the sample index
+// where the wire angle is zero, and DTHETA is the angle per sample.
+int accum_segment(lcw_accum_t *acc, unsigned int iwire, 
+        long Izero, long Imin, long Imax, double dtheta){
+    long ii, J;
+    double theta;
+
+    // The samples must not have been discarded yet.  This only happens if
+    // the disc speed changed dramatically.
+    if(Imin < Imax && (Imin < (long)acc->offset || Imax > (long)acc->ndata))
+        return LCW_ERR_SPEED;
+    for(ii=Imin; ii<Imax; ii++){
+        theta = (ii-Izero) * dtheta;
+        J = (long) floor((theta - acc->theta_min)/acc->theta_step);
+        // Negative bins wrap around like python list indices
+        if(J < 0)
+            J += acc->ntheta;
+        if(J < 0 || J >= acc->ntheta)
+            return LCW_ERR_BIN;
+        lct_quant_add(&acc->bins[iwire*acc->ntheta + J], 
+                acc->current[ii - acc->offset]);
+    }
+    return LCW_NOERR;
+}
+
+
+// Bin rotation K, which starts at wire-0 edge ROT[K] and lasts DI samples.
+// The first rotation also bins the samples before ROT[0].  When FINAL is 
+// zero, nothing is done unless all of the windows are already complete, 
+// and 0 is returned.  Returns 1 when the rotation is binned.
+int accum_rotation(lcw_accum_t *acc, unsigned int K, long dI, int final){
+    long I, Izero, Imin, Imax, temp;
+    double dtheta;
+    unsigned int iwire;
+    int err;
+
+    I = acc->rot[K];
+    // Calculate the angle rotated between each sample
+    dtheta = 2*M_PI / dI;
+    // If rotation is backwards, dtheta is negative
+    if(acc->ccw)
+        dtheta = -dtheta;
+    // Wait for the last window to be complete.  The windows are not 
+    // clamped to the end of the data unless this is the final pass.
+    if(!final){
+        for(iwire=0; iwire<acc->nwire; iwire++){
+            Izero = I + (iwire*dI) / acc->nwire;
+            Imin = Izero + (long)(acc->theta_min / dtheta);
+            Imax = Izero + (long)(acc->theta_max / dtheta);
+            if(Imin > (long)acc->ndata-1 || Imax > (long)acc->ndata-1)
+                return 0;
+        }
+    }
+    // Samples before the first trigger event
+    if(K == 0){
+        for(iwire=0; iwire<acc->nwire; iwire++){
+            Izero = I - ((acc->nwire-iwire)*dI) / acc->nwire;
+            Imin = Izero + (long)(acc->theta_min / dtheta);
+            Imax = Izero + (long)(acc->theta_max / dtheta);
+            Imin = Imin > 0 ? Imin : 0;
+            Imax = Imax > 0 ? Imax : 0;
+            if(acc->ccw){
+                temp = Imin;
+                Imin = Imax;
+                Imax = temp;
+            }
+            if((err = accum_segment(acc, iwire, Izero, Imin, Imax, dtheta)))
+                return err;
+        }
+    }
+    for(iwire=0; iwire<acc->nwire; iwire++){
+        Izero = I + (iwire*dI) / acc->nwire;
+        Imin = Izero + (long)(acc->theta_min / dtheta);
+        Imax = Izero + (long)(acc->theta_max / dtheta);
+        Imin = Imin < (long)acc->ndata-1 ? Imin : (long)acc->ndata-1;
+        Imax = Imax < (long)acc->ndata-1 ? Imax : (long)acc->ndata-1;
+        if(acc->ccw){
+            temp = Imin;
+            Imin = Imax;
+            Imax = temp;
+        }
+        if((err = accum_segment(acc, iwire, Izero, Imin, Imax, dtheta)))
+            return err;
+    }
+    return 1;
+}
+
+
+// Record a photo-reflector edge
+int accum_edge(lcw_accum_t *acc, long edge){
+    long edges_dI[4], *rot;
+    unsigned int kk;
+
+    if(acc->nedges < 5)
+        acc->edges[acc->nedges] = edge;
+    acc->nedges++;
+    // (1) Determine the disc direction and identify the wire-0 edge from 
+    // the first five edges.  See LCW_REDUCE().
+    if(acc->nedges == 5){
+        for(kk=0; kk<4; kk++)
+            edges_dI[kk] = acc->edges[kk+1] - acc->edges[kk];
+        acc->first = 0;
+        for(kk=1; kk<4; kk++)
+            if(edges_dI[kk] > edges_dI[acc->first])
+                acc->first = kk;
+        if(edges_dI[(acc->first+1)%4] > edges_dI[(acc->first+3)%4]){
+            acc->first = (acc->first+2)%4;
+            acc->ccw = 1;
+        }else{
+            acc->first = (acc->first+3)%4;
+            acc->ccw = 0;
+        }
+        // Catch up on the wire-0 edges among the first five
+        for(kk=acc->first; kk<5; kk+=4)
+            acc->rot[acc->nrot++] = acc->edges[kk];
+    // (2) Keep only the wire-0 edges
+    }else if(acc->nedges > 5 && (acc->nedges - 1 - acc->first) % 4 == 0){
+        if(acc->nrot >= acc->maxrot){
+            rot = realloc(acc->rot, 2 * acc->maxrot * sizeof(long));
+            if(!rot)
+                return LCONF_ERROR;
+            acc->rot = rot;
+            acc->maxrot *= 2;
+        }
+        acc->rot[acc->nrot++] = edge;
+    }
+    return LCONF_NOERR;
+}
+
+
+int lcw_accum_init(lcw_accum_t *acc, lc_devconf_t *dconf,
+        double theta_min, double theta_max, double theta_step){
+    char param[LCW_STR];
+
+    acc->current = NULL;
+    acc->bins = NULL;
+    acc->rot = NULL;
+
+    // Extract the wire radii
+    for(acc->nwire=0; acc->nwire<LCONF_MAX_META; acc->nwire++){
+        sprintf(param, "r%d", acc->nwire);
+        if(lc_get_meta_type(dconf, param) != LC_MT_FLT)
+            break;
+        lc_get_meta_flt(dconf, param, &acc->r[acc->nwire]);
+    }
+    if(acc->nwire == 0){
+        fprintf(stderr, "LCW_ACCUM_INIT: No wire radii found in meta parameters\n");
+        return LCONF_ERROR;
+    }
+    if(dconf->naich < 1 || !dconf->distream){
+        fprintf(stderr, "LCW_ACCUM_INIT: An analog input and a digital input stream are required\n");
+        return LCONF_ERROR;
+    }
+    acc->nch = lc_nistream(dconf);
+    acc->calslope = dconf->aich[0].calslope;
+    acc->calzero = dconf->aich[0].calzero;
+    // The highest bit in the input stream mask is the photo-reflector
+    for(acc->dibit=0; (dconf->distream >> (acc->dibit+1)); acc->dibit++);
+
+    acc->theta_min = theta_min;
+    acc->theta_max = theta_max;
+    acc->theta_step = theta_step;
+    acc->ntheta = lcw_ntheta(theta_min, theta_max, theta_step);
+    if(acc->ntheta == 0){
+        fprintf(stderr, "LCW_ACCUM_INIT: There are no wire angle bins\n");
+        return LCONF_ERROR;
+    }
+
+    acc->maxdata = LCW_NDATA_INIT;
+    acc->maxrot = LCW_NROT_INIT;
+    acc->current = malloc(acc->maxdata * sizeof(double));
+    acc->rot = malloc(acc->maxrot * sizeof(long));
+    acc->bins = malloc(acc->nwire * acc->ntheta * sizeof(lct_quant_t));
+    if(!acc->current || !acc->rot || !acc->bins){
+        fprintf(stderr, "LCW_ACCUM_INIT: Memory allocation failed\n");
+        lcw_accum_free(acc);
+        return LCONF_ERROR;
+    }
+    lcw_accum_reset(acc);
+    return LCONF_NOERR;
+}
+
+
+// Make room for NSAMPLE more samples in the accumulator
+static int accum_grow(lcw_accum_t *acc, unsigned int nsample){
+    unsigned int maxdata;
+    double *current;
+
+    if(acc->ndata - acc->offset + nsample > acc->maxdata){
+        maxdata = 2*acc->maxdata;
+        if(maxdata < acc->ndata - acc->offset + nsample)
+            maxdata = acc->ndata - acc->offset + nsample;
+        current = realloc(acc->current, maxdata * sizeof(double));
+        if(!current)
+            return LCONF_ERROR;
+        acc->current = current;
+        acc->maxdata = maxdata;
+    }
+    return LCONF_NOERR;
+}
+
+// Add one sample with the raw current, VALUE, and the digital input WORD
+static inline int accum_sample(lcw_accum_t *acc, double value, long word){
+    int this;
+
+    acc->current[acc->ndata - acc->offset] = 
+            (value - acc->calzero) * acc->calslope;
+    // Like LCW_EDGES(), the last sample is not tested, so an edge only
+    // counts once the sample after it has arrived.
+    if(acc->pending >= 0){
+        if(accum_edge(acc, acc->pending))
+            return LCONF_ERROR;
+        acc->pending = -1;
+    }
+    this = (word >> acc->dibit) & 1;
+    if(acc->ndata && this != acc->last)
+        acc->pending = acc->ndata-1;
+    acc->last = this;
+    acc->ndata++;
+    return LCONF_NOERR;
+}
+
+// Bin the rotations that are complete, and discard the samples that are no
+// longer needed
+static void accum_bin(lcw_accum_t *acc){
+    unsigned int keep;
+    long dI;
+    int err;
+
+    // (3) Bin the rotations that are complete
+    while(!acc->err && acc->nproc+1 < acc->nrot){
+        dI = acc->rot[acc->nproc+1] - acc->rot[acc->nproc];
+        err = accum_rotation(acc, acc->nproc, dI, 0);
+        if(err < 0)
+            acc->err = err;
+        else if(err == 0)
+            break;
+        else
+            acc->nproc++;
+    }
+    // Discard the samples that are more than a rotation before the next
+    // one to be binned.  Nothing is discarded until the first rotation has
+    // been binned.
+    if(acc->nproc > 0){
+        dI = acc->rot[acc->nproc] - acc->rot[acc->nproc-1];
+        keep = acc->rot[acc->nproc] > dI ? acc->rot[acc->nproc] - dI : 0;
+        if(keep > acc->offset){
+            memmove(acc->current, &acc->current[keep - acc->offset],
+                    (acc->ndata - keep) * sizeof(double));
+            acc->offset = keep;
+        }
+    }
+}
+
+
+int lcw_accum_add(lcw_accum_t *acc, const double *data, unsigned int nsample){
+    unsigned int ii;
+
+    if(accum_grow(acc, nsample))
+        return LCONF_ERROR;
+    for(ii=0; ii<nsample; ii++)
+        if(accum_sample(acc, data[ii*acc->nch], 
+                (long) data[ii*acc->nch + acc->nch-1]))
+            return LCONF_ERROR;
+    accum_bin(acc);
+    return LCONF_NOERR;
+}
+
+
+int lcw_accum_add_float(lcw_accum_t *acc, const float *data, unsigned int nsample){
+    unsigned int ii;
+
+    if(accum_grow(acc, nsample))
+        return LCONF_ERROR;
+    for(ii=0; ii<nsample; ii++)
+        if(accum_sample(acc, data[ii*acc->nch], 
+                (long) data[ii*acc->nch + acc->nch-1]))
+            return LCONF_ERROR;
+    accum_bin(acc);
+    return LCONF_NOERR;
+}
+
+
+int lcw_accum_write(lcw_accum_t *acc, FILE *ff, double x, double y){
+    double *median, *theta, r[LCONF_MAX_META];
+    long dI, dImin, dImax;
+    unsigned int K, nbin, ii;
+    int err, nrecord;
+
+    // Check for enough wire-0 edges
+    if(acc->err)
+        return acc->err;
+    else if(acc->nedges < 5 || acc->nrot < 2)
+        return LCW_ERR_EDGES;
+    // The disc speed must be steady.  The last rotation is presumed to be
+    // the same as the one before it.
+    dImin = dImax = acc->rot[1] - acc->rot[0];
+    for(K=1; K<acc->nrot-1; K++){
+        dI = acc->rot[K+1] - acc->rot[K];
+        dImin = dI < dImin ? dI : dImin;
+        dImax = dI > dImax ? dI : dImax;
+    }
+    if((double)dImax / (double)dImin > LCW_SPEED_TOL)
+        return LCW_ERR_SPEED;
+    // Bin the remaining rotations
+    for(K=acc->nproc; K<acc->nrot; K++){
+        if(K < acc->nrot-1)
+            dI = acc->rot[K+1] - acc->rot[K];
+        else
+            dI = acc->rot[K] - acc->rot[K-1];
+        err = accum_rotation(acc, K, dI, 1);
+        if(err < 0){
+            acc->err = err;
+            return err;
+        }
+    }
+    acc->nproc = acc->nrot;
+
+    nbin = acc->nwire * acc->ntheta;
+    median = malloc(nbin * sizeof(double));
+    theta = malloc(acc->ntheta * sizeof(double));
+    if(!median || !theta){
+        free(median);
+        free(theta);
+        return LCW_ERR_MEM;
+    }
+    for(ii=0; ii<nbin; ii++)
+        median[ii] = lct_quant(&acc->bins[ii], 0.5);
+    memcpy(r, acc->r, acc->nwire * sizeof(double));
+    lcw_order_radii(r, acc->nwire, acc->ccw);
+    lcw_theta(acc->theta_min, acc->theta_max, acc->theta_step, theta);
+    nrecord = write_records(ff, r, acc->nwire, x, y, theta, acc->ntheta, median);
+    free(median);
+    free(theta);
+    return nrecord;
+}
+
+
+lct_quant_t * lcw_accum_quant(lcw_accum_t *acc, unsigned int iwire, unsigned int J){
+    if(iwire >= acc->nwire || J >= acc->ntheta)
+        return NULL;
+    return &acc->bins[iwire*acc->ntheta + J];
+}
+
+
+void lcw_accum_reset(lcw_accum_t *acc){
+    acc->offset = 0;
+    acc->ndata = 0;
+    acc->last = 0;
+    acc->pending = -1;
+    acc->nedges = 0;
+    acc->first = -1;
+    acc->ccw = 0;
+    acc->nrot = 0;
+    acc->nproc = 0;
+    acc->err = LCW_NOERR;
+    if(acc->bins)
+        lct_quant_init(acc->bins, acc->nwire * acc->ntheta);
+}
+
+
+void lcw_accum_free(lcw_accum_t *acc){
+    free(acc->current);
+    free(acc->rot);
+    free(acc->bins);
+    acc->current = NULL;
+    acc->rot = NULL;
+    acc->bins = NULL;
+    acc->maxdata = 0;
+    acc->maxrot = 0;
+}
+
+
+/*....................................
+.
+.   Data Files
+.
+......................................*/
+
+int lcw_load(const char *source, lc_devconf_t *dconf,
+        double **data, unsigned int *ndata){
+    FILE *ff;
+    char *line = NULL;
+    size_t linesize = 0;
+    unsigned int nch, maxdata, ii;
+    float fblock[LCONF_MAX_STCH];
+    double *temp;
+    int done;
+
+    *data = NULL;
+    *ndata = 0;
+    if(lc_load_config(dconf, 1, source))
+        return LCONF_ERROR;
+    nch = lc_nistream(dconf);
+    if(nch == 0){
+        fprintf(stderr, "LCW_LOAD: No stream channels are configured in %s\n", source);
+        return LCONF_ERROR;
+    }
+
+    ff = fopen(source, "rb");
+    if(!ff){
+        fprintf(stderr, "LCW_LOAD: Failed to open %s\n", source);
+        return LCONF_ERROR;
+    }
+    // The data begin after the timestamp line
+    while(getline(&line, &linesize, ff) > 0 && strncmp(line, "#:", 2));
+    free(line);
+
+    maxdata = LCW_NDATA_INIT;
+    *data = malloc(maxdata * nch * sizeof(double));
+    done = (*data == NULL);
+    while(!done){
+        // Grow the data array
+        if(*ndata >= maxdata){
+            temp = realloc(*data, 2 * maxdata * nch * sizeof(double));
+            if(!temp){
+                done = 1;
+                break;
+            }
+            *data = temp;
+            maxdata *= 2;
+        }
+        temp = &(*data)[(*ndata) * nch];
+        if(dconf->dataformat == LC_DF_BIN){
+            if(fread(fblock, sizeof(float), nch, ff) < nch)
+                break;
+            for(ii=0; ii<nch; ii++)
+                temp[ii] = fblock[ii];
+        }else{
+            for(ii=0; ii<nch; ii++)
+                if(fscanf(ff, "%lf", &temp[ii]) != 1)
+                    break;
+            if(ii < nch)
+                break;
+        }
+        (*ndata)++;
+    }
+    fclose(ff);
+    if(done){
+        fprintf(stderr, "LCW_LOAD: Failed to allocate memory for the data in %s\n", source);
+        free(*data);
+        *data = NULL;
+        *ndata = 0;
+        return LCONF_ERROR;
+    }
+    return LCONF_NOERR;
+}
+
+
+int lcw_post1(const char *source, const char *wdf,
+        double theta_min, double theta_max, double theta_step, int verbose){
+    lc_devconf_t dconf;
+    double *data, *current, *median, *theta, r[LCONF_MAX_META];
+    double x, y, z;
+    long *edges;
+    int *count, ccw, err, ntheta, nrecord;
+    unsigned int ndata, nch, nwire, nedges, dibit, ii, iwire;
+    char param[LCW_STR];
+    FILE *ff;
+
+    if(verbose)
+        printf("[%s] loading\n", source);
+    if(lcw_load(source, &dconf, &data, &ndata))
+        return -1;
+
+    // Extract the wire radii
+    for(nwire=0; nwire<LCONF_MAX_META; nwire++){
+        sprintf(param, "r%d", nwire);
+        if(lc_get_meta_type(&dconf, param) != LC_MT_FLT)
+            break;
+        lc_get_meta_flt(&dconf, param, &r[nwire]);
+    }
+    if(nwire == 0){
+        fprintf(stderr, "[%s] ERROR: no wire radii found in meta parameters\n", source);
+        free(data);
+        return -1;
+    }
+    // Extract the disc position
+    y = 0.;
+    if(lc_get_meta_flt(&dconf, "x", &x) || lc_get_meta_flt(&dconf, "z", &z)){
+        fprintf(stderr, "[%s] ERROR: the x and z meta parameters are missing\n", source);
+        free(data);
+        return -1;
+    }
+    if(dconf.naich < 1 || !dconf.distream){
+        fprintf(stderr, "[%s] ERROR: an analog input and a digital input stream are required\n", source);
+        free(data);
+        return -1;
+    }
+
+    nch = lc_nistream(&dconf);
+    ntheta = lcw_ntheta(theta_min, theta_max, theta_step);
+    // The highest bit in the input stream mask is the photo-reflector
+    for(dibit=0; (dconf.distream >> (dibit+1)); dibit++);
+
+    current = malloc(ndata * sizeof(double));
+    edges = malloc(ndata * sizeof(long));
+    median = malloc(nwire * ntheta * sizeof(double));
+    count = malloc(nwire * ntheta * sizeof(int));
+    theta = malloc(ntheta * sizeof(double));
+    if(!current || !edges || !median || !count || !theta){
+        err = LCW_ERR_MEM;
+    }else{
+        // Calibrate the current signal
+        for(ii=0; ii<ndata; ii++)
+            current[ii] = (data[ii*nch] - dconf.aich[0].calzero) * dconf.aich[0].calslope;
+        nedges = lcw_edges(&data[nch-1], ndata, nch, dibit, edges);
+        err = lcw_reduce(current, ndata, edges, nedges, nwire,
+                theta_min, theta_max, theta_step, median, count, &ccw);
+    }
+
+    nrecord = -1;
+    if(err){
+        fprintf(stderr, "[%s] ERROR: %s.\n", source, lcw_strerror(err));
+    }else{
+        lcw_order_radii(r, nwire, ccw);
+        lcw_theta(theta_min, theta_max, theta_step, theta);
+        if(verbose){
+            printf("[%s] x=%lf, y=%lf, z=%lf, ccw=%d\n    radii:", source, x, y, z, ccw);
+            for(iwire=0; iwire<nwire; iwire++)
+                printf(" %lf", r[iwire]);
+            printf("\n");
+        }
+        // Append to the data file
+        ff = fopen(wdf, "ab");
+        if(!ff){
+            fprintf(stderr, "[%s] ERROR: Failed to open the output file: %s\n", source, wdf);
+        }else{
+            nrecord = write_records(ff, r, nwire, x, y, theta, ntheta, median);
+            fclose(ff);
+        }
+    }
+    free(data);
+    free(current);
+    free(edges);
+    free(median);
+    free(count);
+    free(theta);
+    return nrecord;
+}
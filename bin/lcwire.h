@@ -0,0 +1,290 @@
+/*
+  This file is part of the LCONFIG laboratory configuration system.
+
+    LCONFIG is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LCONFIG is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LCONFIG.  If not, see <https://www.gnu.org/licenses/>.
+
+    Authored by C.Martin crm28@psu.edu
+*/
+
+/*  The LCWIRE header exposes the first step of the spinning disc Langmuir
+probe post-processing.  It does the same work as post1.py: raw wire current
+and the photo-reflector signal are transposed into the median current versus
+wire angle for each wire on the disc.  The results are written as WireData
+(.wdf) records of five doubles: r, x, y, theta, I.
+
+The functions are split into layers so they can be used from python with
+ctypes.  LCW_REDUCE() only needs arrays, while LCW_POST1() does the whole job
+on a data file.
+
+CHANGELOG
+
+v1.0    10/2026     ORIGINAL RELEASE
+v1.1    10/2026     Added the LCW_ACCUM_XXX() functions so the reduction can
+                    be done block by block while the data are collected.
+v1.2    10/2026     The accumulator bins each rotation as it arrives into
+                    streaming quantile bins, so its memory does not grow.
+*/
+
+#ifndef __LCWIRE
+#define __LCWIRE
+
+#include "lconfig.h"
+#include "lctools.h"
+
+/****************************
+ *                          *
+ *       Constants          *
+ *                          *
+ ****************************/
+
+#define LCW_VERSION 1.2
+
+// Default wire angle window and bin width (radians)
+#define LCW_THETA_MIN   -0.1
+#define LCW_THETA_MAX   0.1
+#define LCW_THETA_STEP  0.003
+
+// Error codes returned by LCW_REDUCE()
+#define LCW_NOERR       0
+#define LCW_ERR_EDGES   -1      // Too few encoder edges
+#define LCW_ERR_SPEED   -2      // The disc speed varies by more than 1%
+#define LCW_ERR_BIN     -3      // A sample fell outside of the angle bins
+#define LCW_ERR_MEM     -4      // Memory allocation failed
+
+// The largest allowed ratio between the longest and shortest rotations
+#define LCW_SPEED_TOL   1.01
+
+
+/****************************
+ *                          *
+ *       Accumulator        *
+ *                          *
+ ****************************/
+
+/* The accumulator reduces the data from one measurement while they are being
+ * collected.  Each rotation of the disc is binned as soon as the samples in
+ * its wire windows have arrived, and the samples are then discarded.  Each
+ * bin is an LCT_QUANT_T (see lctools.h), so the memory used does not grow
+ * with the number of samples.
+ */
+typedef struct __lcw_accum_t__ {
+    unsigned int    nch;        // Number of channels in each sample
+    unsigned int    dibit;      // Photo-reflector bit in the digital word
+    double          calslope;   // Wire current calibration slope
+    double          calzero;    // Wire current calibration offset
+    unsigned int    nwire;      // Number of wires on the disc
+    double          r[LCONF_MAX_META];  // Wire radii in disc order
+    double          theta_min;  // Wire angle bins
+    double          theta_max;
+    double          theta_step;
+    unsigned int    ntheta;     // Number of angle bins
+    lct_quant_t     *bins;      // NWIRE*NTHETA bins indexed [iwire*ntheta + J]
+    double          *current;   // Calibrated current samples not yet binned
+    unsigned int    offset;     // Sample index of CURRENT[0]
+    unsigned int    ndata;      // Number of samples added
+    unsigned int    maxdata;    // Allocated length of CURRENT
+    int             last;       // The last photo-reflector bit
+    long            pending;    // An edge waiting for the next sample (or -1)
+    unsigned int    nedges;     // Number of photo-reflector edges found
+    long            edges[5];   // The first five edges
+    int             first;      // Index of the first wire-0 edge (or -1)
+    int             ccw;        // Direction of rotation
+    long            *rot;       // Wire-0 edge indices
+    unsigned int    nrot;       // Number of wire-0 edges
+    unsigned int    maxrot;     // Allocated length of ROT
+    unsigned int    nproc;      // Number of rotations already binned
+    int             err;        // The first LCW_ERR_XXX code encountered
+} lcw_accum_t;
+
+
+/****************************
+ *                          *
+ *       Angle Bins         *
+ *                          *
+ ****************************/
+
+/* LCW_NTHETA
+LCW_THETA
+The angle bins span THETA_MIN to THETA_MAX in steps of THETA_STEP.
+LCW_NTHETA() returns the number of bins, and LCW_THETA() writes the angle at
+the center of each bin into the THETA array, which must have room for
+LCW_NTHETA() elements.  The centers are calculated exactly as
+
+    numpy.arange(theta_min + 0.5*theta_step, theta_max, theta_step)
+
+so the results are bit-for-bit the same as post1.py.
+*/
+int lcw_ntheta(double theta_min, double theta_max, double theta_step);
+
+void lcw_theta(double theta_min, double theta_max, double theta_step,
+        double *theta);
+
+
+/****************************
+ *                          *
+ *       Reduction          *
+ *                          *
+ ****************************/
+
+/* LCW_EDGES
+Find the transitions of bit DIBIT in the digital input stream.  DWORD points
+to the first digital input word, and STRIDE is the number of doubles between
+successive words (the number of channels in an interleaved data array).  The
+index of the last sample before each transition is written to EDGES, which
+must have room for NDATA elements.  Like LData.get_dievents() in lconfig.py,
+the last sample is not tested.
+
+Returns the number of edges found.
+*/
+unsigned int lcw_edges(const double *dword, unsigned int ndata,
+        unsigned int stride, unsigned int dibit, long *edges);
+
+
+/* LCW_REDUCE
+Bin the wire current by wire angle and calculate the median in each bin.
+
+CURRENT is an array of NDATA calibrated current samples.  EDGES is an array
+of NEDGES photo-reflector edge indices (see LCW_EDGES).  NWIRE is the number of
+wires on the disc, and THETA_MIN, THETA_MAX, and THETA_STEP define the angle
+bins.
+
+The disc direction is determined from the first five edges, and the wire-0
+edges are used to calculate the angle of every sample in the windows around
+each wire.  The MEDIAN and COUNT arrays must have room for
+NWIRE * LCW_NTHETA() elements.  They are indexed as [iwire*ntheta + J].  Empty
+bins have a median of zero.  CCW is set to 1 if the disc rotation was
+counter-clockwise and 0 otherwise.  When the rotation is clockwise, the
+wires are encountered in reverse order; see LCW_ORDER_RADII().
+
+Returns LCW_NOERR on success or one of the LCW_ERR_XXX codes on failure.
+*/
+int lcw_reduce(const double *current, unsigned int ndata,
+        const long *edges, unsigned int nedges, unsigned int nwire,
+        double theta_min, double theta_max, double theta_step,
+        double *median, int *count, int *ccw);
+
+
+/* LCW_STRERROR
+Returns a string describing one of the LCW_ERR_XXX codes.
+*/
+const char * lcw_strerror(int err);
+
+
+/* LCW_ORDER_RADII
+Put the NWIRE wire radii in R in the order that the wires appear in the
+LCW_REDUCE() results.  When CCW is zero, the order is reversed, and then the
+last radius is moved to the front.  When CCW is non-zero, R is unchanged.
+*/
+void lcw_order_radii(double *r, unsigned int nwire, int ccw);
+
+
+/****************************
+ *                          *
+ *   Block-wise Reduction   *
+ *                          *
+ ****************************/
+
+/* LCW_ACCUM_INIT
+Configure an accumulator from the device configuration, DCONF.  The wire 
+radii are read from the r0, r1, ... meta parameters, the first analog input
+is the wire current, and the highest bit of the digital input stream is the
+photo-reflector.  THETA_MIN, THETA_MAX, and THETA_STEP define the angle bins
+as they do for LCW_REDUCE().
+
+Returns LCONF_NOERR on success and LCONF_ERROR on failure.
+*/
+int lcw_accum_init(lcw_accum_t *acc, lc_devconf_t *dconf,
+        double theta_min, double theta_max, double theta_step);
+
+/* LCW_ACCUM_ADD
+Add a block of NSAMPLE interleaved samples to the accumulator.  DATA is 
+the raw data as it is returned by LC_STREAM_READ() or LC_STREAM_PEEK(); the
+calibration is applied here.  The photo-reflector edges are found as the 
+samples arrive, and every rotation whose wire windows are complete is 
+binned.
+
+Returns LCONF_NOERR on success and LCONF_ERROR if memory could not be 
+allocated.
+*/
+int lcw_accum_add(lcw_accum_t *acc, const double *data, unsigned int nsample);
+
+/* LCW_ACCUM_ADD_FLOAT
+The same as LCW_ACCUM_ADD(), but DATA is a single-precision block as it is
+returned by LC_STREAM_PEEK_FLOAT().
+*/
+int lcw_accum_add_float(lcw_accum_t *acc, const float *data, unsigned int nsample);
+
+/* LCW_ACCUM_WRITE
+Bin the last rotations, and write the WireData records to the open file, FF.
+The current in each record is the median of its bin.  X and Y are the disc
+position.  On success, the number of records written is returned.  On 
+failure, one of the LCW_ERR_XXX codes is returned, and nothing is written.
+
+Bins with LCT_QUANT_EXACT or fewer samples have the same medians that 
+LCW_REDUCE() (and post1.py) would calculate.  The medians of larger bins are
+estimated from their histograms.
+*/
+int lcw_accum_write(lcw_accum_t *acc, FILE *ff, double x, double y);
+
+/* LCW_ACCUM_QUANT
+Returns the bin for wire IWIRE and angle bin J, so that other quantiles can
+be calculated with LCT_QUANT().  Returns NULL if either is out of range.  
+The bins are only complete after LCW_ACCUM_WRITE() is called.  The wires 
+are in disc order; see LCW_ORDER_RADII().
+*/
+lct_quant_t * lcw_accum_quant(lcw_accum_t *acc, unsigned int iwire, unsigned int J);
+
+/* LCW_ACCUM_RESET
+LCW_ACCUM_FREE
+LCW_ACCUM_RESET() discards the accumulated data so the accumulator can be
+used for the next measurement.  The memory is kept.  LCW_ACCUM_FREE() 
+releases the memory.
+*/
+void lcw_accum_reset(lcw_accum_t *acc);
+
+void lcw_accum_free(lcw_accum_t *acc);
+
+
+/****************************
+ *                          *
+ *       Data Files         *
+ *                          *
+ ****************************/
+
+/* LCW_LOAD
+Load an LConfig data file.  The configuration header is loaded into DCONF,
+and the data are read into a new array of doubles, DATA, with NDATA rows.
+There is one column for each of the LC_NISTREAM() channels.  The calibration
+is NOT applied.  The application is responsible for calling free() on DATA.
+
+Returns LCONF_NOERR on success and LCONF_ERROR on failure.
+*/
+int lcw_load(const char *source, lc_devconf_t *dconf,
+        double **data, unsigned int *ndata);
+
+
+/* LCW_POST1
+Perform the whole first post-processing step on the data file, SOURCE, and
+append the results to the WireData file, WDF.  The wire radii are read from
+the r0, r1, ... meta parameters, and the disc position from the x and z
+meta parameters.  The first analog input is the wire current, and the digital
+input stream is the photo-reflector.  When VERBOSE is non-zero, progress
+is printed to stdout.
+
+Returns the number of records written, or -1 on failure.
+*/
+int lcw_post1(const char *source, const char *wdf,
+        double theta_min, double theta_max, double theta_step, int verbose);
+
+#endif
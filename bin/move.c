@@ -8,27 +8,32 @@
 const char config_default[] = "wscan.conf";
 
 const char help_text[] = \
-"move <options> <axis> <distance>\n"\
+"move <options> <axis> <distance> [<axis> <distance> ...]\n"\
 "\n"\
 "Move an x,y,z stepper motor-driven translation stage a specified\n"\
 "distance along the specified axis. The axis must be a single character\n"\
 "specifying x-, y-, or z-axis motion.  Options are listed below.\n"\
 "\n"\
+"More than one axis and distance pair may be given.  The axes are moved\n"\
+"together, and the motion is complete when the longest move is done.\n"\
+"For example, to move 10 mm in x and -2 mm in z at the same time,\n"\
+"    $ move x 10 z _2\n"\
+"\n"\
 "To allow negative distances, use the underscore (\"_\") character instead\n"\
 "of a hyphen for the negative sign.  For example, to move -10 mm,\n"
 "    $ move x _10\n"
 "\n"\
 "The move binary uses the same \"wscan.conf\" configuration file used by\n"\
 "the wscan binary to define axis motion and calibration. See \"wscan -h\"\n"\
-"for more information.\n"\
+"for more information.  The x, z, and y axes use the first, second, and\n"\
+"third pulse outputs.\n"\
 "\n"\
 "-c <configfile>\n"\
 "  Override the default configuration file: \"wscan.conf\".\n"\
 "-e\n"\
-"  Exit quickly. By default, the program calculates the time required for\n"\
-"  the motion to complete and waits appropriately. With the -e option set,\n"\
-"  the appropriate number of pulses are sent and the binary exits\n"\
-"  immediately\n"\
+"  Exit quickly. By default, the program waits until the motion is\n"\
+"  complete and has settled. With the -e option set, the appropriate\n"\
+"  number of pulses are sent and the binary exits immediately\n"\
 "\n"\
 "-h\n"\
 "  Display this help text and exit immediately.\n"\
@@ -42,10 +47,14 @@ int main(int argc, char *argv[]){
     double distance = 0;
     char *config = (char *) config_default;
     char *distance_s;
-    int distance_i;
-    int efch;
+    int distance_i[AX_GROUP_MAX];
+    int efch[AX_GROUP_MAX];
+    char axes[AX_GROUP_MAX];
+    int naxes, index, jj;
     lc_devconf_t dconf;
-    AxisIterator_t ax;
+    AxisIterator_t ax[AX_GROUP_MAX];
+    AxisIterator_t *group[AX_GROUP_MAX];
+    double dist[AX_GROUP_MAX];
     
     // Parse command-line options
     while((ch = getopt(argc, argv, "hec:")) >= 0){
@@ -66,47 +75,61 @@ int main(int argc, char *argv[]){
     }
     
     //
-    // Parse the non-option arguments - two are required
+    // Parse the non-option arguments - they come in axis/distance pairs
     //
-    if(argc - optind != 2){
-        fprintf(stderr, "MOVE: Two non-option arguments required. Use -h for more info.\n");
+    if(argc - optind < 2 || (argc - optind) % 2){
+        fprintf(stderr, "MOVE: Axis and distance pairs are required. Use -h for more info.\n");
         return -1;
     }
-    
-    //
-    // First, parse the axis
-    //
-    if(strlen(argv[argc-2]) != 1){
-        fprintf(stderr, "MOVE: The axis must be a single character.\n");
-        return -1;
-    }
-    axis = argv[argc-2][0];
-    // Check the axis
-    if(axis == 'x' || axis == 'X'){
-        axis = 'x';
-        efch = 0;
-    }else if(axis == 'y' || axis == 'Y'){
-        axis = 'y';
-        fprintf(stderr, "MOVE: y-axis motion is not currently supported.\n");
-        return -1;
-    }else if(axis == 'z' || axis == 'Z'){
-        axis = 'z';
-        efch = 1;
-    }else{
-        fprintf(stderr, "MOVE: The axis must be 'x', 'y', or 'z'.\n");
+    naxes = (argc - optind) / 2;
+    if(naxes > AX_GROUP_MAX){
+        fprintf(stderr, "MOVE: No more than %d axes may be moved at once.\n", AX_GROUP_MAX);
         return -1;
     }
     
-    //
-    // Parse the distance
-    //
-    distance_s = argv[argc-1];
-    if(distance_s[0] == '_')
-        distance_s[0] = '-';
-    
-    if(1 != sscanf(distance_s, "%lf", &distance)){
-        fprintf(stderr, "MOVE: The distance must be a number. Use -h for more info.\n");
-        return -1;
+    for(index=0; index<naxes; index++){
+        //
+        // First, parse the axis
+        //
+        if(strlen(argv[optind + 2*index]) != 1){
+            fprintf(stderr, "MOVE: The axis must be a single character.\n");
+            return -1;
+        }
+        axis = argv[optind + 2*index][0];
+        // Check the axis
+        if(axis == 'x' || axis == 'X'){
+            axis = 'x';
+            efch[index] = 0;
+        }else if(axis == 'y' || axis == 'Y'){
+            axis = 'y';
+            efch[index] = 2;
+        }else if(axis == 'z' || axis == 'Z'){
+            axis = 'z';
+            efch[index] = 1;
+        }else{
+            fprintf(stderr, "MOVE: The axis must be 'x', 'y', or 'z'.\n");
+            return -1;
+        }
+        for(jj=0; jj<index; jj++){
+            if(axes[jj] == axis){
+                fprintf(stderr, "MOVE: The %c-axis was given more than once.\n", axis);
+                return -1;
+            }
+        }
+        axes[index] = axis;
+        
+        //
+        // Parse the distance
+        //
+        distance_s = argv[optind + 2*index + 1];
+        if(distance_s[0] == '_')
+            distance_s[0] = '-';
+        
+        if(1 != sscanf(distance_s, "%lf", &distance)){
+            fprintf(stderr, "MOVE: The distance must be a number. Use -h for more info.\n");
+            return -1;
+        }
+        dist[index] = distance;
     }
         
     //
@@ -126,23 +149,27 @@ int main(int argc, char *argv[]){
         return -1;
     }
     
-    //
-    // Configure the axis motion
-    //
-    if(ax_init(&ax, &dconf, efch, axis)){
-        fprintf(stderr, "MOVE: Failed while initializing the axis for motion.\n");
-        lc_close(&dconf);
-        return -1;
+    for(index=0; index<naxes; index++){
+        //
+        // Configure the axis motion
+        //
+        if(ax_init(&ax[index], &dconf, efch[index], axes[index])){
+            fprintf(stderr, "MOVE: Failed while initializing the axis for motion.\n");
+            lc_close(&dconf);
+            return -1;
+        }
+        group[index] = &ax[index];
+        
+        // Calculate the motion parameters and tell the user
+        distance_i[index] = (int) (dist[index] / ax[index].cal);
+        printf("  %c %+0.3f%s (%+d)\n", axes[index], dist[index], 
+                ax[index].units, distance_i[index]);
     }
     
-    // Calculate the motion parameters and tell the user
-    distance_i = (int) distance / ax.cal;
-    printf("  %c %+f0.3%s (%+d)\n", axis, distance, ax.units, distance_i);
-    
     //
     // Execute the motion
     //
-    if(ax_move(&ax,distance_i, wait)){
+    if(ax_group_move(group, distance_i, naxes, wait)){
         fprintf(stderr, "MOVE: Error during motion!\n");
         lc_close(&dconf);
         return -1;
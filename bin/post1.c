@@ -0,0 +1,132 @@
+#include "lconfig.h"
+#include "lcwire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+#define POST1_MAX_PATH  512     // Longest supported file path
+
+const char output_default[] = "output.wdf";
+
+const char help_text[] = \
+"post1 [-fqh] [-o OUTPUT] SOURCE\n"\
+"\n"\
+"Langmuir probe post processing step 1.  This is a native implementation\n"\
+"of post1.py.  The SOURCE directory is expected to contain a series of\n"\
+"*.dat files written by wscan with the raw wire current and the digital\n"\
+"photo-reflector signal.  Each is transposed from a time series of current\n"\
+"measurements into the median current versus disc angle for each wire, and\n"\
+"the results are written to a WireData (.wdf) file.\n"\
+"\n"\
+"Files beginning with an underscore (_) are ignored, which allows files to\n"\
+"be excluded from analysis without their deletion.  Archives (*.lca) are\n"\
+"not supported; use post1.py instead.\n"\
+"\n"\
+"-f\n"\
+"  Force overwriting the output file if it already exists.\n"\
+"\n"\
+"-h\n"\
+"  Display this help text and exit immediately.\n"\
+"\n"\
+"-o OUTPUT\n"\
+"  Override the default output file: SOURCE/output.wdf\n"\
+"\n"\
+"-q\n"\
+"  Operate quietly; do not print to stdout.\n"\
+"\n"\
+"(c)2026 Christopher R. Martin\n";
+
+
+int main(int argc, char *argv[]){
+    int ch;
+    int force = 0, verbose = 1;
+    int nfile = 0, nerror = 0;
+    char *output = NULL, *source;
+    char path[POST1_MAX_PATH];
+    size_t length;
+    DIR *dd;
+    struct dirent *entry;
+    struct stat sb;
+    FILE *ff;
+
+    // Parse command-line options
+    while((ch = getopt(argc, argv, "hfqo:")) >= 0){
+        switch(ch){
+        case 'h':
+            printf("%s",help_text);
+            return 0;
+        case 'f':
+            force = 1;
+            break;
+        case 'q':
+            verbose = 0;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "POST1: Unrecognized option: %c\n", (char) ch);
+            return -1;
+        }
+    }
+    if(optind != argc-1){
+        fprintf(stderr, "POST1: Requires exactly one SOURCE directory.\n");
+        return -1;
+    }
+    source = argv[optind];
+
+    // If the output file was not explicitly specified, generate it
+    if(output == NULL){
+        snprintf(path, POST1_MAX_PATH, "%s/%s", source, output_default);
+        output = path;
+    }
+    // Does the output file already exist?
+    if(!stat(output, &sb)){
+        if(!force){
+            fprintf(stderr, "POST1: (-f to override) File exists: %s\n", output);
+            return -1;
+        }else if(verbose)
+            printf("Warning: File exists - overwriting %s\n", output);
+    }
+    // Truncate the output file; lcw_post1() appends to it
+    ff = fopen(output, "wb");
+    if(!ff){
+        fprintf(stderr, "POST1: Failed to open the output file: %s\n", output);
+        return -1;
+    }
+    fclose(ff);
+    // Copy the output so path can be reused
+    output = strdup(output);
+
+    dd = opendir(source);
+    if(!dd){
+        fprintf(stderr, "POST1: Failed to open the source directory: %s\n", source);
+        free(output);
+        return -1;
+    }
+    // Loop over all data files
+    while((entry = readdir(dd))){
+        length = strlen(entry->d_name);
+        // Ignore files that are not data files or are marked for exclusion
+        if(length < 4 || strcmp(&entry->d_name[length-4], ".dat") ||
+                entry->d_name[0] == '_')
+            continue;
+        snprintf(path, POST1_MAX_PATH, "%s/%s", source, entry->d_name);
+        if(stat(path, &sb) || !S_ISREG(sb.st_mode))
+            continue;
+        nfile++;
+        if(lcw_post1(path, output, LCW_THETA_MIN, LCW_THETA_MAX,
+                LCW_THETA_STEP, verbose) < 0)
+            nerror++;
+    }
+    closedir(dd);
+    free(output);
+
+    if(verbose)
+        printf("Processed %d files with %d errors.\n", nfile, nerror);
+    return nerror ? -1 : 0;
+}
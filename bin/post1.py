@@ -18,6 +18,7 @@ import numpy as np
 import pickle
 import multiprocessing as mp
 import matplotlib.pyplot as plt
+import ctypes
 import wire
 
 
@@ -26,6 +27,30 @@ theta_max = .1
 theta_step = .003
 
 
+# The native reduction library is loaded on first use
+_lcwire = None
+
+def lcwire():
+    """Load the native wire reduction library, liblcwire.so
+    lib = lcwire()
+
+The library is built by "make liblcwire.so" and is expected to reside in 
+the same directory as this script.
+"""
+    global _lcwire
+    if _lcwire is None:
+        lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'liblcwire.so'))
+        dptr = np.ctypeslib.ndpointer(dtype=np.float64, flags='C_CONTIGUOUS')
+        lptr = np.ctypeslib.ndpointer(dtype=np.int64, flags='C_CONTIGUOUS')
+        iptr = np.ctypeslib.ndpointer(dtype=np.intc, flags='C_CONTIGUOUS')
+        lib.lcw_reduce.restype = ctypes.c_int
+        lib.lcw_reduce.argtypes = [dptr, ctypes.c_uint, lptr, ctypes.c_uint, 
+                ctypes.c_uint, ctypes.c_double, ctypes.c_double, ctypes.c_double, 
+                dptr, iptr, ctypes.POINTER(ctypes.c_int)]
+        _lcwire = lib
+    return _lcwire
+
+
 
 def post1(workerdata):
     """Accepts a path to the .dat file to load and a .p1d file to generate
@@ -36,6 +61,7 @@ data, and appends it to a WSOLVE wire data file.  The workerdata dictionary
 MUST contain the following MANDATORY data elements:
 
     source      The path to the LConfig data file to read in
+    entry       (optional) The record to read if source is an archive
     theta_min   The minimum wire angle to include
     theta_max   The maximum wire angle to include
     theta_step  The wire angle increment when binning data
@@ -43,6 +69,7 @@ MUST contain the following MANDATORY data elements:
     wdlock      A lock (mutex) for writing to the file
     verbose     True/False write status updates to stdout?
     view        True/False generate a plot of the results?
+    native_f    (optional) True/False bin the data with liblcwire.so?
 """
     source = workerdata['source']
     theta_min = workerdata['theta_min']
@@ -52,13 +79,25 @@ MUST contain the following MANDATORY data elements:
     wdlock = workerdata['wdlock']
     verbose_f = workerdata['verbose_f']
     view_f = workerdata['view_f']
+    native_f = workerdata.get('native_f', False)
 
 
+    # Archive records are identified by their index
+    if 'entry' in workerdata:
+        entry = workerdata['entry']
+        target = source.rpartition('.')[0] + f'_{entry:04d}'
+        source = f'{source}:{entry}'
+    else:
+        entry = None
+        target = source.rpartition('.')[0]
 
     if verbose_f:
         print(f'[{source}] loading')
         
-    conf,data = lc.load(source)
+    if entry is None:
+        conf,data = lc.load(source)
+    else:
+        conf,data = lc.LArchive(workerdata['source'])[entry]
 
     # Extract the wire radii
     wire_r = []
@@ -99,6 +138,44 @@ MUST contain the following MANDATORY data elements:
     wire_z = conf.meta_values['z']
     wire_y = 0.
     
+    # The native library does steps (1) through (3) below, but it only
+    # calculates the median and count in each bin.
+    if native_f:
+        lib = lcwire()
+        current = np.ascontiguousarray(current, dtype=np.float64)
+        edges_I = np.ascontiguousarray(edges_I, dtype=np.int64)
+        wire_median = np.zeros((Nwire,Ntheta), dtype=np.float64)
+        wire_count = np.zeros((Nwire,Ntheta), dtype=np.intc)
+        ccw = ctypes.c_int(0)
+        err = lib.lcw_reduce(current, Ndata, edges_I, len(edges_I), Nwire,
+                theta_min, theta_max, theta_step, wire_median, wire_count, 
+                ctypes.byref(ccw))
+        if err == -1:
+            print(f'[{source}] ERROR: Too few photo-reflector edges.', file=sys.stderr)
+            return
+        elif err == -2:
+            print(f'[{source}] ERROR: The disc speed changes by more than 1%.', file=sys.stderr)
+            return
+        elif err == -3:
+            raise IndexError(f'[{source}] Wire angle bin out of range')
+        elif err:
+            raise MemoryError(f'[{source}] liblcwire memory allocation failed')
+        is_ccw = bool(ccw.value)
+        if not is_ccw:
+            wire_r.reverse()
+            wire_r.insert(0, wire_r.pop(-1))
+        if verbose_f:
+            print(f'[{source}] x={wire_x}, y={wire_y}, z={wire_z}, ccw={is_ccw}')
+            print(f'    radii: {wire_r}')
+        wdlock.acquire()
+        try:
+            for iwire in range(Nwire):
+                for J in range(Ntheta):
+                    wdf.writeline(wire_r[iwire], wire_x, wire_y, wire_theta[J], wire_median[iwire,J])
+        finally:
+            wdlock.release()
+        return
+    
     # The digital signal is nominally high over most of the rotation.
     # It drops when a stripe of dark tape passes under the 
     # photoreflector.  There are two pieces of tape - each of a 
@@ -138,7 +215,7 @@ MUST contain the following MANDATORY data elements:
         is_ccw = False
         # Adjust the wire radius order
         wire_r.reverse()
-        wire_r.insert(0, r.pop(-1))
+        wire_r.insert(0, wire_r.pop(-1))
         
     # edges_I[ii] is now the index of the first wire-0 edge
     # is_ccw now indicates the direction of disc rotation. When True
@@ -166,9 +243,15 @@ MUST contain the following MANDATORY data elements:
         print(f'[{source}] x={wire_x}, y={wire_y}, z={wire_z}, ccw={is_ccw}')
         print(f'    radii: {wire_r}')
     
-    # Initialize a 2D list of bins bins to accumulate a histogram
-    #   bins[iwire][I]
-    bins = [[ [] for _ in range(Ntheta)] for _ in range(Nwire)]
+    # Each segment of data that falls in the angle window of one wire on
+    # one rotation is described by its first and last (+1) index, the 
+    # index where the wire angle is zero, the angle rotated per sample, 
+    # and the wire index.
+    seg_Imin = []
+    seg_Imax = []
+    seg_Izero = []
+    seg_dtheta = []
+    seg_wire = []
     
     # Before we loop over the bulk of the data, we'll look at data before
     # the first trigger event.
@@ -194,14 +277,11 @@ MUST contain the following MANDATORY data elements:
             temp = Imin
             Imin = Imax
             Imax = temp
-
-        # Loop through the individual measurements
-        for ii in range(Imin, Imax):
-            # Calculate the sample angle
-            theta = (ii-Izero) * dtheta
-            # Where does this sample belong?
-            J = int(np.floor((theta - theta_min)/theta_step))
-            bins[iwire][J].append(current[ii])
+        seg_Imin.append(Imin)
+        seg_Imax.append(Imax)
+        seg_Izero.append(Izero)
+        seg_dtheta.append(dtheta)
+        seg_wire.append(iwire)
     
     # Next, loop through the other rotations
     for I, dI, in zip(edges_I, edges_dI):
@@ -220,30 +300,62 @@ MUST contain the following MANDATORY data elements:
                 temp = Imin
                 Imin = Imax
                 Imax = temp
-            # use ii for an iterator over individual indices
-            for ii in range( Imin, Imax ):
-                # Calculate the sample angle
-                theta = (ii-Izero) * dtheta
-                # Where does this sample belong?
-                J = int(np.floor((theta - theta_min)/theta_step))
-                bins[iwire][J].append(current[ii])
+            seg_Imin.append(Imin)
+            seg_Imax.append(Imax)
+            seg_Izero.append(Izero)
+            seg_dtheta.append(dtheta)
+            seg_wire.append(iwire)
     
-    wire_mean = np.zeros((Nwire,Ntheta), dtype=float)
-    wire_median = np.zeros((Nwire,Ntheta), dtype=float)
-    wire_std = np.zeros((Nwire,Ntheta), dtype=float)
-    wire_min = np.zeros((Nwire,Ntheta), dtype=float)
-    wire_max = np.zeros((Nwire,Ntheta), dtype=float)
-    wire_count = np.zeros((Nwire,Ntheta), dtype=int)
-    # Calculate statistics on each bin
-    for iwire in range(Nwire):
-        for J in range(Ntheta):
-            wire_count[iwire,J] = len(bins[iwire][J])
-            if(bins[iwire][J]):
-                wire_mean[iwire,J] = np.mean(bins[iwire][J])
-                wire_median[iwire,J] = np.median(bins[iwire][J])
-                wire_std[iwire,J] = np.std(bins[iwire][J])
-                wire_min[iwire,J] = np.min(bins[iwire][J])
-                wire_max[iwire,J] = np.max(bins[iwire][J])
+    # Expand the segments into one array of sample indices, I, in the 
+    # same order the segments were listed.
+    seg_Imin = np.array(seg_Imin, dtype=int)
+    seg_N = np.maximum(np.array(seg_Imax, dtype=int) - seg_Imin, 0)
+    seg_start = np.cumsum(seg_N) - seg_N
+    I = np.arange(np.sum(seg_N)) + np.repeat(seg_Imin - seg_start, seg_N)
+    # Calculate the sample angles and the bin where each sample belongs
+    theta = (I - np.repeat(seg_Izero, seg_N)) * np.repeat(seg_dtheta, seg_N)
+    J = np.floor((theta - theta_min)/theta_step).astype(int)
+    # Negative bin indices wrap around, as list indices would
+    J[J<0] += Ntheta
+    if np.any(J >= Ntheta) or np.any(J < 0):
+        raise IndexError(f'[{source}] Wire angle bin out of range')
+    
+    # Group the samples by bin.  The sort is stable, so the samples in 
+    # each bin stay in the order they were collected.
+    key = np.repeat(seg_wire, seg_N) * Ntheta + J
+    order = np.argsort(key, kind='stable')
+    key = key[order]
+    values = current[I[order]]
+    
+    count = np.bincount(key, minlength=Nwire*Ntheta)
+    filled = count > 0
+    first = np.cumsum(count) - count
+    wire_count = count.reshape((Nwire,Ntheta))
+    
+    wire_mean = np.zeros(Nwire*Ntheta, dtype=float)
+    wire_median = np.zeros(Nwire*Ntheta, dtype=float)
+    wire_std = np.zeros(Nwire*Ntheta, dtype=float)
+    wire_min = np.zeros(Nwire*Ntheta, dtype=float)
+    wire_max = np.zeros(Nwire*Ntheta, dtype=float)
+    if np.any(filled):
+        wire_min[filled] = np.minimum.reduceat(values, first[filled])
+        wire_max[filled] = np.maximum.reduceat(values, first[filled])
+        # Sort the values within each bin to find the medians
+        svalues = values[np.lexsort((values, key))]
+        lo = first + (count-1)//2
+        hi = first + count//2
+        wire_median[filled] = (svalues[lo[filled]] + svalues[hi[filled]])/2
+        # The mean and standard deviation use numpy's pairwise summation, 
+        # so they are computed bin by bin from the grouped values.
+        for jj in np.flatnonzero(filled):
+            v = values[first[jj]:first[jj]+count[jj]]
+            wire_mean[jj] = np.mean(v)
+            wire_std[jj] = np.std(v)
+    wire_mean = wire_mean.reshape((Nwire,Ntheta))
+    wire_median = wire_median.reshape((Nwire,Ntheta))
+    wire_std = wire_std.reshape((Nwire,Ntheta))
+    wire_min = wire_min.reshape((Nwire,Ntheta))
+    wire_max = wire_max.reshape((Nwire,Ntheta))
 
     
     # If ordered to make images summarizing the data
@@ -273,10 +385,7 @@ MUST contain the following MANDATORY data elements:
             ax[iwire,1].grid(True)
             ax[iwire,1].set_title(f'Wire {iwire} Histogram')
         # Build a file name and save it
-        # Strip off the file extension
-        target,_,_ = source.rpartition('.')
-        target = target + '.png'
-        fig.savefig(target)
+        fig.savefig(target + '.png')
         plt.close(fig)
         
     # Append to the data file
@@ -300,7 +409,8 @@ if __name__ == '__main__':
             epilog=\
 """The source directory is expected to contain a series of *.dat files with
 raw data collected from the Langmuir probe are wire current and a 
-digital photo-reflector signal.  The first post processing step 
+digital photo-reflector signal.  The source may also be a single archive
+(*.lca) written by wscan -a, in which case every record is processed.  The first post processing step 
 translates these from a time series of current measurements into current
 versus disc angle.
 
@@ -327,7 +437,7 @@ by interpolation.  The wires are presumed to be equally spaced around
 the disc.
 """)
     parser.add_argument('source',
-            help='The directory containing .dat files from a scan',
+            help='The directory containing .dat files or the .lca archive from a scan',
             type=str)
             
     parser.add_argument('-f', '--force', 
@@ -355,12 +465,20 @@ the disc.
             dest='view',
             help='Generate plots of the wire data',
             action='store_true')
+
+    parser.add_argument('-n', '--native', 
+            dest='native',
+            help='Bin the wire data with the native liblcwire.so library (no plots)',
+            action='store_true')
             
     args = parser.parse_args()
     
     # If the output file was not explicitly specified, generate it
     if args.output is None:
-        args.output = os.path.join(args.source, 'output.wdf')
+        if os.path.isfile(args.source):
+            args.output = os.path.join(os.path.dirname(args.source), 'output.wdf')
+        else:
+            args.output = os.path.join(args.source, 'output.wdf')
     # Does the output file already exist?
     if os.path.isfile(args.output):
         if args.force:
@@ -378,8 +496,22 @@ the disc.
 
     # Open the output file
     with wire.WireData(args.output).open('w') as wdf:
+        # An archive contributes one worker argument per record
+        if os.path.isfile(args.source):
+            for entry in range(len(lc.LArchive(args.source))):
+                wargs.append({
+                        'source':args.source,
+                        'entry':entry,
+                        'theta_min':theta_min,
+                        'theta_max':theta_max,
+                        'theta_step':theta_step,
+                        'wiredata':wdf,
+                        'wdlock':wdlock,
+                        'verbose_f':not args.quiet,
+                        'view_f':args.view,
+                        'native_f':args.native})
         # Loop over all data files
-        for dfile in os.listdir(args.source):
+        for dfile in (os.listdir(args.source) if os.path.isdir(args.source) else []):
             # Establish the path to the current file
             source = os.path.join(args.source, dfile)
             # If this file is a data file (not marked for exclusion
@@ -395,7 +527,8 @@ the disc.
                         'wiredata':wdf,
                         'wdlock':wdlock,
                         'verbose_f':not args.quiet,
-                        'view_f':args.view}
+                        'view_f':args.view,
+                        'native_f':args.native}
                 wargs.append(this_warg)
             
         # If there is only one worker allowed at a time, do not use multiprocessing
@@ -0,0 +1,951 @@
+#include "lconfig.h"
+#include "wscan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* ScanPlan
+ *  A struct to manage the order in which the points of a scan are
+ * visited.  A plan is an ordered list of target positions for one to
+ * PLAN_MAX_AXES AxisIterator_t axes.  The targets are either the grid
+ * defined by each axis' step and n meta parameters, visited in one of
+ * the PLAN_XXX orders, or an arbitrary list of points read from a file.
+ *
+ * The plan is executed with the AxisIterator primitives; PLAN_NEXT()
+ * works like AX_ITER_NEXT(), and the steps it returns are passed to
+ * AX_GROUP_MOVE().
+ */
+
+#ifndef __WPLAN_H__
+#define __WPLAN_H__
+
+#define PLAN_MAX_AXES   AX_GROUP_MAX
+#define PLAN_2OPT_PASSES 32         // Most improvement passes over a point list
+
+// Traversal orders
+#define PLAN_RASTER     0           // Every row starts at index 0
+#define PLAN_SERPENTINE 1           // Alternate rows are reversed
+#define PLAN_SPIRAL     2           // Rectangular spiral from the corner inward
+#define PLAN_HILBERT    3           // Generalized Hilbert curve
+#define PLAN_LIST       4           // Points from a file in the file's order
+#define PLAN_AUTO       5           // The shortest of the above
+#define PLAN_NORDER     6
+
+const char *plan_order_names[PLAN_NORDER] = {
+    "raster", "serpentine", "spiral", "hilbert", "list", "auto"};
+
+typedef struct _ScanPlan {
+    int             naxes;  // Number of axes in the plan
+    AxisIterator_t  *ax[PLAN_MAX_AXES];  // The axes; the first moves fastest
+    int             order;  // The PLAN_XXX order used to build the plan
+    int             npoint; // Number of points in the plan
+    int             *index; // Grid indices [point*naxes + axis]
+    int             *target; // Target positions in steps [point*naxes + axis]
+    // These are "live" parameters in use during a scan
+    int             _point; // Index of the current point
+} ScanPlan_t;
+
+
+/* PLAN_ORDER - Look up an order by name
+ *
+ * Returns the PLAN_XXX order for the name, or -1 if it is not recognized.
+ */
+int plan_order(const char *name){
+    int ii;
+    for(ii=0; ii<PLAN_NORDER; ii++)
+        if(strcmp(name, plan_order_names[ii]) == 0)
+            return ii;
+    return -1;
+}
+
+
+/* PLAN_DISTANCE - Steps between two points
+ *
+ * The axes move together (see AX_GROUP_MOVE()), so the time between two
+ * points is set by the axis with the most steps.  Returns the largest
+ * number of steps on any of the NAXES axes between the targets A and B.
+ */
+int plan_distance(const int *a, const int *b, int naxes){
+    int ii, d, dmax = 0;
+    for(ii=0; ii<naxes; ii++){
+        d = abs(a[ii] - b[ii]);
+        dmax = d > dmax ? d : dmax;
+    }
+    return dmax;
+}
+
+
+/* PLAN_COST - Total steps in a plan
+ *
+ * Returns the sum of PLAN_DISTANCE() from the current axis positions to
+ * the first point, between each point and the next, and from the last
+ * point back to the current positions.
+ */
+long plan_cost(ScanPlan_t *plan){
+    int home[PLAN_MAX_AXES], ii;
+    long cost = 0;
+
+    if(plan->npoint <= 0)
+        return 0;
+    for(ii=0; ii<plan->naxes; ii++)
+        home[ii] = plan->ax[ii]->state;
+    cost += plan_distance(home, plan->target, plan->naxes);
+    for(ii=1; ii<plan->npoint; ii++)
+        cost += plan_distance(&plan->target[(ii-1)*plan->naxes],
+                &plan->target[ii*plan->naxes], plan->naxes);
+    cost += plan_distance(&plan->target[(plan->npoint-1)*plan->naxes],
+            home, plan->naxes);
+    return cost;
+}
+
+
+/* PLAN_DIV2 - Integer division by two that rounds toward -infinity
+ */
+int plan_div2(int a){
+    return (a >= 0) ? a/2 : -((1-a)/2);
+}
+
+
+/* PLAN_HILBERT2D - Generalized Hilbert curve
+ *
+ * Writes the (i,j) indices of a generalized Hilbert curve over a
+ * rectangle into LAYER and returns the number written.  Unlike the
+ * classic curve, the rectangle does not need to be a square with a
+ * power-of-two side.  The curve starts at (X,Y), (AX,AY) spans the major
+ * side, and (BX,BY) spans the minor side.  Consecutive points are
+ * neighbors except for at most one diagonal step when a side is odd.
+ */
+int plan_hilbert2d(int *layer, int x, int y, int ax, int ay, int bx, int by){
+    int w, h, dax, day, dbx, dby, ax2, ay2, bx2, by2, w2, h2, ii, n = 0;
+
+    w = abs(ax + ay);
+    h = abs(bx + by);
+    dax = (ax > 0) - (ax < 0);
+    day = (ay > 0) - (ay < 0);
+    dbx = (bx > 0) - (bx < 0);
+    dby = (by > 0) - (by < 0);
+
+    // A single row or column is traversed directly
+    if(h == 1 || w == 1){
+        if(h != 1){
+            dax = dbx;
+            day = dby;
+            w = h;
+        }
+        for(ii=0; ii<w; ii++){
+            layer[n++] = x;
+            layer[n++] = y;
+            x += dax;
+            y += day;
+        }
+        return n/2;
+    }
+
+    ax2 = plan_div2(ax);
+    ay2 = plan_div2(ay);
+    bx2 = plan_div2(bx);
+    by2 = plan_div2(by);
+    w2 = abs(ax2 + ay2);
+    h2 = abs(bx2 + by2);
+
+    if(2*w > 3*h){
+        // Split the long side in two, and keep the halves even
+        if((w2 % 2) && (w > 2)){
+            ax2 += dax;
+            ay2 += day;
+        }
+        n = plan_hilbert2d(layer, x, y, ax2, ay2, bx, by);
+        n += plan_hilbert2d(&layer[2*n], x+ax2, y+ay2, ax-ax2, ay-ay2, bx, by);
+    }else{
+        // Up the minor side, across, and back down
+        if((h2 % 2) && (h > 2)){
+            bx2 += dbx;
+            by2 += dby;
+        }
+        n = plan_hilbert2d(layer, x, y, bx2, by2, ax2, ay2);
+        n += plan_hilbert2d(&layer[2*n], x+bx2, y+by2, ax, ay, bx-bx2, by-by2);
+        n += plan_hilbert2d(&layer[2*n],
+                x+(ax-dax)+(bx2-dbx), y+(ay-day)+(by2-dby),
+                -bx2, -by2, -(ax-ax2), -(ay-ay2));
+    }
+    return n;
+}
+
+
+/* PLAN_LAYER - Order the points in one layer of the grid
+ *
+ * Writes the (i,j) indices of an N0 by N1 grid into LAYER in the order
+ * they are visited.  LAYER must have room for 2*N0*N1 integers.
+ */
+void plan_layer(int *layer, int n0, int n1, int order){
+    int ii, jj, n = 0, left, right, top, bottom;
+
+    switch(order){
+    case PLAN_RASTER:
+    case PLAN_SERPENTINE:
+        for(jj=0; jj<n1; jj++){
+            for(ii=0; ii<n0; ii++){
+                layer[n++] = (order == PLAN_SERPENTINE && jj%2) ? n0-1-ii : ii;
+                layer[n++] = jj;
+            }
+        }
+    break;
+    case PLAN_SPIRAL:
+        left = 0;
+        right = n0-1;
+        top = 0;
+        bottom = n1-1;
+        while(left <= right && top <= bottom){
+            for(ii=left; ii<=right; ii++){
+                layer[n++] = ii;
+                layer[n++] = top;
+            }
+            for(jj=top+1; jj<=bottom; jj++){
+                layer[n++] = right;
+                layer[n++] = jj;
+            }
+            if(top < bottom)
+                for(ii=right-1; ii>=left; ii--){
+                    layer[n++] = ii;
+                    layer[n++] = bottom;
+                }
+            if(left < right)
+                for(jj=bottom-1; jj>top; jj--){
+                    layer[n++] = left;
+                    layer[n++] = jj;
+                }
+            left++;
+            right--;
+            top++;
+            bottom--;
+        }
+    break;
+    case PLAN_HILBERT:
+        if(n0 >= n1)
+            plan_hilbert2d(layer, 0, 0, n0, 0, 0, n1);
+        else
+            plan_hilbert2d(layer, 0, 0, 0, n1, n0, 0);
+    break;
+    }
+}
+
+
+/* PLAN_FREE - Release the memory used by a plan
+ */
+void plan_free(ScanPlan_t *plan){
+    if(plan->index)
+        free(plan->index);
+    if(plan->target)
+        free(plan->target);
+    plan->index = NULL;
+    plan->target = NULL;
+    plan->npoint = 0;
+}
+
+
+/* PLAN_ALLOC - Set up an empty plan with room for NPOINT points
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int plan_alloc(ScanPlan_t *plan, AxisIterator_t *ax[], int naxes, int npoint){
+    int ii;
+
+    plan->index = NULL;
+    plan->target = NULL;
+    plan->npoint = 0;
+    plan->_point = -1;
+    if(naxes < 1 || naxes > PLAN_MAX_AXES){
+        fprintf(stderr, "PLAN_ALLOC: A plan must have 1 to %d axes.\n", PLAN_MAX_AXES);
+        return -1;
+    }
+    plan->naxes = naxes;
+    for(ii=0; ii<naxes; ii++)
+        plan->ax[ii] = ax[ii];
+    plan->index = malloc(npoint * naxes * sizeof(int));
+    plan->target = malloc(npoint * naxes * sizeof(int));
+    if(!plan->index || !plan->target){
+        fprintf(stderr, "PLAN_ALLOC: Failed to allocate %d points.\n", npoint);
+        plan_free(plan);
+        return -1;
+    }
+    plan->npoint = npoint;
+    return 0;
+}
+
+
+/* PLAN_GRID - Plan a grid scan
+ *
+ * Builds a plan that visits the grid defined by the NAXES axes in AX in
+ * the PLAN_XXX ORDER.  Each axis visits its NITER+1 locations, INDEX *
+ * STEPS, as they would be visited by AX_ITER().  The first two axes
+ * form the layers of the grid, which are visited in ORDER.  With a third
+ * axis, the layers are stacked along it, and every other layer is
+ * traversed in reverse so the scan ends each layer where the next
+ * begins (except for the RASTER order).  The SERPENTINE order over the
+ * x and z axes is the same scan that was conducted by nested AX_ITER()
+ * loops with AX_ITER_REPEAT().
+ *
+ * When ORDER is PLAN_AUTO, every grid order is planned, and the one with
+ * the smallest PLAN_COST() is kept.  Ties go to SERPENTINE.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int plan_grid(ScanPlan_t *plan, AxisIterator_t *ax[], int naxes, int order){
+    int n[PLAN_MAX_AXES], ii, jj, kk, point, nlayer, *layer, *tt;
+    int candidates[] = {PLAN_SERPENTINE, PLAN_HILBERT, PLAN_SPIRAL, PLAN_RASTER};
+    long cost, best;
+    ScanPlan_t trial;
+
+    if(order == PLAN_AUTO){
+        best = -1;
+        for(ii=0; ii<sizeof(candidates)/sizeof(int); ii++){
+            if(plan_grid(&trial, ax, naxes, candidates[ii])){
+                if(best >= 0)
+                    plan_free(plan);
+                return -1;
+            }
+            cost = plan_cost(&trial);
+            if(best < 0 || cost < best){
+                if(best >= 0)
+                    plan_free(plan);
+                *plan = trial;
+                best = cost;
+            }else
+                plan_free(&trial);
+        }
+        return 0;
+    }else if(order < 0 || order >= PLAN_LIST){
+        fprintf(stderr, "PLAN_GRID: Unrecognized grid order: %d\n", order);
+        return -1;
+    }
+
+    for(ii=0; ii<PLAN_MAX_AXES; ii++)
+        n[ii] = (ii < naxes) ? ax[ii]->niter + 1 : 1;
+    nlayer = n[0] * n[1];
+    if(plan_alloc(plan, ax, naxes, nlayer * n[2]))
+        return -1;
+    plan->order = order;
+    layer = malloc(2 * nlayer * sizeof(int));
+    if(!layer){
+        fprintf(stderr, "PLAN_GRID: Failed to allocate the grid layer.\n");
+        plan_free(plan);
+        return -1;
+    }
+    plan_layer(layer, n[0], n[1], order);
+
+    point = 0;
+    for(kk=0; kk<n[2]; kk++){
+        for(jj=0; jj<nlayer; jj++){
+            // Every other layer is reversed
+            tt = (order != PLAN_RASTER && kk%2) ?
+                    &layer[2*(nlayer-1-jj)] : &layer[2*jj];
+            for(ii=0; ii<naxes; ii++){
+                plan->index[point*naxes + ii] = (ii < 2) ? tt[ii] : kk;
+                plan->target[point*naxes + ii] =
+                        plan->index[point*naxes + ii] * ax[ii]->steps;
+            }
+            point++;
+        }
+    }
+    free(layer);
+    return 0;
+}
+
+
+/* PLAN_SHORTEN - Reorder the points to shorten the scan
+ *
+ * The points are first put in nearest-neighbor order starting from the
+ * current axis positions.  Then, segments of the path are reversed
+ * wherever that shortens it (2-opt) until no reversal helps or
+ * PLAN_2OPT_PASSES passes have been made.  The return to the starting
+ * positions is included, so the result minimizes PLAN_COST().  Returns
+ * 0 on success and -1 on failure.
+ */
+int plan_shorten(ScanPlan_t *plan){
+    int naxes = plan->naxes, npoint = plan->npoint;
+    int *tour, *used, *index, *target, *tmp, *a, *b, *c, *e;
+    int home[PLAN_MAX_AXES], ii, jj, kk, best, d, dbest, pass, improved;
+
+    if(npoint < 2)
+        return 0;
+    tour = malloc((npoint+1) * sizeof(int));
+    used = calloc(npoint, sizeof(int));
+    index = malloc(npoint * naxes * sizeof(int));
+    target = malloc(npoint * naxes * sizeof(int));
+    if(!tour || !used || !index || !target){
+        fprintf(stderr, "PLAN_SHORTEN: Failed to allocate the tour.\n");
+        free(tour); free(used); free(index); free(target);
+        return -1;
+    }
+    for(ii=0; ii<naxes; ii++)
+        home[ii] = plan->ax[ii]->state;
+// The target of tour position K; position 0 is home
+#define plan_node(K) (tour[K] < 0 ? home : &plan->target[tour[K]*naxes])
+
+    // Nearest neighbor
+    tour[0] = -1;
+    for(kk=1; kk<=npoint; kk++){
+        best = -1;
+        dbest = 0;
+        for(ii=0; ii<npoint; ii++){
+            if(used[ii])
+                continue;
+            d = plan_distance(plan_node(kk-1), &plan->target[ii*naxes], naxes);
+            if(best < 0 || d < dbest){
+                best = ii;
+                dbest = d;
+            }
+        }
+        used[best] = 1;
+        tour[kk] = best;
+    }
+
+    // 2-opt on the closed tour through home
+    for(pass=0; pass<PLAN_2OPT_PASSES; pass++){
+        improved = 0;
+        for(ii=1; ii<npoint; ii++){
+            for(jj=ii+1; jj<=npoint; jj++){
+                a = plan_node(ii-1);
+                b = plan_node(ii);
+                c = plan_node(jj);
+                e = plan_node((jj+1) % (npoint+1));
+                if(plan_distance(a, c, naxes) + plan_distance(b, e, naxes) <
+                        plan_distance(a, b, naxes) + plan_distance(c, e, naxes)){
+                    // Reverse tour[ii..jj]
+                    for(kk=0; kk<(jj-ii+1)/2; kk++){
+                        d = tour[ii+kk];
+                        tour[ii+kk] = tour[jj-kk];
+                        tour[jj-kk] = d;
+                    }
+                    improved = 1;
+                }
+            }
+        }
+        if(!improved)
+            break;
+    }
+#undef plan_node
+
+    for(kk=0; kk<npoint; kk++){
+        for(ii=0; ii<naxes; ii++){
+            index[kk*naxes + ii] = plan->index[tour[kk+1]*naxes + ii];
+            target[kk*naxes + ii] = plan->target[tour[kk+1]*naxes + ii];
+        }
+    }
+    tmp = plan->index;
+    plan->index = index;
+    index = tmp;
+    tmp = plan->target;
+    plan->target = target;
+    target = tmp;
+    free(tour); free(used); free(index); free(target);
+    return 0;
+}
+
+
+/* PLAN_LOAD - Plan a scan from a list of points
+ *
+ * Reads a list of points from the file, FILENAME.  Each line has NAXES
+ * positions in length units relative to the start of the scan, in the
+ * order of the axes in AX.  Blank lines and lines beginning with '#' are
+ * ignored.  The positions are rounded to the nearest step.  The index of
+ * the first axis is the point's number in the file (counted from 0), and
+ * the indices of the other axes are zero.
+ *
+ * The points are visited in the order they appear when ORDER is
+ * PLAN_LIST.  When ORDER is PLAN_AUTO, they are reordered by
+ * PLAN_SHORTEN().
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int plan_load(ScanPlan_t *plan, AxisIterator_t *ax[], int naxes,
+        const char *filename, int order){
+    char line[LCONF_MAX_STR*4], *here, *end;
+    double value;
+    int npoint, nline, ii;
+    FILE *fd;
+
+    if(order != PLAN_LIST && order != PLAN_AUTO){
+        fprintf(stderr, "PLAN_LOAD: Point lists must use the list or auto order.\n");
+        return -1;
+    }else if(!(fd = fopen(filename, "r"))){
+        fprintf(stderr, "PLAN_LOAD: Failed to open the point list: %s\n", filename);
+        return -1;
+    }
+    // Count the points
+    npoint = 0;
+    while(fgets(line, sizeof(line), fd)){
+        for(here=line; *here==' ' || *here=='\t'; here++){}
+        if(*here != '#' && *here != '\n' && *here != '\r' && *here != '\0')
+            npoint++;
+    }
+    if(npoint == 0){
+        fprintf(stderr, "PLAN_LOAD: Found no points in: %s\n", filename);
+        fclose(fd);
+        return -1;
+    }else if(plan_alloc(plan, ax, naxes, npoint)){
+        fclose(fd);
+        return -1;
+    }
+    plan->order = order;
+    // Read the points
+    rewind(fd);
+    npoint = 0;
+    nline = 0;
+    while(fgets(line, sizeof(line), fd)){
+        nline++;
+        for(here=line; *here==' ' || *here=='\t'; here++){}
+        if(*here == '#' || *here == '\n' || *here == '\r' || *here == '\0')
+            continue;
+        for(ii=0; ii<naxes; ii++){
+            value = strtod(here, &end);
+            if(end == here){
+                fprintf(stderr, "PLAN_LOAD: Expected %d positions on line %d of %s\n",
+                        naxes, nline, filename);
+                fclose(fd);
+                plan_free(plan);
+                return -1;
+            }
+            here = end;
+            plan->index[npoint*naxes + ii] = (ii == 0) ? npoint : 0;
+            plan->target[npoint*naxes + ii] = (int) floor(value / ax[ii]->cal + 0.5);
+        }
+        npoint++;
+    }
+    fclose(fd);
+
+    if(order == PLAN_AUTO && plan_shorten(plan)){
+        plan_free(plan);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* PLAN_INIT - Plan a scan from the LConfig meta parameters
+ *
+ * The optional meta parameters are:
+ * NAME         : [type] description
+ * ----------------------------------------------------------------------
+ * scan_order   : [str] One of "raster", "serpentine", "spiral",
+ *                "hilbert", "list", or "auto".  The default is
+ *                "serpentine" for grids and "list" for point lists.
+ * scan_points  : [str] A point list file (see PLAN_LOAD()).  When it is
+ *                given, the grid is not used.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int plan_init(ScanPlan_t *plan, lc_devconf_t *dconf, AxisIterator_t *ax[], int naxes){
+    char name[LCONF_MAX_STR], points[LCONF_MAX_STR];
+    int order = -1;
+
+    plan->index = NULL;
+    plan->target = NULL;
+    plan->npoint = 0;
+    if(lc_get_meta_type(dconf, "scan_order") == LC_MT_STR){
+        lc_get_meta_str(dconf, "scan_order", name);
+        if((order = plan_order(name)) < 0){
+            fprintf(stderr, "PLAN_INIT: Unrecognized scan_order: %s\n", name);
+            return -1;
+        }
+    }else if(lc_get_meta_type(dconf, "scan_order")){
+        fprintf(stderr, "PLAN_INIT: scan_order must be a string.\n");
+        return -1;
+    }
+
+    if(lc_get_meta_type(dconf, "scan_points") == LC_MT_STR){
+        lc_get_meta_str(dconf, "scan_points", points);
+        return plan_load(plan, ax, naxes, points, order < 0 ? PLAN_LIST : order);
+    }else if(lc_get_meta_type(dconf, "scan_points")){
+        fprintf(stderr, "PLAN_INIT: scan_points must be a string.\n");
+        return -1;
+    }else if(order == PLAN_LIST){
+        fprintf(stderr, "PLAN_INIT: The list scan_order requires scan_points.\n");
+        return -1;
+    }
+    return plan_grid(plan, ax, naxes, order < 0 ? PLAN_SERPENTINE : order);
+}
+
+
+/* PLAN_START - Set up the first point of a plan
+ * PLAN_NEXT - Advance to the next point of a plan
+ *
+ * PLAN_START() does not command motion.  It only rewinds the plan.
+ *
+ * PLAN_NEXT() works like AX_ITER_NEXT() for all of the axes at once.
+ * The number of steps each axis must move to reach the next point is
+ * written to STEPS, which must have room for NAXES integers.  The axis
+ * indices are updated, so AX_GET_INDEX() returns the grid index of the
+ * new point.  The motion is commanded by passing STEPS to
+ * AX_GROUP_MOVE().
+ *
+ * Returns:
+ *  0 on success
+ *  1 on plan complete
+ */
+int plan_start(ScanPlan_t *plan){
+    plan->_point = -1;
+    return 0;
+}
+
+int plan_next(ScanPlan_t *plan, int *steps){
+    int ii;
+
+    if(plan->_point + 1 >= plan->npoint)
+        return 1;
+    plan->_point ++;
+    for(ii=0; ii<plan->naxes; ii++){
+        plan->ax[ii]->_index = plan->index[plan->_point*plan->naxes + ii];
+        steps[ii] = plan->target[plan->_point*plan->naxes + ii] - plan->ax[ii]->state;
+    }
+    return 0;
+}
+
+
+/* PLAN_GET_POINT - Return the number of the current point in the plan
+ */
+int plan_get_point(ScanPlan_t *plan){
+    return plan->_point;
+}
+
+
+/* ScanRefine
+ *  A struct to manage adaptive refinement of a grid scan.  After the 
+ * grid has been scanned, each pair of neighboring points whose figure of
+ * merit (e.g. the mean wire current) differs by more than TOL is split
+ * by a new point half way between them.  The new points are scanned in
+ * a refinement pass, and the two halves of each split become candidates
+ * for the next pass.  The largest changes are refined first, and no
+ * more than BUDGET points are added in all.
+ */
+typedef struct _ScanRefine {
+    int             budget; // Most points to add (0 disables refinement)
+    double          tol;    // Smallest change in the merit that is refined
+    int             levels; // Most times the grid spacing is halved
+    int             level;  // The current pass (0 for the grid)
+    int             nadded; // Number of points added so far
+    int             naxes;  // Number of axes in the plan
+    int             *grid;  // Grid lookup: point number at each grid index
+    int             n[PLAN_MAX_AXES];   // Grid dimensions
+    // Measured points
+    int             npoint, maxpoint;
+    int             *target; // Positions in steps [point*naxes + axis]
+    double          *merit; // Figure of merit at each point
+    // Candidate edges between measured points
+    int             nedge, maxedge;
+    int             *edge;  // Point pairs [2*edge]
+    // Edges being split in the current pass
+    int             nsplit;
+    int             *split; // Point pairs [2*split]
+} ScanRefine_t;
+
+
+/* REFINE_INIT - Configure refinement from the LConfig meta parameters
+ *
+ * The optional meta parameters are:
+ * NAME         : [type] description
+ * ----------------------------------------------------------------------
+ * refine_n     : [int] (>=0) The most points to add.  Refinement is
+ *                disabled when it is 0 or absent.
+ * refine_tol   : [float] (>=0) Neighbors are only split when their 
+ *                figures of merit differ by more than this (0).
+ * refine_levels: [int] (>0) The most times the spacing is halved (2).
+ *
+ * PLAN must be a grid plan (see PLAN_GRID()).  Returns 0 on success and
+ * -1 on failure.
+ */
+int refine_init(ScanRefine_t *ref, lc_devconf_t *dconf, ScanPlan_t *plan){
+    int ii, ngrid;
+
+    ref->budget = 0;
+    ref->tol = 0.;
+    ref->levels = 2;
+    ref->level = 0;
+    ref->nadded = 0;
+    ref->naxes = plan->naxes;
+    ref->grid = NULL;
+    ref->npoint = ref->maxpoint = 0;
+    ref->target = NULL;
+    ref->merit = NULL;
+    ref->nedge = ref->maxedge = 0;
+    ref->edge = NULL;
+    ref->nsplit = 0;
+    ref->split = NULL;
+
+    if(lc_get_meta_type(dconf, "refine_n") != LC_MT_INT)
+        return 0;
+    lc_get_meta_int(dconf, "refine_n", &ref->budget);
+    if(lc_get_meta_type(dconf, "refine_tol") == LC_MT_FLT)
+        lc_get_meta_flt(dconf, "refine_tol", &ref->tol);
+    if(lc_get_meta_type(dconf, "refine_levels") == LC_MT_INT)
+        lc_get_meta_int(dconf, "refine_levels", &ref->levels);
+    if(ref->budget < 0 || ref->tol < 0. || ref->levels < 1){
+        fprintf(stderr, "REFINE_INIT: refine_n and refine_tol must be non-negative, and\n"
+                "  refine_levels must be positive.\n");
+        return -1;
+    }else if(ref->budget == 0)
+        return 0;
+    else if(plan->order == PLAN_LIST || plan->order == PLAN_AUTO){
+        fprintf(stderr, "REFINE_INIT: Refinement requires a grid scan.\n");
+        return -1;
+    }
+    // Set up the lookup from grid indices to measured points
+    ngrid = 1;
+    for(ii=0; ii<PLAN_MAX_AXES; ii++){
+        ref->n[ii] = (ii < plan->naxes) ? plan->ax[ii]->niter + 1 : 1;
+        ngrid *= ref->n[ii];
+    }
+    ref->grid = malloc(ngrid * sizeof(int));
+    if(!ref->grid){
+        fprintf(stderr, "REFINE_INIT: Failed to allocate the grid lookup.\n");
+        ref->budget = 0;
+        return -1;
+    }
+    for(ii=0; ii<ngrid; ii++)
+        ref->grid[ii] = -1;
+    return 0;
+}
+
+
+/* REFINE_FREE - Release the memory used by refinement
+ */
+void refine_free(ScanRefine_t *ref){
+    free(ref->grid);
+    free(ref->target);
+    free(ref->merit);
+    free(ref->edge);
+    free(ref->split);
+    ref->grid = NULL;
+    ref->target = NULL;
+    ref->merit = NULL;
+    ref->edge = NULL;
+    ref->split = NULL;
+    ref->budget = 0;
+}
+
+
+/* REFINE_EDGE - Add a candidate edge between points A and B
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int refine_edge(ScanRefine_t *ref, int a, int b){
+    int *tmp;
+    if(ref->nedge >= ref->maxedge){
+        tmp = realloc(ref->edge, 2 * (2*ref->maxedge + 64) * sizeof(int));
+        if(!tmp){
+            fprintf(stderr, "REFINE_EDGE: Failed to allocate the edges.\n");
+            return -1;
+        }
+        ref->edge = tmp;
+        ref->maxedge = 2*ref->maxedge + 64;
+    }
+    ref->edge[2*ref->nedge] = a;
+    ref->edge[2*ref->nedge + 1] = b;
+    ref->nedge++;
+    return 0;
+}
+
+
+/* REFINE_RECORD - Record the figure of merit at the current point
+ *
+ * Call once for each point of PLAN after it has been measured.  MERIT
+ * should be NAN if the point could not be measured; edges to it are not
+ * refined.  Does nothing when refinement is disabled.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int refine_record(ScanRefine_t *ref, ScanPlan_t *plan, double merit){
+    int ii, jj, point, gi, *itmp;
+    double *dtmp;
+
+    if(ref->budget <= 0)
+        return 0;
+    if(ref->npoint >= ref->maxpoint){
+        ii = 2*ref->maxpoint + 64;
+        itmp = realloc(ref->target, ii * ref->naxes * sizeof(int));
+        if(itmp)
+            ref->target = itmp;
+        dtmp = realloc(ref->merit, ii * sizeof(double));
+        if(dtmp)
+            ref->merit = dtmp;
+        if(!itmp || !dtmp){
+            fprintf(stderr, "REFINE_RECORD: Failed to allocate the points.\n");
+            return -1;
+        }
+        ref->maxpoint = ii;
+    }
+    point = ref->npoint++;
+    for(ii=0; ii<ref->naxes; ii++)
+        ref->target[point*ref->naxes + ii] = 
+                plan->target[plan->_point*plan->naxes + ii];
+    ref->merit[point] = merit;
+
+    if(ref->level == 0){
+        // Grid points are connected to their neighbors after the pass
+        gi = 0;
+        for(ii=ref->naxes-1; ii>=0; ii--)
+            gi = gi * ref->n[ii] + plan->index[plan->_point*plan->naxes + ii];
+        ref->grid[gi] = point;
+    }else{
+        // The new point splits an edge into two new candidates
+        jj = plan->index[plan->_point*plan->naxes];
+        if(refine_edge(ref, ref->split[2*jj], point) ||
+                refine_edge(ref, point, ref->split[2*jj + 1]))
+            return -1;
+    }
+    return 0;
+}
+
+
+/* REFINE_SCORE - An edge with its change in the figure of merit
+ */
+typedef struct _refine_score_t {
+    double score;
+    int edge;
+} refine_score_t;
+
+int refine_compare(const void *a, const void *b){
+    double sa = ((const refine_score_t *)a)->score;
+    double sb = ((const refine_score_t *)b)->score;
+    return (sa < sb) - (sa > sb);
+}
+
+
+/* REFINE_NEXT - Plan the next refinement pass
+ *
+ * Call after every point of PLAN has been passed to REFINE_RECORD().  The
+ * candidate edges are ranked by the change in the figure of merit, and 
+ * a new point is planned half way along each of the largest, until the
+ * budget is spent or the changes are no more than TOL.  Edges that are a single
+ * step long cannot be split.  The old plan is released, and PLAN is 
+ * replaced by the new points in the order with the fewest steps (see 
+ * PLAN_SHORTEN()).  The index of the first axis is the number of the new
+ * point in the pass, and the indices of the other axes are zero.
+ *
+ * Returns:
+ *  0 when a new pass has been planned
+ *  1 when refinement is complete (PLAN is left alone)
+ *  -1 on failure
+ */
+int refine_next(ScanRefine_t *ref, ScanPlan_t *plan){
+    int ii, jj, kk, axis, stride, a, b, naxes = ref->naxes, nscore, nnew;
+    int *ta, *tb;
+    double d;
+    refine_score_t *score;
+    AxisIterator_t *ax[PLAN_MAX_AXES];
+
+    if(ref->budget <= 0 || ref->nadded >= ref->budget || ref->level >= ref->levels)
+        return 1;
+    // After the grid, connect the neighbors along each axis
+    if(ref->level == 0){
+        for(ii=0, stride=1; ii<PLAN_MAX_AXES; stride*=ref->n[ii], ii++){
+            for(jj=0; jj<ref->n[0]*ref->n[1]*ref->n[2]; jj++){
+                // Skip the last index along this axis
+                if((jj / stride) % ref->n[ii] == ref->n[ii] - 1)
+                    continue;
+                a = ref->grid[jj];
+                b = ref->grid[jj + stride];
+                if(a >= 0 && b >= 0 && refine_edge(ref, a, b))
+                    return -1;
+            }
+        }
+    }
+
+    // Rank the edges that can be split
+    score = malloc((ref->nedge + 1) * sizeof(refine_score_t));
+    if(!score){
+        fprintf(stderr, "REFINE_NEXT: Failed to allocate the edge scores.\n");
+        return -1;
+    }
+    nscore = 0;
+    for(ii=0; ii<ref->nedge; ii++){
+        a = ref->edge[2*ii];
+        b = ref->edge[2*ii + 1];
+        ta = &ref->target[a*naxes];
+        tb = &ref->target[b*naxes];
+        if(plan_distance(ta, tb, naxes) < 2)
+            continue;
+        d = fabs(ref->merit[a] - ref->merit[b]);
+        if(isnan(d) || d <= ref->tol)
+            continue;
+        score[nscore].score = d;
+        score[nscore].edge = ii;
+        nscore++;
+    }
+    qsort(score, nscore, sizeof(refine_score_t), refine_compare);
+    nnew = ref->budget - ref->nadded;
+    nnew = nnew < nscore ? nnew : nscore;
+    ref->level++;
+    if(nnew == 0){
+        free(score);
+        return 1;
+    }
+
+    // Plan the new points
+    free(ref->split);
+    ref->split = malloc(2 * nnew * sizeof(int));
+    for(ii=0; ii<naxes; ii++)
+        ax[ii] = plan->ax[ii];
+    plan_free(plan);
+    if(!ref->split || plan_alloc(plan, ax, naxes, nnew)){
+        fprintf(stderr, "REFINE_NEXT: Failed to allocate the refinement pass.\n");
+        free(score);
+        return -1;
+    }
+    plan->order = PLAN_AUTO;
+    for(kk=0; kk<nnew; kk++){
+        a = ref->edge[2*score[kk].edge];
+        b = ref->edge[2*score[kk].edge + 1];
+        ref->split[2*kk] = a;
+        ref->split[2*kk + 1] = b;
+        for(axis=0; axis<naxes; axis++){
+            plan->index[kk*naxes + axis] = (axis == 0) ? kk : 0;
+            ta = &ref->target[a*naxes + axis];
+            tb = &ref->target[b*naxes + axis];
+            plan->target[kk*naxes + axis] = *ta + plan_div2(*tb - *ta);
+        }
+    }
+    ref->nsplit = nnew;
+    ref->nadded += nnew;
+
+    // The split edges are replaced by their halves as the points arrive
+    for(kk=0; kk<nnew; kk++)
+        ref->edge[2*score[kk].edge] = -1;
+    for(ii=0, jj=0; ii<ref->nedge; ii++){
+        if(ref->edge[2*ii] < 0)
+            continue;
+        ref->edge[2*jj] = ref->edge[2*ii];
+        ref->edge[2*jj + 1] = ref->edge[2*ii + 1];
+        jj++;
+    }
+    ref->nedge = jj;
+    free(score);
+    return plan_shorten(plan);
+}
+
+
+/* REFINE_PLAN_NEXT - Advance through a plan and its refinement passes
+ *
+ * Works like PLAN_NEXT(), but when PLAN is complete, the next 
+ * refinement pass is planned with REFINE_NEXT(), and its first point is
+ * returned.  When refinement is disabled, this is the same as 
+ * PLAN_NEXT().  The pass is in REF->LEVEL.
+ *
+ * Returns:
+ *  0 on success
+ *  1 on plan and refinement complete
+ *  -1 on failure
+ */
+int refine_plan_next(ScanRefine_t *ref, ScanPlan_t *plan, int *steps){
+    int err;
+
+    while((err = plan_next(plan, steps)) > 0){
+        if((err = refine_next(ref, plan)))
+            return err;
+        plan_start(plan);
+    }
+    return err;
+}
+
+#endif
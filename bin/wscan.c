@@ -1,10 +1,14 @@
 #include "lconfig.h"
+#include "lctools.h"
+#include "lcwire.h"
 #include "wscan.h"
+#include "wplan.h"
 #include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 
 
 #define CONFIG_DEFAULT  "wscan.conf"
@@ -12,13 +16,16 @@
 #define STR_SHORT       32
 #define XPULSE_EF       0
 #define ZPULSE_EF       1
+#define YPULSE_EF       2
 #define XDIR_POS        1
 #define ZDIR_POS        1
-#define TSETTLE_US      100000  // Time for mechanical vibration to settle before taking data
+#define SETTLE_WINDOW   0.02    // Default settle detection window (s)
+#define SETTLE_TIMEOUT  2.0     // Default settle detection timeout (s)
+#define FLY_POLL_US     10000   // Interval between fly scan progress reads
 
 
 
-char help_text[] = "wscan [-h] [-c CONFIG] [-d DEST] [-i|f|s PARAM=VALUE] \n"\
+char help_text[] = "wscan [-htlaCFwWr] [-c CONFIG] [-d DEST] [-i|f|s PARAM=VALUE] \n"\
 "  Conducts an ion density scan of a region in space by alternatively\n"\
 "commanding motion of the spinning disc Langmuir probe and collecting\n"\
 "data.  The data acquisition process is configured in an LCONFIG file\n"\
@@ -32,33 +39,77 @@ char help_text[] = "wscan [-h] [-c CONFIG] [-d DEST] [-i|f|s PARAM=VALUE] \n"\
 "   These are the x and z step commands (in that order). They must be at\n"\
 "   least one channel appart, because the channel above each will be used\n"\
 "   for the channel direction. For example, if the x pulse output were\n"\
-"   set to DIO2, then DIO3 will be used for the x direction.\n"\
+"   set to DIO2, then DIO3 will be used for the x direction.  A third\n"\
+"   pulse output is the optional y step command.  It is used when the\n"\
+"   \"yn\" meta parameter is present, and it needs the same \"y\" meta\n"\
+"   parameters as the x and z axes.\n"\
 " - There must be meta parameters with the following names:\n"\
 "   \"xstep\" (int): The x-axis increment in pulses (+/-).\n"\
 "   \"xn\" (int): The number of x-axis scan locations (min 1).\n"\
 "   \"xdir\" (int): Which direction is positive (1 or 0).\n"\
 "   \"xcal\" (float): The distance moved per step (>0).\n"\
 "   \"xunits\" (str): The distance units string.\n"\
+"   \"xsettle\" (float): Optional seconds to wait after each motion (0.1).\n"\
 "   \"zstep\" (int): The z-axis increment in pulses (+/-).\n"\
 "   \"zn\" (int): The number of z-axis scan locations (min 1).\n"\
 "   \"zdir\" (int): Which direction is positive (1 or 0).\n"\
 "   \"zcal\" (float): The distance moved per step (>0).\n"\
 "   \"zunits\" (str): The distance units string.\n"\
+"   \"zsettle\" (float): Optional seconds to wait after each motion (0.1).\n"\
+"   \"xvmax\", \"zvmax\" (float): Optional fastest step rate in Hz.\n"\
+"   \"xaccel\", \"zaccel\" (float): Step rate acceleration in Hz/s.  When\n"\
+"   both are given, long motions are ramped up from the effrequency to\n"\
+"   the vmax and back down. See AX_PROFILE() in wscan.h.\n"\
 "   These define a grid of disc locations in the x-z plane.  The x-axis\n"\
 "   is assumed to have been carefully aligned with the plane of disc\n"\
 "   rotation. The z-axis is roughly (but not necessarily precisely) \n"\
 "   perpendicular to the plane of disc rotation.\n"\
+" - Optionally, the order in which the points are visited can be set.\n"\
+"   \"scan_order\" (str): One of \"serpentine\" (the default), \"raster\",\n"\
+"   \"spiral\", \"hilbert\", \"list\", or \"auto\".  The x-axis moves\n"\
+"   fastest.  With a y-axis, each x-y layer is visited in this order, and\n"\
+"   the layers are stacked along z.  \"auto\" picks the order with the\n"\
+"   fewest steps.\n"\
+"   \"scan_points\" (str): A file listing the points to visit instead of\n"\
+"   the grid.  Each line has the x, (y,) and z positions in length units\n"\
+"   relative to the start.  The points are visited in the file's order,\n"\
+"   or in the order with the fewest steps if scan_order is \"auto\".\n"\
+"   The x-index of each point is its line number among the points.\n"\
+"   See wplan.h.\n"\
 " - There must be AT LEAST one meta parameter beginning with a lower case\n"\
 "   'r', followed by an integer index, identifying a wire and its radius.\n"\
 "   For example:\n"\
 "       r0  16.4\n"\
 "       r1  16.9\n"\
 "   Defines a disc with two wires, each with the specified radius.\n"\
+" - Optionally, the motion can be judged settled from the wire current\n"\
+"   itself.  When these meta parameters are present, the current is\n"\
+"   streamed in short windows after each motion, and the measurement\n"\
+"   begins once the variance in a window falls below the threshold.\n"\
+"   \"settle_var\" (float): The variance threshold in calibrated units^2.\n"\
+"   \"settle_window\" (float): Optional window length in seconds (0.02).\n"\
+"   \"settle_timeout\" (float): Optional longest wait in seconds (2.0).\n"\
+"   The time spent is recorded in each data file as the \"tsettle\" meta\n"\
+"   parameter (s).  The fixed \"xsettle\" and \"zsettle\" waits still\n"\
+"   apply first, so they can be set to 0.  The window should span a\n"\
+"   whole number of disc rotations.  This is not used with -C.\n"\
+" - Optionally, the grid can be refined where the signal changes quickly.\n"\
+"   After the grid is scanned, each pair of neighboring points is ranked\n"\
+"   by the change in the mean wire current between them, and new points\n"\
+"   are measured half way between the pairs with the largest changes.\n"\
+"   The halves of each split pair are candidates for the next pass.\n"\
+"   \"refine_n\" (int): The most points to add in all passes.\n"\
+"   \"refine_tol\" (float): Optional smallest change in the current that\n"\
+"   is refined, in calibrated units (0).\n"\
+"   \"refine_levels\" (int): Optional number of passes (2).\n"\
+"   The points from pass N are written to DEST/rNN/PPP.dat, and each data\n"\
+"   file records its pass in the \"refine\" meta parameter. This is not\n"\
+"   used with -C or with scan_points.\n"\
 "\n"\
 "The data collection will begin wherever the system is positioned when\n"
 "wscan begins. Each measurement will be written to its own dat file in\n"
-"the target directory, and the files are named by number in the order \n"
-"they were collected. \n"
+"the target directory, and the files are named by their grid indices,\n"
+"\"ZZZ/ZZZ_XXX.dat\" or \"ZZZ/ZZZ_YYY_XXX.dat\" with a y-axis.\n"
 "-h\n"\
 "  Displays this help text and exits.\n"\
 "\n"\
@@ -71,6 +122,75 @@ char help_text[] = "wscan [-h] [-c CONFIG] [-d DEST] [-i|f|s PARAM=VALUE] \n"\
 "will be created using the timestamp, but if this argument is present, it\n"\
 "will be used instead.\n"\
 "\n"\
+"-t\n"\
+"  Threaded acquisition. Normally, the data from each point are written to\n"\
+"disc after the measurement is complete. With -t set, a dedicated thread\n"\
+"reads from the device while the data are written to disc as they arrive.\n"\
+"\n"\
+"-a\n"\
+"  Archive. Instead of writing a directory for each z-slice and a file for\n"\
+"each point, all points are written to a single archive, DEST/scan.lca.\n"\
+"It has one configuration header, the data from each point one after the\n"\
+"other, and an index table at the end with each point's indices,\n"\
+"position, time, file offset, and number of samples. See LC_ARCHIVE_OPEN\n"\
+"in lconfig.h and LArchive in lconfig.py.\n"\
+"\n"\
+"-C\n"\
+"  Continuous stream. Normally, the stream is stopped while the probe moves\n"\
+"and restarted at each point. With -C set, a single stream runs for the\n"\
+"entire scan and is written to DEST/scan.dat. The stream samples that\n"\
+"belong to each point are listed in DEST/segments.txt with the columns\n"\
+"    z-index  x-index  z  x  start  stop\n"\
+"or, with a y-axis,\n"\
+"    z-index  y-index  x-index  z  y  x  start  stop\n"\
+"Samples start to stop-1 (counted from 0) were collected at that point\n"\
+"after the motion settled. Implies -t.\n"\
+"\n"\
+"-F\n"\
+"  Fly scan. Like -C, but the x-axis is not stopped at each point. Each\n"\
+"x row is scanned in one constant-rate motion while the stream runs, and\n"\
+"only the z (and y) motions between rows stop and settle. The rows are\n"\
+"visited in the scan_order over the z (and y) axes, and the x direction\n"\
+"alternates. The pulse rate is the optional \"xfly\" float meta parameter\n"\
+"(Hz). By default, it is |xstep| * samplehz / nsample, so each x-step\n"\
+"spans nsample samples. The pulse count is read about every 10ms, and the\n"\
+"(row, sample, pulses) readings are written to DEST/fly.txt. The x\n"\
+"position of any sample can be interpolated from them. The pulses are\n"\
+"timed by the EF clock, so the samples are fit to the known rate, and the\n"\
+"samples within half a step of each grid point are listed in\n"\
+"DEST/segments.txt just as they are with -C. The readings are taken when\n"\
+"each block of samples arrives, so they lag by up to one block. Implies -C.\n"\
+"\n"\
+"-w\n"\
+"  Wire reduction. The photo-reflector edges are found and the wire current\n"\
+"is binned by wire angle while the data arrive, just as post1 would do\n"\
+"after the scan. The WireData records for each point are appended to\n"\
+"DEST/output.wdf as soon as the point is complete. The raw data are still\n"\
+"written. Each rotation is binned as soon as it is complete, so the memory\n"\
+"used does not grow with the number of samples. The medians are exact in\n"\
+"bins with 64 or fewer samples and are estimated from a histogram in\n"\
+"larger bins (see LCT_QUANT_T in lctools.h). This is not supported with -C.\n"\
+"\n"\
+"-W\n"\
+"  The same as -w, but the raw data are not written at all. Only\n"\
+"DEST/output.wdf is kept. Overrides -a.\n"\
+"\n"\
+"-r\n"\
+"  Resume. Continue an interrupted scan in the existing directory DEST.\n"\
+"After each motion is completed and after each point's data are saved,\n"\
+"the scan is journaled in DEST/journal.txt. With -r, the points already\n"\
+"saved are skipped, the axes are taken to be where the last journaled\n"\
+"motion left them, and the scan continues from the next unsaved point.\n"\
+"The origin is unchanged, so the stage must not have been moved by hand.\n"\
+"Use the same configuration and options as the interrupted run. The\n"\
+"refinement passes are replayed from the journaled figures of merit.\n"\
+"This is not supported with -a, -C, or -F.\n"\
+"\n"\
+"-l\n"\
+"  Lock the stream buffer in RAM and request huge pages for it. The buffer\n"\
+"is always allocated once and reused at every point, but -l also prevents\n"\
+"it from being paged out. This is subject to the memlock limit (ulimit -l).\n"\
+"\n"\
 "-i\n"\
 "-f\n"\
 "-s\n"\
@@ -86,18 +206,747 @@ char help_text[] = "wscan [-h] [-c CONFIG] [-d DEST] [-i|f|s PARAM=VALUE] \n"\
 "(c)2023  Christopher R. Martin\n";
 
 
+/* POINT_GET
+ * Write the grid indices and the position (x,y,z) of the current point 
+ * into INDEX and POS.  YAXIS is NULL when there is no y-axis.
+ */
+void point_get(AxisIterator_t *xaxis, AxisIterator_t *yaxis, 
+        AxisIterator_t *zaxis, int *index, double *pos){
+    index[0] = ax_get_index(xaxis);
+    index[1] = yaxis ? ax_get_index(yaxis) : 0;
+    index[2] = ax_get_index(zaxis);
+    pos[0] = ax_get_pos(xaxis);
+    pos[1] = yaxis ? ax_get_pos(yaxis) : 0.;
+    pos[2] = ax_get_pos(zaxis);
+}
+
+
+/* STREAM_UNTIL
+ * Write the stream to FD until at least SAMPLE samples per channel have
+ * been streamed.  The acquisition thread must be running.
+ */
+int stream_until(lc_devconf_t *dconf, FILE *fd, unsigned int sample){
+    unsigned int streamed, read, waiting;
+    
+    lc_stream_status(dconf, &streamed, &read, &waiting);
+    while(streamed < sample){
+        if(lc_stream_service(dconf)){
+            fprintf(stderr, "WSCAN: Unexpected error while streaming data. Aborting\n");
+            return -1;
+        }
+        while( !lc_stream_isempty(dconf) )
+            lc_datafile_write(dconf, fd);
+        lc_stream_status(dconf, &streamed, &read, &waiting);
+    }
+    return 0;
+}
+
+
+/* STREAM_WAIT
+ * Write the stream to FD for WAIT_US microseconds.  The time is measured
+ * by the stream itself, so the wait ends WAIT_US after the samples 
+ * already in the buffer were collected.  That errs on the side of 
+ * waiting too long.
+ */
+int stream_wait(lc_devconf_t *dconf, FILE *fd, int wait_us){
+    unsigned int streamed, read, waiting;
+    
+    lc_stream_status(dconf, &streamed, &read, &waiting);
+    return stream_until(dconf, fd, 
+            streamed + (unsigned int) ceil(wait_us * 1e-6 * dconf->samplehz));
+}
+
+
+/* STREAM_MOTION
+ * Write the stream to FD until the last motions on the NAXES axes in AX
+ * are complete and have settled.  The pulse counts are polled between 
+ * writes with the same backoff used by AX_GROUP_WAIT().
+ */
+int stream_motion(lc_devconf_t *dconf, FILE *fd, AxisIterator_t *ax[], int naxes){
+    int done, settle_us, poll_us = AX_POLL_US;
+    
+    while(!(done = ax_group_done(ax, naxes))){
+        if(stream_wait(dconf, fd, poll_us))
+            return -1;
+        poll_us = 2*poll_us < AX_POLL_MAX_US ? 2*poll_us : AX_POLL_MAX_US;
+    }
+    if(done < 0)
+        return -1;
+    settle_us = ax_group_settle_us(ax, naxes);
+    return settle_us ? stream_wait(dconf, fd, settle_us) : 0;
+}
+
+
+/* SETTLE_T
+ * Parameters for detecting that the motion has settled from the wire 
+ * current.  Detection is disabled when VAR is not positive.
+ */
+typedef struct _settle_t {
+    double var;             // Variance threshold (calibrated units^2)
+    unsigned int window;    // Samples per window
+    unsigned int timeout;   // Most samples to stream
+} settle_t;
+
+
+/* SETTLE_INIT
+ * Read the settle detection parameters from the meta parameters 
+ * settle_var, settle_window, and settle_timeout.  Returns 0 on success
+ * and -1 if a parameter is illegal.
+ */
+int settle_init(lc_devconf_t *dconf, settle_t *settle){
+    double window = SETTLE_WINDOW, timeout = SETTLE_TIMEOUT;
+    
+    settle->var = 0.;
+    if(lc_get_meta_type(dconf, "settle_var") != LC_MT_FLT)
+        return 0;
+    lc_get_meta_flt(dconf, "settle_var", &settle->var);
+    if(lc_get_meta_type(dconf, "settle_window") == LC_MT_FLT)
+        lc_get_meta_flt(dconf, "settle_window", &window);
+    if(lc_get_meta_type(dconf, "settle_timeout") == LC_MT_FLT)
+        lc_get_meta_flt(dconf, "settle_timeout", &timeout);
+    if(settle->var <= 0. || window <= 0. || timeout < window){
+        fprintf(stderr, "WSCAN: settle_var and settle_window must be positive, and settle_timeout\n"
+                "  must be at least settle_window.\n");
+        return -1;
+    }
+    if(dconf->naich < 1){
+        fprintf(stderr, "WSCAN: Settle detection requires an analog input.\n");
+        return -1;
+    }
+    settle->window = (unsigned int) ceil(window * dconf->samplehz);
+    settle->timeout = (unsigned int) ceil(timeout * dconf->samplehz);
+    return 0;
+}
+
+
+/* SETTLE_WAIT
+ * Stream the wire current in windows of SETTLE->WINDOW samples until the 
+ * variance of the first analog input in one window falls below 
+ * SETTLE->VAR or SETTLE->TIMEOUT samples have been streamed.  The time 
+ * spent streaming is returned in TSETTLE in seconds.  The samples are 
+ * discarded.
+ * 
+ * Returns 0 if the signal settled, 1 if the timeout expired, and -1 on
+ * an error.
+ */
+int settle_wait(lc_devconf_t *dconf, settle_t *settle, double *tsettle){
+    lct_stat_t stat[LCONF_MAX_STCH];
+    unsigned int streamed = 0;
+    int err = 1;
+    
+    *tsettle = 0.;
+    lc_stream_continuous(dconf, 1);
+    if(lc_stream_start(dconf, settle->window)){
+        lc_stream_continuous(dconf, 0);
+        return -1;
+    }
+    while(streamed < settle->timeout){
+        if(lc_stream_service(dconf)){
+            err = -1;
+            break;
+        }
+        // Test each window as it arrives
+        while(!lc_stream_isempty(dconf)){
+            lct_stat_init(stat, LCONF_MAX_STCH);
+            // A failed read leaves the zero variance from LCT_STAT_INIT()
+            if(lct_stream_stat(dconf, stat, LCONF_MAX_STCH) || stat[0].n == 0){
+                err = -1;
+                break;
+            }
+            streamed += settle->window;
+            if(stat[0].var < settle->var){
+                err = 0;
+                break;
+            }
+        }
+        if(err <= 0)
+            break;
+    }
+    lc_stream_stop(dconf);
+    lc_stream_clean(dconf);
+    lc_stream_continuous(dconf, 0);
+    *tsettle = streamed / dconf->samplehz;
+    return err;
+}
+
+
+/* MERIT_T
+ * The figure of merit used to refine the scan is the mean calibrated 
+ * wire current (the first analog input) at each point.
+ */
+typedef struct _merit_t {
+    double sum;             // Sum of the calibrated samples
+    unsigned long n;        // Number of samples
+} merit_t;
+
+
+/* MERIT_MEAN
+ * Returns the mean wire current, or NAN if there were no samples.  The
+ * sums are cleared for the next point.
+ */
+double merit_mean(merit_t *merit){
+    double mean = merit->n ? merit->sum / merit->n : NAN;
+    merit->sum = 0.;
+    merit->n = 0;
+    return mean;
+}
+
+
+/* JOURNAL_T
+ * The checkpoint journal, DEST/journal.txt, lets an aborted scan be 
+ * resumed with -r.  It is written line by line and flushed to disc
+ *     plan NAXES NPOINT ORDER      once, to identify the scan
+ *     move PASS POINT S0 S1 [S2]   after each motion succeeds, with the
+ *                                  axis states in steps
+ *     done PASS POINT MERIT FILE   after each point's data are saved
+ *     home                         once the axes are back at the origin
+ * PASS is the refinement pass (0 for the grid), and the home return is
+ * journaled as a move with PASS and POINT -1.  The last move is the 
+ * position of the axes if the scan is interrupted.  A motion that fails 
+ * is not journaled, and neither is the home line when the scan ends in 
+ * an error.
+ */
+typedef struct _journal_t {
+    FILE *fd;               // The journal file
+    int ndone, maxdone;     // Points finished in an earlier run
+    int *done;              // (PASS, POINT) pairs
+    double *merit;          // The figure of merit at each
+    int state[PLAN_MAX_AXES];   // The last journaled position
+    int pending;            // Must the axes be set to STATE?
+} journal_t;
+
+
+/* JOURNAL_FLUSH
+ * Make sure the last journal line is on disc.
+ */
+void journal_flush(journal_t *jr){
+    fflush(jr->fd);
+    fsync(fileno(jr->fd));
+}
+
+
+/* JOURNAL_LOAD
+ * Read the journal from an earlier run of the same scan.  The plan line 
+ * must come before any move or done line, and it must match PLAN.  
+ * Returns 0 on success, 1 if the scan was complete, and -1 on failure.
+ */
+int journal_load(journal_t *jr, char *filename, ScanPlan_t *plan){
+    char line[STR_LEN*2], word[STR_SHORT];
+    int naxes, npoint, order, ii, nread, *itmp, state[PLAN_MAX_AXES];
+    int planned = 0;
+    double merit, *dtmp;
+    FILE *fd;
+    
+    if(!(fd = fopen(filename, "r"))){
+        fprintf(stderr, "WSCAN: Failed to open the journal: %s\n", filename);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fd)){
+        if(sscanf(line, "%31s", word) != 1 || word[0] == '#')
+            continue;
+        if(strcmp(word, "plan") == 0){
+            if(sscanf(line, "%*s %d %d %d", &naxes, &npoint, &order) != 3 ||
+                    naxes != plan->naxes || npoint != plan->npoint || 
+                    order != plan->order){
+                fprintf(stderr, "WSCAN: The journal is from a different scan plan.\n");
+                fclose(fd);
+                return -1;
+            }
+            planned = 1;
+        }else if(!planned){
+            fprintf(stderr, "WSCAN: The journal does not begin with the scan plan.\n");
+            fclose(fd);
+            return -1;
+        }else if(strcmp(word, "move") == 0){
+            nread = sscanf(line, "%*s %*d %*d %d %d %d", 
+                    &state[0], &state[1], &state[2]);
+            if(nread < plan->naxes){
+                fprintf(stderr, "WSCAN: Corrupt journal line: %s", line);
+                fclose(fd);
+                return -1;
+            }
+            for(ii=0; ii<plan->naxes; ii++)
+                jr->state[ii] = state[ii];
+            jr->pending = 1;
+        }else if(strcmp(word, "done") == 0){
+            if(jr->ndone >= jr->maxdone){
+                jr->maxdone = 2*jr->maxdone + 64;
+                itmp = realloc(jr->done, 2 * jr->maxdone * sizeof(int));
+                if(itmp)
+                    jr->done = itmp;
+                dtmp = realloc(jr->merit, jr->maxdone * sizeof(double));
+                if(dtmp)
+                    jr->merit = dtmp;
+                if(!itmp || !dtmp){
+                    fprintf(stderr, "WSCAN: Failed to allocate the journal.\n");
+                    fclose(fd);
+                    return -1;
+                }
+            }
+            if(sscanf(line, "%*s %d %d %lf", &jr->done[2*jr->ndone], 
+                    &jr->done[2*jr->ndone + 1], &merit) != 3){
+                fprintf(stderr, "WSCAN: Corrupt journal line: %s", line);
+                fclose(fd);
+                return -1;
+            }
+            jr->merit[jr->ndone++] = merit;
+        }else if(strcmp(word, "home") == 0){
+            fclose(fd);
+            return 1;
+        }
+    }
+    fclose(fd);
+    if(!planned){
+        fprintf(stderr, "WSCAN: The journal does not begin with the scan plan.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* JOURNAL_OPEN
+ * Start the journal in DEST.  When RESUME is set, the journal from the 
+ * earlier run is loaded, and new lines are appended to it.  Returns 0 on
+ * success, 1 if the scan was already complete, and -1 on failure.
+ */
+int journal_open(journal_t *jr, char *dest, int resume, ScanPlan_t *plan){
+    char filename[STR_LEN];
+    int err, ii, length;
+    
+    jr->fd = NULL;
+    jr->ndone = jr->maxdone = 0;
+    jr->done = NULL;
+    jr->merit = NULL;
+    jr->pending = 0;
+    for(ii=0; ii<PLAN_MAX_AXES; ii++)
+        jr->state[ii] = 0;
+    length = snprintf(filename, STR_LEN, "%s/journal.txt", dest);
+    if(length >= STR_LEN){
+        fprintf(stderr, "WSCAN: The journal file name is too long: %s\n", filename);
+        return -1;
+    }
+    if(resume && (err = journal_load(jr, filename, plan)))
+        return err;
+    if(!(jr->fd = fopen(filename, resume ? "a" : "w"))){
+        fprintf(stderr, "WSCAN: Failed to create the journal: %s\n", filename);
+        return -1;
+    }
+    if(!resume){
+        fprintf(jr->fd, "# wscan checkpoint journal; see wscan -h\n");
+        fprintf(jr->fd, "plan %d %d %d\n", plan->naxes, plan->npoint, plan->order);
+        journal_flush(jr);
+    }
+    return 0;
+}
+
+
+/* JOURNAL_SKIP
+ * Returns 1 and writes the figure of merit to MERIT if the point was 
+ * finished in an earlier run.  Otherwise, returns 0.
+ */
+int journal_skip(journal_t *jr, int pass, int point, double *merit){
+    int ii;
+    for(ii=0; ii<jr->ndone; ii++){
+        if(jr->done[2*ii] == pass && jr->done[2*ii + 1] == point){
+            *merit = jr->merit[ii];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* JOURNAL_RESUME
+ * JOURNAL_MOVE
+ * Before the first motion after a resume, JOURNAL_RESUME() sets the axis
+ * states to the last journaled position, and the STEPS to the next point
+ * are corrected to match.  Once the motion has succeeded, JOURNAL_MOVE()
+ * journals the new axis states.
+ */
+void journal_resume(journal_t *jr, AxisIterator_t *ax[], int naxes, int *steps){
+    int ii;
+    
+    if(!jr->pending)
+        return;
+    for(ii=0; ii<naxes; ii++){
+        steps[ii] += ax[ii]->state - jr->state[ii];
+        ax[ii]->state = jr->state[ii];
+    }
+    jr->pending = 0;
+}
+
+void journal_move(journal_t *jr, int pass, int point, 
+        AxisIterator_t *ax[], int naxes){
+    int ii;
+    
+    if(!jr->fd)
+        return;
+    fprintf(jr->fd, "move %d %d", pass, point);
+    for(ii=0; ii<naxes; ii++)
+        fprintf(jr->fd, " %d", ax[ii]->state);
+    fprintf(jr->fd, "\n");
+    journal_flush(jr);
+}
+
+
+/* JOURNAL_DONE
+ * JOURNAL_HOME
+ * JOURNAL_CLOSE
+ * Record that a point's data were saved to FILE, that the axes returned
+ * to the origin, and close the journal.  Nothing is written when the 
+ * journal is not open.
+ */
+void journal_done(journal_t *jr, int pass, int point, double merit, char *file){
+    if(!jr->fd)
+        return;
+    fprintf(jr->fd, "done %d %d %.17g %s\n", pass, point, merit, file);
+    journal_flush(jr);
+}
+
+void journal_home(journal_t *jr){
+    if(!jr->fd)
+        return;
+    fprintf(jr->fd, "home\n");
+    journal_flush(jr);
+}
+
+void journal_close(journal_t *jr){
+    if(jr->fd)
+        fclose(jr->fd);
+    free(jr->done);
+    free(jr->merit);
+    jr->fd = NULL;
+    jr->done = NULL;
+    jr->merit = NULL;
+}
+
+
+/* WRITE_BLOCK
+ * Consume the next block in the buffer.  It is first added to the wire
+ * reduction, ACC, and the figure of merit, MERIT, if they are not NULL.
+ * Then, it is written to the archive, AR, or the data file, FD, whichever
+ * is not NULL.  If both are NULL, the block is discarded.
+ */
+int write_block(lc_devconf_t *dconf, lcw_accum_t *acc, merit_t *merit,
+        lc_archive_t *ar, FILE *fd){
+    double *data;
+    const float *fdata;
+    unsigned int channels, samples_per_read, ii;
+    
+    // Compact buffers are used in place as floats
+    if((acc || merit) && !lc_stream_peek_float(dconf, &fdata, &channels, &samples_per_read)){
+        if(acc && lcw_accum_add_float(acc, fdata, samples_per_read))
+            fprintf(stderr, "WSCAN: WARNING: The wire reduction ran out of memory.\n");
+        if(merit && dconf->naich > 0){
+            for(ii=0; ii<samples_per_read; ii++)
+                merit->sum += (fdata[ii*channels] - dconf->aich[0].calzero) * 
+                        dconf->aich[0].calslope;
+            merit->n += samples_per_read;
+        }
+    }else if(acc || merit){
+        lc_stream_peek(dconf, &data, &channels, &samples_per_read);
+        if(acc && data && lcw_accum_add(acc, data, samples_per_read))
+            fprintf(stderr, "WSCAN: WARNING: The wire reduction ran out of memory.\n");
+        if(merit && data && dconf->naich > 0){
+            for(ii=0; ii<samples_per_read; ii++)
+                merit->sum += (data[ii*channels] - dconf->aich[0].calzero) * 
+                        dconf->aich[0].calslope;
+            merit->n += samples_per_read;
+        }
+    }
+    if(ar)
+        return lc_archive_write(dconf, ar);
+    else if(fd)
+        return lc_datafile_write(dconf, fd);
+    else if(!lc_stream_read_float(dconf, &fdata, &channels, &samples_per_read))
+        return LCONF_NOERR;
+    return lc_stream_read(dconf, &data, &channels, &samples_per_read);
+}
+
+
+/* CONTINUOUS_LOOP
+ * Visit the points in PLAN while the stream runs.  The data are written
+ * to FD and the segments are written to SFD.  Motion is commanded 
+ * without waiting so that the stream can be written while the axes move.
+ * The axes are x, (y,) and z in that order.
+ */
+int continuous_loop(lc_devconf_t *dconf, ScanPlan_t *plan, FILE *fd, FILE *sfd){
+    unsigned int start, read, waiting;
+    int err, steps[PLAN_MAX_AXES], index[3];
+    double pos[3];
+    AxisIterator_t *yaxis = plan->naxes > 2 ? plan->ax[1] : NULL;
+    
+    plan_start(plan);
+    while(!(err = plan_next(plan, steps))){
+        if(ax_group_move(plan->ax, steps, plan->naxes, 0))
+            return -1;
+        point_get(plan->ax[0], yaxis, plan->ax[plan->naxes-1], index, pos);
+        printf("point %3d of %3d  index: (%d,%d,%d)  (%lf, %lf, %lf)%s\n", 
+                plan_get_point(plan), plan->npoint,
+                index[0], index[1], index[2],
+                pos[0], pos[1], pos[2], plan->ax[0]->units);
+        if(stream_motion(dconf, fd, plan->ax, plan->naxes))
+            return -1;
+        // Mark the segment and collect the data
+        lc_stream_status(dconf, &start, &read, &waiting);
+        if(stream_until(dconf, fd, start + dconf->nsample))
+            return -1;
+        if(yaxis)
+            fprintf(sfd, "%d %d %d %lf %lf %lf %u %u\n",
+                    index[2], index[1], index[0], pos[2], pos[1], pos[0],
+                    start, start + dconf->nsample);
+        else
+            fprintf(sfd, "%d %d %lf %lf %u %u\n",
+                    index[2], index[0], pos[2], pos[0],
+                    start, start + dconf->nsample);
+    }
+    // A normal exit returns 1 from the plan
+    return (err < 0) ? -1 : 0;
+}
+
+
+/* FLY_ROW
+ * Move the x-axis, XAXIS, across the whole row at RATE Hz while the 
+ * stream is written to FD.  The pulse count is read about every 
+ * FLY_POLL_US, and each (ROW, sample, pulses) reading is written to FFD.
+ * The first sample of the motion is fit to the readings with the known
+ * rate and written to START.
+ */
+int fly_row(lc_devconf_t *dconf, AxisIterator_t *xaxis, double rate, 
+        int row, FILE *fd, FILE *ffd, double *start){
+    unsigned int streamed, read, waiting, nfit = 0;
+    int psteps, pulses, err;
+    double spp = dconf->samplehz / rate;    // Samples per pulse
+    double sum = 0.;
+    
+    // Travel to the far end of the row
+    psteps = xaxis->niter * abs(xaxis->steps);
+    lc_stream_status(dconf, &streamed, &read, &waiting);
+    *start = streamed;
+    if(ax_fly(xaxis, xaxis->state == 0 ? xaxis->niter * xaxis->steps : -xaxis->state, rate))
+        return -1;
+    while(!(err = ax_done(xaxis))){
+        if(stream_wait(dconf, fd, FLY_POLL_US))
+            return -1;
+        lc_stream_status(dconf, &streamed, &read, &waiting);
+        if((pulses = ax_progress(xaxis)) < 0)
+            return -1;
+        fprintf(ffd, "%d %u %d\n", row, streamed, pulses);
+        // Only readings taken while the axis moved constrain the fit
+        if(pulses > 0 && pulses < psteps){
+            sum += streamed - spp * pulses;
+            nfit++;
+        }
+    }
+    if(err < 0 || ax_fly_end(xaxis))
+        return -1;
+    if(nfit)
+        *start = sum / nfit;
+    return 0;
+}
+
+
+/* FLY_LOOP
+ * Conduct a fly scan while the stream runs.  The rows are the points of
+ * a plan over the z (and y) axes, and the x-axis is moved across each 
+ * row by FLY_ROW().  The samples within half a step of each x grid point
+ * are written to SFD as CONTINUOUS_LOOP() would, and the pulse count 
+ * readings are written to FFD.
+ */
+int fly_loop(lc_devconf_t *dconf, ScanPlan_t *plan, double rate, 
+        FILE *fd, FILE *sfd, FILE *ffd){
+    AxisIterator_t *xaxis = plan->ax[0];
+    AxisIterator_t *yaxis = plan->naxes > 2 ? plan->ax[1] : NULL;
+    ScanPlan_t rows;
+    int err, kk, steps[PLAN_MAX_AXES], index[3], forward, psteps;
+    double pos[3], spp = dconf->samplehz / rate, start, lo, hi;
+    
+    if(plan_grid(&rows, &plan->ax[1], plan->naxes - 1, 
+            plan->order == PLAN_AUTO ? PLAN_SERPENTINE : plan->order))
+        return -1;
+    psteps = xaxis->niter * abs(xaxis->steps);
+    plan_start(&rows);
+    while(!(err = plan_next(&rows, steps))){
+        // Move to the row, and wait for it to settle
+        if(ax_group_move(rows.ax, steps, rows.naxes, 0) || 
+                stream_motion(dconf, fd, rows.ax, rows.naxes)){
+            err = -1;
+            break;
+        }
+        forward = (xaxis->state == 0);
+        xaxis->_index = forward ? 0 : xaxis->niter;
+        point_get(xaxis, yaxis, plan->ax[plan->naxes-1], index, pos);
+        printf("row %3d of %3d  index: (-,%d,%d)  (-, %lf, %lf)%s\n", 
+                plan_get_point(&rows), rows.npoint,
+                index[1], index[2], pos[1], pos[2], xaxis->units);
+        if(fly_row(dconf, xaxis, rate, plan_get_point(&rows), fd, ffd, &start)){
+            err = -1;
+            break;
+        }
+        // Split the row into bins around each x grid point
+        for(kk=0; kk<=xaxis->niter; kk++){
+            xaxis->_index = forward ? kk : xaxis->niter - kk;
+            point_get(xaxis, yaxis, plan->ax[plan->naxes-1], index, pos);
+            pos[0] = xaxis->_index * xaxis->steps * xaxis->cal;
+            // The pulse range, and then the sample range
+            lo = (kk - 0.5) * abs(xaxis->steps);
+            hi = (kk + 0.5) * abs(xaxis->steps);
+            lo = start + spp * (lo < 0 ? 0 : lo);
+            hi = start + spp * (hi > psteps ? psteps : hi);
+            lo = lo < 0 ? 0 : floor(lo + 0.5);
+            hi = hi < 0 ? 0 : floor(hi + 0.5);
+            if(yaxis)
+                fprintf(sfd, "%d %d %d %lf %lf %lf %u %u\n",
+                        index[2], index[1], index[0], pos[2], pos[1], pos[0],
+                        (unsigned int) lo, (unsigned int) hi);
+            else
+                fprintf(sfd, "%d %d %lf %lf %u %u\n",
+                        index[2], index[0], pos[2], pos[0],
+                        (unsigned int) lo, (unsigned int) hi);
+        }
+    }
+    plan_free(&rows);
+    // A normal exit returns 1 from the plan
+    return (err < 0) ? -1 : 0;
+}
+
+
+/* CONTINUOUS_SCAN
+ * Conduct the scan with a single stream that runs the whole time.  The 
+ * data are written to DEST/scan.dat, and the samples collected at each
+ * point are recorded in DEST/segments.txt.  When FLY_RATE is positive,
+ * the scan is a fly scan with the x-axis moving at FLY_RATE Hz (see 
+ * FLY_LOOP()), and the pulse count readings are written to DEST/fly.txt.
+ */
+int continuous_scan(lc_devconf_t *dconf, ScanPlan_t *plan, double fly_rate,
+        char *dest_directory){
+    char filename[STR_LEN];
+    int err, length;
+    FILE *fd, *sfd, *ffd = NULL;
+    AxisIterator_t *xaxis = plan->ax[0], *zaxis = plan->ax[plan->naxes-1];
+    
+    length = snprintf(filename, STR_LEN, "%s/scan.dat", dest_directory);
+    if(length >= STR_LEN){
+        fprintf(stderr, "WSCAN: The data file name is too long: %s\n", filename);
+        return -1;
+    }
+    fd = fopen(filename, "wb");
+    if(!fd){
+        fprintf(stderr, "WSCAN: Failed to create file: %s\n", filename);
+        return -1;
+    }
+    length = snprintf(filename, STR_LEN, "%s/segments.txt", dest_directory);
+    if(length >= STR_LEN){
+        fprintf(stderr, "WSCAN: The segment file name is too long: %s\n", filename);
+        fclose(fd);
+        return -1;
+    }
+    sfd = fopen(filename, "w");
+    if(!sfd){
+        fprintf(stderr, "WSCAN: Failed to create file: %s\n", filename);
+        fclose(fd);
+        return -1;
+    }
+    if(fly_rate > 0){
+        length = snprintf(filename, STR_LEN, "%s/fly.txt", dest_directory);
+        if(length >= STR_LEN){
+            fprintf(stderr, "WSCAN: The fly file name is too long: %s\n", filename);
+            fclose(fd);
+            fclose(sfd);
+            return -1;
+        }
+        ffd = fopen(filename, "w");
+        if(!ffd){
+            fprintf(stderr, "WSCAN: Failed to create file: %s\n", filename);
+            fclose(fd);
+            fclose(sfd);
+            return -1;
+        }
+        fprintf(ffd, "# row sample pulses (%lf Hz, %lf %s per pulse)\n", 
+                fly_rate, plan->ax[0]->cal, plan->ax[0]->units);
+    }
+    if(plan->naxes > 2)
+        fprintf(sfd, "# z-index y-index x-index z(%s) y(%s) x(%s) start stop\n", 
+                zaxis->units, plan->ax[1]->units, xaxis->units);
+    else
+        fprintf(sfd, "# z-index x-index z(%s) x(%s) start stop\n", 
+                zaxis->units, xaxis->units);
+    
+    // The data file header records the starting position
+    if( lc_put_meta_flt(dconf, "x", ax_get_pos(xaxis)) || 
+            lc_put_meta_flt(dconf, "y", plan->naxes > 2 ? ax_get_pos(plan->ax[1]) : 0.) ||
+            lc_put_meta_flt(dconf, "z", ax_get_pos(zaxis)) ){
+        fprintf(stderr, "WSCAN: WARNING! Failed to write the (x,y,z) meta values prior to data acquisition\n");
+    }
+    
+    lc_stream_continuous(dconf, 1);
+    err = -1;
+    if(lc_stream_start(dconf, -1)){
+        fprintf(stderr, "WSCAN: Failed to start data stream. Aborting\n");
+    }else if(lc_stream_thread_start(dconf)){
+        fprintf(stderr, "WSCAN: Failed to start the acquisition thread. Aborting\n");
+        lc_stream_stop(dconf);
+    }else{
+        lc_datafile_init(dconf, fd);
+        if(ffd)
+            err = fly_loop(dconf, plan, fly_rate, fd, sfd, ffd);
+        else
+            err = continuous_loop(dconf, plan, fd, sfd);
+        lc_stream_stop(dconf);
+        // Flush what is left in the buffer
+        while( !lc_stream_isempty(dconf) )
+            lc_datafile_write(dconf, fd);
+    }
+    lc_stream_clean(dconf);
+    lc_stream_continuous(dconf, 0);
+    fclose(fd);
+    fclose(sfd);
+    if(ffd)
+        fclose(ffd);
+    return err;
+}
+
+
 int main(int argc, char *argv[]){
     int ch,             // holds the character for the getopt system
-        err;            // error index
+        err,            // error index
+        length;         // length of a constructed file name
     char config_filename[STR_LEN], 
         dest_directory[STR_LEN],
         slice_directory[STR_LEN],
         filename[STR_LEN],
         stemp[STR_SHORT],
         stemp1[STR_SHORT];
-    AxisIterator_t xaxis, zaxis;
+    AxisIterator_t xaxis, yaxis, zaxis;
+    AxisIterator_t *axes[PLAN_MAX_AXES];    // The axes in the plan: x, (y,) z
+    AxisIterator_t *yaxisp = NULL;  // The y-axis, if there is one
+    int naxes;          // Number of axes in the scan
+    int steps[PLAN_MAX_AXES];   // Steps to the next point
+    ScanPlan_t plan;    // The order of the points in the scan
+    ScanRefine_t refine;    // Adaptive refinement of the plan
+    merit_t merit, *meritp = NULL;  // Figure of merit for refinement
     double ftemp;
     int itemp, ii;
+    int thread_f = 0;   // use the threaded acquisition?
+    int continuous_f = 0;   // stream continuously through the scan?
+    int fly_f = 0;      // move the x-axis continuously through each row?
+    int resume_f = 0;   // resume an interrupted scan?
+    int saved;          // were the data from this point saved?
+    journal_t journal;  // checkpoint journal
+    double fly_rate = 0.;   // x-axis pulse rate in a fly scan (Hz)
+    int archive_f = 0;  // write a single archive instead of a file per point?
+    int wire_f = 0;     // reduce the wire data while they arrive?
+    int raw_f = 1;      // write the raw data?
+    int index[3];       // Grid indices (x,y,z) for the archive
+    double pos[3];      // Position (x,y,z) for the archive
+    lc_archive_t ar, *arp = NULL;
+    lcw_accum_t acc, *accp = NULL;
+    FILE *wfd = NULL;
+    settle_t settle;    // Settle detection parameters
+    double tsettle;     // Time spent detecting the settle (s)
+    unsigned int pool_flags = 0,    // buffer pool flags
+        nalloc;         // buffer allocation count
+    unsigned long pool_bytes;
     
     time_t now;
     struct stat dirstat;
@@ -109,7 +958,7 @@ int main(int argc, char *argv[]){
     dest_directory[0] = '\0';
     
     // Parse the options
-    while((ch = getopt(argc, argv, "hc:d:i:s:f:")) >= 0){
+    while((ch = getopt(argc, argv, "htlaCFwWrc:d:i:s:f:")) >= 0){
         switch(ch){
         case 'h':
             printf("%s",help_text);
@@ -120,6 +969,34 @@ int main(int argc, char *argv[]){
         case 'd':
             strcpy(dest_directory, optarg);
         break;
+        case 't':
+            thread_f = 1;
+        break;
+        case 'l':
+            pool_flags = LC_RB_MLOCK | LC_RB_HUGE;
+        break;
+        case 'a':
+            archive_f = 1;
+        break;
+        case 'C':
+            continuous_f = 1;
+            thread_f = 1;
+        break;
+        case 'F':
+            fly_f = 1;
+            continuous_f = 1;
+            thread_f = 1;
+        break;
+        case 'r':
+            resume_f = 1;
+        break;
+        case 'w':
+            wire_f = 1;
+        break;
+        case 'W':
+            wire_f = 1;
+            raw_f = 0;
+        break;
         case 'i':
         case 's':
         case 'f':
@@ -140,6 +1017,19 @@ int main(int argc, char *argv[]){
         time(&now);
         strftime(dest_directory, STR_LEN, "%04Y%02m%02d%02H%02M%02S", localtime(&now));
     }
+    // The wire reduction works point-by-point
+    if(wire_f && continuous_f){
+        fprintf(stderr, "WSCAN: The wire reduction (-w, -W) is not supported with -C.\n");
+        return -1;
+    }
+    // Without raw data, there is nothing to archive
+    if(!raw_f)
+        archive_f = 0;
+    // Only the point-by-point scan is journaled
+    if(resume_f && (continuous_f || archive_f)){
+        fprintf(stderr, "WSCAN: Resume (-r) is not supported with -a, -C, or -F.\n");
+        return -1;
+    }
     // Load the configuration file.
     if(lc_load_config(&dconf, 1, config_filename))
         return -1;
@@ -147,11 +1037,19 @@ int main(int argc, char *argv[]){
         
     // Go back and apply any meta configuration parameters
     optind = 1;
-    while((ch = getopt(argc, argv, "hc:d:i:s:f:")) >= 0){
+    while((ch = getopt(argc, argv, "htlaCFwWrc:d:i:s:f:")) >= 0){
         switch(ch){
         case 'h':
         case 'c':
         case 'd':
+        case 't':
+        case 'l':
+        case 'a':
+        case 'C':
+        case 'F':
+        case 'r':
+        case 'w':
+        case 'W':
             // These have already been dealt with
         break;
         case 'i':
@@ -189,16 +1087,89 @@ int main(int argc, char *argv[]){
         }
     }
 
+    // Open the device connection
+    if(lc_open(&dconf)){
+        fprintf(stderr, "WSCAN: Failed to open the device connection.\n");
+        return -1;
+    }
+    // Upload the device configuration
+    if(lc_upload_config(&dconf)){
+        fprintf(stderr, "WSCAN: Configuration upload failed.\n");
+        lc_close(&dconf);
+        return -1;
+    }
+
     // Initialize the axis iterators
-    // This includes configuration
-    if(ax_init(&xaxis, &dconf, 0, 'x')){
+    // This includes configuration.  The EF register addresses are resolved
+    // by the upload.
+    if(ax_init(&xaxis, &dconf, XPULSE_EF, 'x')){
         fprintf(stderr, "WSCAN: Configuration of the x-axis failed.\n");
+        lc_close(&dconf);
         return -1;
     }
-    if(ax_init(&zaxis, &dconf, 1, 'z')){
+    if(ax_init(&zaxis, &dconf, ZPULSE_EF, 'z')){
         fprintf(stderr, "WSCAN: Configuration of the z-axis failed.\n");
+        lc_close(&dconf);
+        return -1;
+    }
+    // The y-axis is optional
+    naxes = 0;
+    axes[naxes++] = &xaxis;
+    if(lc_get_meta_type(&dconf, "yn")){
+        if(ax_init(&yaxis, &dconf, YPULSE_EF, 'y')){
+            fprintf(stderr, "WSCAN: Configuration of the y-axis failed.\n");
+            lc_close(&dconf);
+            return -1;
+        }
+        yaxisp = &yaxis;
+        axes[naxes++] = &yaxis;
+    }
+    axes[naxes++] = &zaxis;
+    // Plan the order of the points
+    if(plan_init(&plan, &dconf, axes, naxes)){
+        fprintf(stderr, "WSCAN: Planning the scan failed.\n");
+        lc_close(&dconf);
+        return -1;
+    }
+    printf("Scan plan: %d points in %s order, %ld steps\n", 
+            plan.npoint, plan_order_names[plan.order], plan_cost(&plan));
+    // The fly scan moves x through each row of the grid
+    if(fly_f){
+        if(plan.order == PLAN_LIST || plan.order == PLAN_AUTO){
+            fprintf(stderr, "WSCAN: The fly scan (-F) requires a grid scan.\n");
+            lc_close(&dconf);
+            return -1;
+        }
+        fly_rate = abs(xaxis.steps) * dconf.samplehz / dconf.nsample;
+        if(lc_get_meta_type(&dconf, "xfly") == LC_MT_FLT)
+            lc_get_meta_flt(&dconf, "xfly", &fly_rate);
+        if(fly_rate <= 0.){
+            fprintf(stderr, "WSCAN: The fly scan pulse rate, xfly, must be positive.\n");
+            lc_close(&dconf);
+            return -1;
+        }
+        printf("Fly scan: %lf Hz, %lf%s/s\n", fly_rate, 
+                fly_rate * xaxis.cal, xaxis.units);
+    }
+    // Configure the adaptive refinement
+    if(refine_init(&refine, &dconf, &plan)){
+        fprintf(stderr, "WSCAN: Configuration of the refinement failed.\n");
+        lc_close(&dconf);
         return -1;
+    }else if(continuous_f && refine.budget > 0)
+        fprintf(stderr, "WSCAN: WARNING: Refinement is not used with -C.\n");
+    else if(refine.budget > 0){
+        merit.sum = 0.;
+        merit.n = 0;
+        meritp = &merit;
     }
+    // Load the settle detection parameters
+    if(settle_init(&dconf, &settle)){
+        fprintf(stderr, "WSCAN: Configuration of the settle detection failed.\n");
+        lc_close(&dconf);
+        return -1;
+    }else if(continuous_f && settle.var > 0.)
+        fprintf(stderr, "WSCAN: WARNING: Settle detection is not used with -C.\n");
     // Verify that the wire radii are configured
     // wscan doesn't need them, but the post processing codes will
     for(ii=0; ii<LCONF_MAX_META; ii++){
@@ -208,19 +1179,18 @@ int main(int argc, char *argv[]){
             printf("Wire %d radius: %lf", ii, ftemp);
         }else if(ii==0){
             fprintf(stderr, "WSCAN: Found no wire radii in the configuration file.\n");
+            lc_close(&dconf);
             return -1;
         }else
             break;
     }
 
-    // Open the device connection
-    if(lc_open(&dconf)){
-        fprintf(stderr, "WSCAN: Failed to open the device connection.\n");
-        return -1;
-    }
-    // Upload the device configuration
-    if(lc_upload_config(&dconf)){
-        fprintf(stderr, "WSCAN: Configuration upload failed.\n");
+    // Allocate the stream buffer once for all of the points
+    // Binary data files are written as floats, so the buffer can be too.
+    if(dconf.dataformat == LC_DF_BIN)
+        pool_flags |= LC_RB_FLOAT;
+    if(lc_stream_pool(&dconf, -1, pool_flags)){
+        fprintf(stderr, "WSCAN: Failed to allocate the stream buffer.\n");
         lc_close(&dconf);
         return -1;
     }
@@ -229,104 +1199,323 @@ int main(int argc, char *argv[]){
     err = stat(dest_directory, &dirstat);
     // If the directory doesn't exist, create it
     if(err){
-        if(mkdir(dest_directory, 0755)){
+        if(resume_f){
+            fprintf(stderr, "WSCAN: There is no scan to resume in: %s\n", dest_directory);
+            lc_close(&dconf);
+            return -1;
+        }else if(mkdir(dest_directory, 0755)){
             fprintf(stderr, "WSCAN: Failed to create directory: %s\n", dest_directory);
             lc_close(&dconf);
             return -1;
         }
     // If the directory already exists, warn the user
-    }else{
+    }else if(!resume_f){
         fprintf(stderr, "WSCAN: The destination directory already exists: %s\n", dest_directory);
+        lc_close(&dconf);
         return -1;
     }
+    
+    // Start the checkpoint journal
+    journal.fd = NULL;
+    journal.pending = 0;
+    journal.ndone = 0;
+    journal.done = NULL;
+    journal.merit = NULL;
+    if(!continuous_f && !archive_f){
+        err = journal_open(&journal, dest_directory, resume_f, &plan);
+        if(err > 0){
+            printf("The scan in %s is already complete.\n", dest_directory);
+            journal_close(&journal);
+            lc_close(&dconf);
+            return 0;
+        }else if(err){
+            lc_close(&dconf);
+            return -1;
+        }else if(resume_f)
+            printf("Resuming with %d points already saved.\n", journal.ndone);
+    }
+    
+    // Set up the wire reduction
+    if(wire_f){
+        length = snprintf(filename, STR_LEN, "%s/output.wdf", dest_directory);
+        if(length >= STR_LEN){
+            fprintf(stderr, "WSCAN: The wire data file name is too long: %s\n", filename);
+            lc_close(&dconf);
+            return -1;
+        }else if(lcw_accum_init(&acc, &dconf, 
+                LCW_THETA_MIN, LCW_THETA_MAX, LCW_THETA_STEP)){
+            fprintf(stderr, "WSCAN: Failed to configure the wire reduction.\n");
+            lc_close(&dconf);
+            return -1;
+        }else if(!(wfd = fopen(filename, resume_f ? "ab" : "wb"))){
+            fprintf(stderr, "WSCAN: Failed to create file: %s\n", filename);
+            lcw_accum_free(&acc);
+            lc_close(&dconf);
+            return -1;
+        }
+        accp = &acc;
+    }
 
-    // Set up the x- and z-axes iteration
-    ax_iter_start(&zaxis);
-    ax_iter_start(&xaxis);
-    // z-loop
-    while(!(err = ax_iter(&zaxis, -1))){
-        // Let the user know what's goin on
-        printf("z-index: %3d of %3d  (%lf%s)\n", 
-                ax_get_index(&zaxis), 
-                zaxis.niter, 
-                ax_get_pos(&zaxis), 
-                zaxis.units);
-        
-        // Create a directory for each z-slice
-        sprintf(slice_directory, "%s/%03d", dest_directory, ax_get_index(&zaxis));
-        if(mkdir(slice_directory, 0755)){
-            fprintf(stderr, "WSCAN: Failed to create slice directory: %s\n", slice_directory);
+    // The continuous scan is handled separately
+    if(continuous_f){
+        if(continuous_scan(&dconf, &plan, fly_rate, dest_directory)){
             lc_close(&dconf);
             return -1;
         }
         
-        // x-loop
-        while(!(err = ax_iter(&xaxis, -1))){
+    }else{
+        // In archive mode, the header is written once for the whole scan
+        if(archive_f){
+            length = snprintf(filename, STR_LEN, "%s/scan.lca", dest_directory);
+            if(length >= STR_LEN){
+                fprintf(stderr, "WSCAN: The archive file name is too long: %s\n", filename);
+                lc_close(&dconf);
+                return -1;
+            }else if(lc_archive_open(&dconf, &ar, filename)){
+                lc_close(&dconf);
+                return -1;
+            }
+            arp = &ar;
+        }
+        // Visit the points in the plan, and then in each refinement pass
+        plan_start(&plan);
+        while(!(err = refine_plan_next(&refine, &plan, steps))){
+            // Skip the points saved before a resume
+            if(journal_skip(&journal, refine.level, plan_get_point(&plan), &ftemp)){
+                for(ii=0; ii<naxes; ii++)
+                    axes[ii]->state += steps[ii];
+                if(meritp && refine_record(&refine, &plan, ftemp))
+                    fprintf(stderr, "WSCAN: WARNING: Failed to record the point for refinement.\n");
+                continue;
+            }
+            journal_resume(&journal, axes, naxes, steps);
+            if(ax_group_move(axes, steps, naxes, -1)){
+                fprintf(stderr, "WSCAN: Failed to move to point %d.  Resume with -r.\n",
+                        plan_get_point(&plan));
+                goto abort_scan;
+            }
+            journal_move(&journal, refine.level, plan_get_point(&plan), 
+                    axes, naxes);
+            saved = 1;
+            point_get(&xaxis, yaxisp, &zaxis, index, pos);
             // Let the user know what's going on
-            printf("  x-index: %3d of %3d  (%lf%s)\n", 
-                    ax_get_index(&xaxis), 
-                    xaxis.niter, 
-                    ax_get_pos(&xaxis), 
-                    xaxis.units);
-            // Record the current z and x indices
-            if( lc_put_meta_flt(&dconf, "x", ax_get_pos(&xaxis)) || 
-                    lc_put_meta_flt(&dconf, "y", 0.) ||
-                    lc_put_meta_flt(&dconf, "z", ax_get_pos(&zaxis)) ){
+            if(refine.level && plan_get_point(&plan) == 0)
+                printf("Refinement pass %d: %d points\n", refine.level, plan.npoint);
+            printf("point %3d of %3d  index: (%d,%d,%d)  (%lf, %lf, %lf)%s\n", 
+                    plan_get_point(&plan), plan.npoint,
+                    index[0], index[1], index[2],
+                    pos[0], pos[1], pos[2], xaxis.units);
+            // Record the current position
+            if( lc_put_meta_flt(&dconf, "x", pos[0]) || 
+                    lc_put_meta_flt(&dconf, "y", pos[1]) ||
+                    lc_put_meta_flt(&dconf, "z", pos[2]) ){
                 fprintf(stderr, "WSCAN: WARNING! Failed to write the (x,y,z) meta values prior to data acquisition\n");
             }
             
+            if(meritp && lc_put_meta_int(&dconf, "refine", refine.level))
+                fprintf(stderr, "WSCAN: WARNING! Failed to write the refine meta value\n");
+            
+            // Create a directory for each z-slice (or refinement pass) the
+            // first time it is visited
+            if(refine.level)
+                length = snprintf(slice_directory, STR_LEN, "%s/r%02d", 
+                        dest_directory, refine.level);
+            else
+                length = snprintf(slice_directory, STR_LEN, "%s/%03d", 
+                        dest_directory, index[2]);
+            if(length >= STR_LEN){
+                fprintf(stderr, "WSCAN: The slice directory name is too long: %s\n", slice_directory);
+                goto abort_scan;
+            }
+            if(raw_f && !archive_f && stat(slice_directory, &dirstat) && 
+                    mkdir(slice_directory, 0755)){
+                fprintf(stderr, "WSCAN: Failed to create slice directory: %s\n", slice_directory);
+                goto abort_scan;
+            }
+            // construct the file name
+            if(refine.level)
+                length = snprintf(filename, STR_LEN, "%s/%03d.dat", 
+                        slice_directory, index[0]);
+            else if(yaxisp)
+                length = snprintf(filename, STR_LEN, "%s/%03d_%03d_%03d.dat", 
+                        slice_directory, index[2], index[1], index[0]);
+            else
+                length = snprintf(filename, STR_LEN, "%s/%03d_%03d.dat", 
+                        slice_directory, index[2], index[0]);
+            if(length >= STR_LEN){
+                fprintf(stderr, "WSCAN: The data file name is too long: %s\n", filename);
+                goto abort_scan;
+            }
+            
+            // Wait for the wire current to settle
+            if(settle.var > 0.){
+                err = settle_wait(&dconf, &settle, &tsettle);
+                if(err < 0){
+                    fprintf(stderr, "WSCAN: Failed while detecting the settle. Aborting\n");
+                    goto abort_scan;
+                }else if(err)
+                    fprintf(stderr, "WSCAN: WARNING: The signal did not settle in %.3fs\n", tsettle);
+                if(lc_put_meta_flt(&dconf, "tsettle", tsettle))
+                    fprintf(stderr, "WSCAN: WARNING! Failed to write the tsettle meta value\n");
+                err = 0;
+            }
+        
             // Read data in a burst configuration: start, service, stop
             if(lc_stream_start(&dconf, -1)){
                 fprintf(stderr, "WSCAN: Failed to start data stream. Aborting\n");
-                lc_close(&dconf);
-                return -1;
+                goto abort_scan;
             }
-            // Keep going until the collection is complete
-            while( !lc_stream_iscomplete(&dconf) ){
-                if(lc_stream_service(&dconf)){
-                    fprintf(stderr, "WSCAN: Unexpected error while streaming data. Aborting\n");
+        
+            // In threaded mode, the data are written while they arrive
+            if(thread_f){
+                if(lc_stream_thread_start(&dconf)){
+                    fprintf(stderr, "WSCAN: Failed to start the acquisition thread. Aborting\n");
                     lc_stream_stop(&dconf);
-                    lc_close(&dconf);
-                    return -1;
+                    goto abort_scan;
+                }
+                if(archive_f){
+                    fd = NULL;
+                    lc_archive_begin(&ar, index, pos);
+                }else if(!raw_f){
+                    fd = NULL;
+                }else{
+                    fd = fopen(filename, "wb");
+                    if(fd)
+                        lc_datafile_init(&dconf, fd);
+                    else{
+                        fprintf(stderr, "WSCAN: WARNING: Failed to create file: %s\n    The data were lost!\n", filename);
+                        saved = 0;
+                    }
+                }
+                // Keep going until the collection is complete and the
+                // buffer has been drained
+                while( !lc_stream_iscomplete(&dconf) || !lc_stream_isempty(&dconf) ){
+                    if(lc_stream_service(&dconf)){
+                        fprintf(stderr, "WSCAN: Unexpected error while streaming data. Aborting\n");
+                        lc_stream_stop(&dconf);
+                        goto abort_scan;
+                    }
+                    while( !lc_stream_isempty(&dconf) )
+                        write_block(&dconf, accp, meritp, arp, fd);
+                }
+                lc_stream_stop(&dconf);
+                if(archive_f)
+                    lc_archive_end(&ar);
+                else if(fd){
+                    fclose(fd);
+                    fd = NULL;
                 }
-            }
-            lc_stream_stop(&dconf);
             
-            // construct the file name and open it.  Only write if the 
-            // open operation is complete.
-            sprintf(filename, "%s/%03d_%03d.dat", 
-                    slice_directory, 
-                    ax_get_index(&zaxis), 
-                    ax_get_index(&xaxis));
-            fd = fopen(filename, "wb");
-            if(fd){
-                // Write the data file
-                lc_datafile_init(&dconf, fd);
-                while( !lc_stream_isempty(&dconf) )
-                    lc_datafile_write(&dconf, fd);
-                fclose(fd);
-                fd = NULL;
             }else{
-                fprintf(stderr, "WSCAN: WARNING: Failed to create file: %s\n    The data were lost!\n", filename);
+                // Keep going until the collection is complete
+                while( !lc_stream_iscomplete(&dconf) ){
+                    if(lc_stream_service(&dconf)){
+                        fprintf(stderr, "WSCAN: Unexpected error while streaming data. Aborting\n");
+                        lc_stream_stop(&dconf);
+                        goto abort_scan;
+                    }
+                }
+                lc_stream_stop(&dconf);
+            
+                if(archive_f){
+                    lc_archive_begin(&ar, index, pos);
+                    while( !lc_stream_isempty(&dconf) )
+                        write_block(&dconf, accp, meritp, arp, NULL);
+                    lc_archive_end(&ar);
+                // Without raw data, the blocks are only reduced
+                }else if(!raw_f){
+                    while( !lc_stream_isempty(&dconf) )
+                        write_block(&dconf, accp, meritp, NULL, NULL);
+                // Open the file.  Only write if the open operation is 
+                // complete.
+                }else if((fd = fopen(filename, "wb"))){
+                    // Write the data file
+                    lc_datafile_init(&dconf, fd);
+                    while( !lc_stream_isempty(&dconf) )
+                        write_block(&dconf, accp, meritp, NULL, fd);
+                    fclose(fd);
+                    fd = NULL;
+                }else{
+                    fprintf(stderr, "WSCAN: WARNING: Failed to create file: %s\n    The data were lost!\n", filename);
+                    saved = 0;
+                }
             }
             lc_stream_clean(&dconf);
             
-        }// End x-loop
+            // Write the wire data from this point.  Like post1, y is 0.
+            if(wire_f){
+                err = lcw_accum_write(&acc, wfd, pos[0], 0.);
+                if(err < 0)
+                    fprintf(stderr, "WSCAN: WARNING: Wire reduction failed: %s\n", lcw_strerror(err));
+                else
+                    fflush(wfd);
+                lcw_accum_reset(&acc);
+            }
+            
+            // Record the figure of merit for refinement
+            ftemp = meritp ? merit_mean(meritp) : NAN;
+            if(meritp && refine_record(&refine, &plan, ftemp))
+                fprintf(stderr, "WSCAN: WARNING: Failed to record the point for refinement.\n");
+            // Checkpoint the point, so a resume will not repeat it
+            if(saved)
+                journal_done(&journal, refine.level, plan_get_point(&plan), 
+                        ftemp, filename);
+        
+        }// End plan
+        if(err < 0){
+            fprintf(stderr, "WSCAN: Failed to plan the next point.\n");
+            goto abort_scan;
+        }
+        refine_free(&refine);
         
-        // Set up for the next scan
-        ax_iter_repeat(&xaxis);
-    }// End z-loop
+        if(archive_f && lc_archive_close(&ar))
+            fprintf(stderr, "WSCAN: WARNING: Failed to write the archive index.\n");
+        if(wire_f){
+            fclose(wfd);
+            lcw_accum_free(&acc);
+        }
+    }
+    
+    plan_free(&plan);
     
     // Move back to the origin
     printf("Returning to home.\n");
-    // X-axis first
-    ax_move(&xaxis, -xaxis.state, -1);
-    // Then the z-axis
-    ax_move(&zaxis, -zaxis.state, -1);
+    for(ii=0; ii<naxes; ii++)
+        steps[ii] = -axes[ii]->state;
+    journal_resume(&journal, axes, naxes, steps);
+    if(ax_group_move(axes, steps, naxes, -1)){
+        fprintf(stderr, "WSCAN: Failed to return to home.\n");
+        journal_close(&journal);
+        lc_close(&dconf);
+        return -1;
+    }
+    journal_move(&journal, -1, -1, axes, naxes);
+    journal_home(&journal);
+    journal_close(&journal);
+    
+    // Report on the buffer memory
+    lc_stream_pool_status(&dconf, &nalloc, &ftemp, &pool_bytes);
+    printf("Stream buffer: %lu bytes, %u allocation(s), %.3fms first-touch\n",
+            pool_bytes, nalloc, ftemp);
     
     // All done
     lc_close(&dconf);
     return 0;
+    
+    // Abort the scan from inside the point loop.  The archive index is 
+    // written so the points that were already recorded are not lost.
+abort_scan:
+    refine_free(&refine);
+    plan_free(&plan);
+    if(arp && lc_archive_close(arp))
+        fprintf(stderr, "WSCAN: WARNING: Failed to write the archive index.\n");
+    if(wire_f){
+        fclose(wfd);
+        lcw_accum_free(&acc);
+    }
+    journal_close(&journal);
+    lc_close(&dconf);
+    return -1;
 }
 
 
@@ -1,5 +1,8 @@
 #include "lconfig.h"
 #include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <stdlib.h>
 
 /* AxisIterator
  *  A struct to manage axis motion using stepper motors. It requires an
@@ -13,7 +16,27 @@
 #define __WSCAN_H__
 
 #define AX_STR          64          // Standard string length
-#define AX_SETTLE_US    100000      // Time to wait for the axis motion to settle
+#define AX_SETTLE_US    100000      // Default time to wait for the axis motion to settle
+#define AX_POLL_US      1000        // First interval between completion checks
+#define AX_POLL_MAX_US  50000       // Longest interval between completion checks
+#define AX_TIMEOUT_US   1000000     // Allowance beyond the nominal motion time
+#define AX_NRAMP        8           // Speed steps in each acceleration ramp
+#define AX_NSEG         (2*AX_NRAMP + 1)    // Most pulse trains in one motion
+#define AX_TRAIN_US     10000       // Allowance for the overhead of each pulse train
+#define AX_GROUP_MAX    3           // Most axes in an axis group
+
+// Indices into the AxisIterator register table
+#define AX_REG_DIR      0           // Direction bit (DIOn)
+#define AX_REG_COUNT    1           // Pulse count (DIOn_EF_CONFIG_C)
+#define AX_REG_ENABLE   2           // Pulse out enable (DIOn_EF_ENABLE)
+#define AX_NREG         3
+#define AX_REG_DONE     3           // Pulses completed (DIOn_EF_READ_A)
+#define AX_REG_TARGET   4           // Pulses commanded (DIOn_EF_READ_B)
+#define AX_REG_CONFIG_A 5           // High-to-low index (DIOn_EF_CONFIG_A)
+#define AX_REG_CONFIG_B 6           // Low-to-high index (DIOn_EF_CONFIG_B)
+#define AX_REG_CLK_EN   7           // EF clock enable (DIO_EF_CLOCK0_ENABLE)
+#define AX_REG_CLK_ROLL 8           // EF clock roll (DIO_EF_CLOCK0_ROLL_VALUE)
+#define AX_NREG_ALL     9
 
 typedef struct _AxisIterator {
     lc_devconf_t    *dconf; // The LConfig device configuration
@@ -25,9 +48,19 @@ typedef struct _AxisIterator {
     int             steps;  // The steps per each motion
     int             niter;  // Number of iterations in a scan
     int             dpos;   // Direction bit value when moving in the positive axis
+    int             settle_us;  // Time to wait after each motion completes
+    double          vmax;   // Fastest pulse rate (Hz) in ramped motions
+    double          accel;  // Pulse rate acceleration (Hz/s) in ramped motions
+    // Register addresses and types for the direction bit and the pulse out
+    // channel's registers, resolved once by AX_INIT()
+    int             _reg[AX_NREG_ALL];
+    int             _regtype[AX_NREG_ALL];
     // These are "live" parameters in use during a scan
     int             _dir;   // Direction of motion
     int             _index; // Number of iterations performed
+    int             _psteps; // Steps in the last commanded motion
+    double          _tmove_us; // Nominal duration of the last motion
+    int             _pending; // Has the last motion been sent without a wait?
 } AxisIterator_t;
 
 
@@ -49,10 +82,23 @@ typedef struct _AxisIterator {
  * Xcal     : [float] (>0)  Calibration in length per count
  * Xunits   : [str] (<63 char) Unit length string
  * 
+ * The optional meta data are:
+ * Xsettle  : [float] (>=0) Seconds to wait after each motion completes.  
+ *            The default is AX_SETTLE_US.
+ * Xvmax    : [float] (>0)  Fastest pulse rate in Hz
+ * Xaccel   : [float] (>0)  Pulse rate acceleration in Hz per second
+ * 
+ * When Xvmax and Xaccel are both given, and Xvmax is faster than the
+ * EFFREQUENCY, motions that wait for completion are ramped (see 
+ * AX_PROFILE()).  Otherwise, all pulses are sent at the EFFREQUENCY.
+ * 
  * efch : the extended feature channel to associate with this axis.  It
  *        must be configured as a pulse output.  Note that the direction
  *        pin will automatically be set as (dconf[efch].channel + 1)
  *
+ * The pulse out register addresses are taken from those resolved by 
+ * LC_UPLOAD_CONFIG(), so the configuration must be uploaded first.
+ *
  * axis : a single-character used to identify the mandatory meta 
  *        configuration parameters in the LConfig struct.
  * 
@@ -60,12 +106,16 @@ typedef struct _AxisIterator {
  * Returns -1 on failure.
  */
 int ax_init(AxisIterator_t *ax, lc_devconf_t *dconf, int efch, char axis){
-    int dirch;
+    int dirch, err;
+    double ftemp;
     char stemp[AX_STR];
     
     ax->state = 0;
     ax->_index = -1;
     ax->_dir = 1;
+    ax->_psteps = 0;
+    ax->_tmove_us = 0.;
+    ax->_pending = 0;
     
     ax->dconf = dconf;
     // Is the efch number in range?
@@ -86,8 +136,36 @@ int ax_init(AxisIterator_t *ax, lc_devconf_t *dconf, int efch, char axis){
         fprintf(stderr, "AX_INIT: direction pin, DIO%d, is not configured as an output.\n", dirch);
         return -1;
     }
+    // The pulse out registers were resolved by LC_UPLOAD_CONFIG()
+    if(!dconf->efroll){
+        fprintf(stderr, "AX_INIT: The configuration must be uploaded before the axis is initialized.\n");
+        return -1;
+    }
+    ax->_reg[AX_REG_COUNT] = dconf->efch[efch].reg[LC_EF_REG_CONFIG_C];
+    ax->_regtype[AX_REG_COUNT] = dconf->efch[efch].regtype[LC_EF_REG_CONFIG_C];
+    ax->_reg[AX_REG_ENABLE] = dconf->efch[efch].reg[LC_EF_REG_ENABLE];
+    ax->_regtype[AX_REG_ENABLE] = dconf->efch[efch].regtype[LC_EF_REG_ENABLE];
+    ax->_reg[AX_REG_DONE] = dconf->efch[efch].reg[LC_EF_REG_READ_A];
+    ax->_regtype[AX_REG_DONE] = dconf->efch[efch].regtype[LC_EF_REG_READ_A];
+    ax->_reg[AX_REG_TARGET] = dconf->efch[efch].reg[LC_EF_REG_READ_B];
+    ax->_regtype[AX_REG_TARGET] = dconf->efch[efch].regtype[LC_EF_REG_READ_B];
+    ax->_reg[AX_REG_CONFIG_A] = dconf->efch[efch].reg[LC_EF_REG_CONFIG_A];
+    ax->_regtype[AX_REG_CONFIG_A] = dconf->efch[efch].regtype[LC_EF_REG_CONFIG_A];
+    ax->_reg[AX_REG_CONFIG_B] = dconf->efch[efch].reg[LC_EF_REG_CONFIG_B];
+    ax->_regtype[AX_REG_CONFIG_B] = dconf->efch[efch].regtype[LC_EF_REG_CONFIG_B];
     // stash the direction register name for later
-    sprintf(ax->dregister, "DIO%d", dconf->efch[efch].channel+1);
+    sprintf(ax->dregister, "DIO%d", dirch);
+    // Look up the direction bit and the EF clock registers
+    err = LJM_NameToAddress(ax->dregister, 
+            &ax->_reg[AX_REG_DIR], &ax->_regtype[AX_REG_DIR]);
+    err = err ? err : LJM_NameToAddress("DIO_EF_CLOCK0_ENABLE", 
+            &ax->_reg[AX_REG_CLK_EN], &ax->_regtype[AX_REG_CLK_EN]);
+    err = err ? err : LJM_NameToAddress("DIO_EF_CLOCK0_ROLL_VALUE", 
+            &ax->_reg[AX_REG_CLK_ROLL], &ax->_regtype[AX_REG_CLK_ROLL]);
+    if(err){
+        fprintf(stderr, "AX_INIT: Failed to find the registers for DIO%d.\n", dirch);
+        return -1;
+    }
 
     // Retrieve the configuration parameters from the LConfig meta variables
     // STEPS
@@ -126,10 +204,378 @@ int ax_init(AxisIterator_t *ax, lc_devconf_t *dconf, int efch, char axis){
         fprintf(stderr, "AX_INIT: Did not find required meta configuration parameter: unit_length\n");
         return -1;
     }
+    // SETTLE (optional)
+    sprintf(stemp, "%csettle", axis);
+    ax->settle_us = AX_SETTLE_US;
+    if(lc_get_meta_type(dconf, stemp) == LC_MT_FLT){
+        lc_get_meta_flt(dconf, stemp, &ftemp);
+        if(ftemp < 0){
+            fprintf(stderr, "AX_INIT: %csettle set to %lf.  Must be non-negative.\n", axis, ftemp);
+            return -1;
+        }
+        ax->settle_us = (int)(ftemp * 1e6);
+    }else if(lc_get_meta_type(dconf, stemp)){
+        fprintf(stderr, "AX_INIT: %csettle must be a float.\n", axis);
+        return -1;
+    }
+    // VMAX and ACCEL (optional)
+    ax->vmax = 0.;
+    ax->accel = 0.;
+    sprintf(stemp, "%cvmax", axis);
+    if(lc_get_meta_type(dconf, stemp) == LC_MT_FLT){
+        lc_get_meta_flt(dconf, stemp, &ax->vmax);
+        sprintf(stemp, "%caccel", axis);
+        if(lc_get_meta_type(dconf, stemp) != LC_MT_FLT){
+            fprintf(stderr, "AX_INIT: %cvmax requires the float parameter %s.\n", axis, stemp);
+            return -1;
+        }
+        lc_get_meta_flt(dconf, stemp, &ax->accel);
+        if(ax->vmax <= 0 || ax->accel <= 0){
+            fprintf(stderr, "AX_INIT: %cvmax and %caccel must be positive.\n", axis, axis);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* AX_PROFILE - Plan the pulse trains for a motion
+ * 
+ * Divides a motion of PSTEPS pulses into pulse trains of COUNT[ii] pulses
+ * at FREQ[ii] Hz.  The arrays must have room for AX_NSEG elements.  
+ * Without a ramp, there is one train at the EFFREQUENCY.  Otherwise, the
+ * rate starts at the EFFREQUENCY and is raised in AX_NRAMP equal steps,
+ * each held until the rate would have reached the next at ACCEL.  The 
+ * rate is held at VMAX, and the ramp is repeated in reverse at the end.
+ * If the motion is too short to reach VMAX, the ramps meet in the middle.
+ * The trains are never faster than the acceleration allows.  If the ramp 
+ * would not save at least AX_TRAIN_US per train, it is not used.
+ * 
+ * Returns the number of trains, and sets _TMOVE_US to their duration.
+ */
+int ax_profile(AxisIterator_t *ax, int psteps, double *freq, int *count){
+    double v0, vp, vnext, xlast, x;
+    int ii, nseg, nramp, last;
+    
+    v0 = ax->dconf->effrequency;
+    // No ramp
+    if(ax->vmax <= v0 || ax->accel <= 0 || psteps < 2*AX_NRAMP){
+        freq[0] = v0;
+        count[0] = psteps;
+        ax->_tmove_us = psteps * 1e6 / v0;
+        return 1;
+    }
+    // The peak rate reached half way through the motion 
+    vp = sqrt(v0*v0 + ax->accel * psteps);
+    vp = vp < ax->vmax ? vp : ax->vmax;
+    // Build the ramp up
+    nseg = 0;
+    nramp = 0;
+    last = 0;
+    vnext = v0;
+    for(ii=1; ii<=AX_NRAMP; ii++){
+        // The position where the rate reaches the next step
+        x = v0 + ii * (vp - v0) / AX_NRAMP;
+        x = (x*x - v0*v0) / (2*ax->accel);
+        xlast = floor(x + 0.5);
+        if(xlast > psteps/2)
+            xlast = psteps/2;
+        if((int)xlast > last){
+            freq[nseg] = vnext;
+            vnext = v0 + ii * (vp - v0) / AX_NRAMP;
+            count[nseg] = (int)xlast - last;
+            nramp += count[nseg];
+            last = (int)xlast;
+            nseg++;
+        }
+    }
+    // Hold the peak rate
+    if(psteps > 2*nramp){
+        freq[nseg] = vp;
+        count[nseg] = psteps - 2*nramp;
+        nseg++;
+    }
+    // Mirror the ramp down
+    for(ii=nseg - 1 - (psteps > 2*nramp); ii>=0; ii--){
+        freq[nseg] = freq[ii];
+        count[nseg] = count[ii];
+        nseg++;
+    }
+    ax->_tmove_us = 0.;
+    for(ii=0; ii<nseg; ii++)
+        ax->_tmove_us += count[ii] * 1e6 / freq[ii];
+    // Is it worth it?
+    if(psteps * 1e6 / v0 - ax->_tmove_us < nseg * AX_TRAIN_US){
+        freq[0] = v0;
+        count[0] = psteps;
+        ax->_tmove_us = psteps * 1e6 / v0;
+        return 1;
+    }
+    return nseg;
+}
+
+
+
+/* AX_WAIT_US - Time required by the last motion
+ * 
+ * Returns the nominal number of microseconds required for the last 
+ * motion commanded by AX_MOVE() or AX_ITER() to complete, including the
+ * settle time.  If the last motion was zero steps, returns 0.  The 
+ * pulses are timed by the EF clock, so this is accurate, but AX_WAIT() 
+ * does not have to guess.
+ */
+int ax_wait_us(AxisIterator_t *ax){
+    if(ax->_psteps == 0)
+        return 0;
+    return (int)ax->_tmove_us + ax->settle_us;
+}
+
+
+/* AX_DONE - Test whether the last motion is complete
+ * 
+ * Reads the number of pulses completed by the pulse out channel and the 
+ * number commanded in one transaction.  Returns 1 if the pulse train is 
+ * finished, 0 if it is still running, and -1 on an error.  The settle 
+ * time is not included.
+ */
+int ax_done(AxisIterator_t *ax){
+    int err, errorAddress;
+    double values[2];
+    
+    if(ax->_psteps == 0)
+        return 1;
+    err = LJM_eReadAddresses(ax->dconf->handle, 2, &ax->_reg[AX_REG_DONE],
+            &ax->_regtype[AX_REG_DONE], values, &errorAddress);
+    if(err){
+        fprintf(stderr, "AX_DONE: Failed to read the pulse count on %s (address %d)\n",
+                ax->dregister, errorAddress);
+        return -1;
+    }
+    return values[0] >= values[1];
+}
+
+
+/* AX_POLL - Wait for the pulse train to finish
+ * 
+ * Polls AX_DONE() with an interval that starts at POLL_US and doubles up
+ * to POLL_MAX_US.  If the train has not finished AX_TIMEOUT_US after 
+ * NOMINAL_US, it is treated as an error.  Returns 0 on success and -1 on
+ * failure.
+ */
+int ax_poll(AxisIterator_t *ax, double nominal_us, int poll_us, int poll_max_us){
+    struct timespec start, now;
+    int done;
+    double elapsed_us;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!(done = ax_done(ax))){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_us = (now.tv_sec - start.tv_sec) * 1e6 + 
+                (now.tv_nsec - start.tv_nsec) * 1e-3;
+        if(elapsed_us > nominal_us + AX_TIMEOUT_US){
+            fprintf(stderr, "AX_POLL: Motion on %s did not finish in %.0fus\n", 
+                    ax->dregister, elapsed_us);
+            return -1;
+        }
+        usleep(poll_us);
+        poll_us = 2*poll_us < poll_max_us ? 2*poll_us : poll_max_us;
+    }
+    return done < 0 ? -1 : 0;
+}
+
+
+/* AX_WAIT - Wait for the last motion to complete and settle
+ * 
+ * Polls AX_DONE() with an interval that starts at AX_POLL_US and doubles
+ * up to AX_POLL_MAX_US, and then waits the settle time.  If the motion 
+ * has not finished AX_TIMEOUT_US after its nominal duration, it is 
+ * treated as an error.  Returns 0 on success and -1 on failure.
+ */
+int ax_wait(AxisIterator_t *ax){
+    if(ax->_psteps == 0)
+        return 0;
+    if(ax_poll(ax, ax->_tmove_us, AX_POLL_US, AX_POLL_MAX_US))
+        return -1;
+    ax->_pending = 0;
+    usleep(ax->settle_us);
+    return 0;
+}
+
 
+/* AX_TRAIN_ROLL - Send one pulse train with a given clock roll value
+ * 
+ * Sets the EF clock roll value to ROLL, and sends COUNT pulses from the
+ * pulse out channel.  The pulse edges are placed using the channel's 
+ * duty cycle, phase, and edge settings, as LC_UPLOAD_CONFIG() places 
+ * them.  When DIR is not negative, the direction bit is written first.
+ * Everything is written in one transaction.  When COUNT is zero, only 
+ * the clock and pulse edges are written; that is used to restore the 
+ * clock (see AX_CLOCK_RESTORE()).  Returns 0 on success and -1 on failure.
+ */
+int ax_train_roll(AxisIterator_t *ax, int dir, unsigned int roll, int count){
+    int addr[AX_NREG_ALL + 3], type[AX_NREG_ALL + 3], n = 0, errorAddress;
+    double values[AX_NREG_ALL + 3];
+    unsigned int start, stop;
+    lc_efconf_t *ef;
+    
+// Queue a write by its AX_REG_XXX index
+#define ax_frame(REG, VALUE) {addr[n] = ax->_reg[REG]; \
+        type[n] = ax->_regtype[REG]; values[n] = (VALUE); n++;}
+    
+    ef = &ax->dconf->efch[ax->efch];
+    start = (unsigned int)(roll * (ef->phase / 360.)) % roll;
+    stop = (unsigned int)(((long int) start) + ((long int)(roll * ef->duty))) % roll;
+    if(dir >= 0)
+        ax_frame(AX_REG_DIR, dir);
+    ax_frame(AX_REG_CLK_EN, 0);
+    ax_frame(AX_REG_CLK_ROLL, roll);
+    ax_frame(AX_REG_CLK_EN, 1);
+    if(count)
+        ax_frame(AX_REG_ENABLE, 0);
+    ax_frame(AX_REG_CONFIG_A, ef->edge == LC_EDGE_FALLING ? start : stop);
+    ax_frame(AX_REG_CONFIG_B, ef->edge == LC_EDGE_FALLING ? stop : start);
+    if(count){
+        ax_frame(AX_REG_COUNT, count);
+        ax_frame(AX_REG_ENABLE, 1);
+    }
+#undef ax_frame
+    
+    if(LJM_eWriteAddresses(ax->dconf->handle, n, addr, type, values, &errorAddress)){
+        fprintf(stderr, "AX_TRAIN: Failed to transmit the pulse train on %s (address %d)\n",
+                ax->dregister, errorAddress);
+        return -1;
+    }
     return 0;
 }
 
+/* AX_TRAIN - Send one pulse train at a given rate
+ * 
+ * The same as AX_TRAIN_ROLL(), but the clock roll value is calculated for
+ * pulses at FREQ Hz.
+ */
+int ax_train(AxisIterator_t *ax, int dir, double freq, int count){
+    return ax_train_roll(ax, dir, 
+            (unsigned int)(1e6 * LCONF_CLOCK_MHZ / ax->dconf->efdiv / freq), 
+            count);
+}
+
+/* AX_CLOCK_RESTORE - Return the EF clock to its configured roll value
+ * 
+ * The roll value kept by LC_UPLOAD_CONFIG() is written as it is.  It is 
+ * not recalculated from the EFFREQUENCY, which could round it to a 
+ * different value than the other EF channels and LC_UPDATE_EF() expect.
+ * Returns 0 on success and -1 on failure.
+ */
+int ax_clock_restore(AxisIterator_t *ax){
+    return ax_train_roll(ax, -1, ax->dconf->efroll, 0);
+}
+
+
+/* AX_FLY - Start a constant-rate motion for a fly scan
+ * AX_PROGRESS - Pulses completed in the current motion
+ * AX_FLY_END - Restore the EF clock after a fly scan motion
+ * 
+ * AX_FLY() sends STEPS pulses at FREQ Hz in one pulse train (see 
+ * AX_TRAIN()) and returns immediately.  The axis state is updated as it
+ * is by AX_MOVE().  The EF clock is shared by all of the EF channels, so
+ * no other axis may move until the motion is complete and AX_FLY_END() 
+ * has restored the EFFREQUENCY.
+ * 
+ * AX_PROGRESS() reads the number of pulses the channel has sent in the 
+ * current train.  AX_DONE() tests whether the train is finished.
+ * 
+ * AX_FLY() and AX_FLY_END() return 0 on success and -1 on failure.
+ * AX_PROGRESS() returns the pulse count or -1 on failure.
+ */
+int ax_fly(AxisIterator_t *ax, int steps, double freq){
+    lc_efconf_t *ef;
+    int psteps = steps < 0 ? -steps : steps;
+    
+    if(steps == 0){
+        ax->_psteps = 0;
+        ax->_tmove_us = 0.;
+        ax->_pending = 0;
+        return 0;
+    }else if(freq <= 0){
+        fprintf(stderr, "AX_FLY: The pulse rate must be positive.\n");
+        return -1;
+    }
+    if(ax_train(ax, steps < 0 ? !ax->dpos : ax->dpos, freq, psteps))
+        return -1;
+    ef = &ax->dconf->efch[ax->efch];
+    ef->counts = 0;
+    ef->time = 0;
+    ax->state += steps;
+    ax->_psteps = psteps;
+    ax->_tmove_us = psteps * 1e6 / freq;
+    ax->_pending = 1;
+    return 0;
+}
+
+int ax_progress(AxisIterator_t *ax){
+    int errorAddress;
+    double value;
+    
+    if(LJM_eReadAddresses(ax->dconf->handle, 1, &ax->_reg[AX_REG_DONE], 
+            &ax->_regtype[AX_REG_DONE], &value, &errorAddress)){
+        fprintf(stderr, "AX_PROGRESS: Failed to read the pulse count on %s\n", 
+                ax->dregister);
+        return -1;
+    }
+    return (int) value;
+}
+
+int ax_fly_end(AxisIterator_t *ax){
+    ax->_pending = 0;
+    return ax_clock_restore(ax);
+}
+
+
+/* AX_QUEUE - Queue the register writes for a motion
+ * AX_SENT  - Update the axis once the queued writes were sent
+ * 
+ * AX_QUEUE() writes the direction bit, pulse count, and (if the channel 
+ * has not been enabled yet) enable frames for a motion of STEPS into the
+ * ADDR, TYPE, and VALUES arrays, which must have room for AX_NREG frames.
+ * The motion is not ramped.  Returns the number of frames, which is 0 
+ * when STEPS is 0.  The axis is not changed.
+ * 
+ * The frames are sent by AX_MOVE() or AX_GROUP_MOVE(), which call 
+ * AX_SENT() only when the transmission succeeded.  Then, the axis state
+ * and the EF channel are updated for the motion of STEPS.
+ */
+int ax_queue(AxisIterator_t *ax, int steps, int *addr, int *type, double *values){
+    int nreg, ii;
+    
+    if(steps == 0)
+        return 0;
+    values[AX_REG_DIR] = steps < 0 ? !ax->dpos : ax->dpos;
+    values[AX_REG_COUNT] = steps < 0 ? -steps : steps;
+    values[AX_REG_ENABLE] = 1;
+    // The pulse out channel is enabled here if LC_UPLOAD_CONFIG() left 
+    // it disabled (see LC_UPDATE_EF()).
+    nreg = ax->dconf->efch[ax->efch].time ? AX_NREG : AX_REG_ENABLE;
+    for(ii=0; ii<nreg; ii++){
+        addr[ii] = ax->_reg[ii];
+        type[ii] = ax->_regtype[ii];
+    }
+    return nreg;
+}
+
+void ax_sent(AxisIterator_t *ax, int steps){
+    lc_efconf_t *ef;
+    
+    ax->_psteps = steps < 0 ? -steps : steps;
+    ax->_tmove_us = ax->_psteps * 1e6 / ax->dconf->effrequency;
+    if(steps == 0)
+        return;
+    ef = &ax->dconf->efch[ax->efch];
+    ef->counts = 0;
+    ef->time = 0;
+    ax->state += steps;
+    ax->_pending = 1;
+}
 
 
 /* AX_MOVE - Move the axis a number of steps without iteration
@@ -142,21 +588,36 @@ int ax_init(AxisIterator_t *ax, lc_devconf_t *dconf, int efch, char axis){
  * 
  * wait_us : The number of microseconds to wait before returning for the
  *           motion to complete.  Set to 0 to disable the wait, and set
- *           to a negative value to automatically calculate the value 
- *           from the number of pulses.  AX_SETTLE_US is added to the
- *           calculated value to ensure that any remaining vibration has
- *           subsided.
+ *           to a negative value to wait for the pulse train to finish 
+ *           and settle (see AX_WAIT()).
+ * 
+ * When the axis has a ramp (Xvmax and Xaccel) and wait_us is negative, 
+ * the pulse trains planned by AX_PROFILE() are sent one after the other,
+ * and AX_MOVE() only returns when the motion is complete and settled.  
+ * The EF clock is shared by all of the EF channels, so it is changed for
+ * each train, and the EFFREQUENCY is restored at the end.  Each train is 
+ * started when the last is found to be finished, so there is a pause of
+ * about one round trip between them.  Motions that do not wait are 
+ * never ramped.
  */
 int ax_move(AxisIterator_t *ax, int steps, int wait_us){
-    int dir, psteps, err;
+    int dir, psteps, nreg, errorAddress, nseg, ii;
+    int addr[AX_NREG], type[AX_NREG];
+    double values[AX_NREG];
+    double freq[AX_NSEG];
+    int count[AX_NSEG];
+    lc_efconf_t *ef;
     
     // Recode steps from +/- into a direction bit and a positive
     // number of steps
     // If holding position, do nothing
-    if(steps == 0)
+    if(steps == 0){
+        ax->_psteps = 0;
+        ax->_tmove_us = 0.;
+        ax->_pending = 0;
         return 0;
     // If in the negative direction
-    else if(steps < 0){
+    }else if(steps < 0){
         psteps = -steps;
         dir = ! ax->dpos;
     // If in the positive direction
@@ -165,27 +626,47 @@ int ax_move(AxisIterator_t *ax, int steps, int wait_us){
         dir = ax->dpos;
     }
     
-    // Write to the direction bit
-    err = LJM_eWriteName(ax->dconf->handle, ax->dregister, dir);
-    if(err){
-        fprintf(stderr, "AX_MOVE: Failed to set direction pin on %s\n", ax->dregister);
-        return -1;
+    ef = &ax->dconf->efch[ax->efch];
+    
+    // Ramped motion
+    if(wait_us < 0 && (nseg = ax_profile(ax, psteps, freq, count)) > 1){
+        ax->state += steps;
+        ax->_psteps = psteps;
+        for(ii=0; ii<nseg; ii++){
+            if(ax_train(ax, ii ? -1 : dir, freq[ii], count[ii]))
+                return -1;
+            // Sleep through most of the train, and then poll quickly
+            if(count[ii] * 1e6 / freq[ii] > AX_POLL_US)
+                usleep((int)(count[ii] * 1e6 / freq[ii]) - AX_POLL_US);
+            if(ax_poll(ax, AX_POLL_US, AX_POLL_US/10, AX_POLL_US/10))
+                return -1;
+        }
+        ef->counts = 0;
+        ef->time = 0;
+        ax->_pending = 0;
+        // Restore the EF clock for the other channels
+        if(ax_clock_restore(ax))
+            return -1;
+        usleep(ax->settle_us);
+        return 0;
     }
-    // Send the pulse count
-    ax->dconf->efch[ax->efch].counts = psteps;
-    err = lc_update_ef(ax->dconf);
-    if(err){
-        fprintf(stderr, "AX_MOVE: Failed to transmit pulse out\n");
+    
+    // Write the direction bit and the pulse count in one transaction.  
+    // Only this axis' registers are written; lc_update_ef() would rewrite 
+    // all of the EF channels.
+    nreg = ax_queue(ax, steps, addr, type, values);
+    if(LJM_eWriteAddresses(ax->dconf->handle, nreg, addr, type, values, 
+            &errorAddress)){
+        fprintf(stderr, "AX_MOVE: Failed to transmit the motion on %s (address %d)\n", 
+                ax->dregister, errorAddress);
         return -1;
     }
-    
-    // Update the axis state
-    ax->state += steps;
+    ax_sent(ax, steps);
     
     // Case out the wait 
-    // If wait is negative, we'll calculate it
+    // If wait is negative, wait for the motion to finish
     if(wait_us < 0){
-        usleep((int)(psteps * 1e6 / ax->dconf->effrequency) + AX_SETTLE_US);
+        return ax_wait(ax);
     // If wait is positive, just wait that long
     }else if(wait_us > 0){
         usleep(wait_us);
@@ -230,6 +711,35 @@ int ax_iter_repeat(AxisIterator_t *ax){
     return 0;
 }
 
+/* AX_ITER_NEXT - advance the iteration without motion
+ * 
+ * Works like AX_ITER(), but the motion is not commanded.  Instead, the 
+ * number of steps to the next location is written to DISTANCE, so the 
+ * motion can be commanded along with other axes (see AX_GROUP_MOVE()).
+ * 
+ * Returns:
+ *  0 on success
+ *  1 on iteration complete
+ */
+int ax_iter_next(AxisIterator_t *ax, int *distance){
+    // Test for iteration complete
+    if(ax->_index >= ax->niter)
+        return 1;
+    
+    // Increment the index
+    ax->_index ++;
+    
+    // Calculate the desired location
+    if(ax->_dir)
+        *distance = ax->_index * ax->steps;
+    else
+        *distance = (ax->niter - ax->_index) * ax->steps;
+    // Adjust to find the distance required
+    *distance -= ax->state;
+    return 0;
+}
+
+
 /* AX_ITER - iterate through a series of equal motions on an axis
  * 
  * Only call AX_ITER() after calling AX_ITER_START() or AX_ITER_REPEAT()
@@ -243,10 +753,8 @@ int ax_iter_repeat(AxisIterator_t *ax){
  *  
  * wait_us : The number of microseconds to wait before returning for the
  *           motion to complete.  Set to 0 to disable the wait, and set
- *           to a negative value to automatically calculate the value 
- *           from the number of pulses.  AX_SETTLE_US is added to the
- *           calculated value to ensure that any remaining vibration has
- *           subsided.
+ *           to a negative value to wait for the pulse train to finish 
+ *           and settle (see AX_WAIT()).
  * 
  * Returns:
  *  0 on success
@@ -254,26 +762,166 @@ int ax_iter_repeat(AxisIterator_t *ax){
  *  -1 on an error 
  */
 int ax_iter(AxisIterator_t *ax, int wait_us){
-    int distance;
+    int distance, err;
     
-    // Test for iteration complete
-    if(ax->_index >= ax->niter)
+    if((err = ax_iter_next(ax, &distance)))
+        return err;
+    return ax_move(ax, distance, wait_us);
+}
+
+/* AX_GROUP_DONE - Test whether several axes have finished
+ * AX_GROUP_SETTLE_US - Settle time for several axes
+ * AX_GROUP_WAIT - Wait for several axes to finish and settle
+ * 
+ * These operate on an array of NAXES pointers to AxisIterator_t structs
+ * that share the same device.  Only axes with a motion that was sent 
+ * without a wait are considered.
+ * 
+ * AX_GROUP_DONE() reads the pulse counts of all of the axes in one 
+ * transaction.  It returns 1 if all of the pulse trains are finished, 0
+ * if any are still running, and -1 on an error.
+ * 
+ * AX_GROUP_SETTLE_US() returns the longest settle time among the axes
+ * and marks their motions as no longer waiting.
+ * 
+ * AX_GROUP_WAIT() polls AX_GROUP_DONE() like AX_WAIT() and then waits the
+ * longest settle time once.  Returns 0 on success and -1 on failure.
+ */
+int ax_group_done(AxisIterator_t *ax[], int naxes){
+    int addr[2*AX_GROUP_MAX], type[2*AX_GROUP_MAX], n = 0, ii, errorAddress;
+    double values[2*AX_GROUP_MAX];
+    
+    for(ii=0; ii<naxes && ii<AX_GROUP_MAX; ii++){
+        if(!ax[ii]->_pending || !ax[ii]->_psteps)
+            continue;
+        addr[n] = ax[ii]->_reg[AX_REG_DONE];
+        type[n++] = ax[ii]->_regtype[AX_REG_DONE];
+        addr[n] = ax[ii]->_reg[AX_REG_TARGET];
+        type[n++] = ax[ii]->_regtype[AX_REG_TARGET];
+    }
+    if(n == 0)
         return 1;
+    if(LJM_eReadAddresses(ax[0]->dconf->handle, n, addr, type, values, &errorAddress)){
+        fprintf(stderr, "AX_GROUP_DONE: Failed to read the pulse counts (address %d)\n", 
+                errorAddress);
+        return -1;
+    }
+    for(ii=0; ii<n; ii+=2)
+        if(values[ii] < values[ii+1])
+            return 0;
+    return 1;
+}
+
+int ax_group_settle_us(AxisIterator_t *ax[], int naxes){
+    int ii, settle_us = 0;
+    for(ii=0; ii<naxes; ii++){
+        if(ax[ii]->_pending && ax[ii]->_psteps && ax[ii]->settle_us > settle_us)
+            settle_us = ax[ii]->settle_us;
+        ax[ii]->_pending = 0;
+    }
+    return settle_us;
+}
+
+int ax_group_wait(AxisIterator_t *ax[], int naxes){
+    struct timespec start, now;
+    int done, ii, poll_us = AX_POLL_US;
+    double elapsed_us, timeout_us = 0.;
     
-    // Increment the index
-    ax->_index ++;
+    for(ii=0; ii<naxes; ii++)
+        if(ax[ii]->_pending && ax[ii]->_tmove_us > timeout_us)
+            timeout_us = ax[ii]->_tmove_us;
+    timeout_us += AX_TIMEOUT_US;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!(done = ax_group_done(ax, naxes))){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_us = (now.tv_sec - start.tv_sec) * 1e6 + 
+                (now.tv_nsec - start.tv_nsec) * 1e-3;
+        if(elapsed_us > timeout_us){
+            fprintf(stderr, "AX_GROUP_WAIT: Motion did not finish in %.0fus\n", elapsed_us);
+            return -1;
+        }
+        usleep(poll_us);
+        poll_us = 2*poll_us < AX_POLL_MAX_US ? 2*poll_us : AX_POLL_MAX_US;
+    }
+    if(done < 0)
+        return -1;
+    usleep(ax_group_settle_us(ax, naxes));
+    return 0;
+}
+
+
+/* AX_GROUP_MOVE - Move several axes at once
+ * 
+ * Commands STEPS[ii] on each of the NAXES axes in AX, which must share 
+ * the same device.  The pulse trains for all of the axes are started in 
+ * one transaction, so the motion takes as long as the longest of them.
+ * WAIT_US works as it does for AX_MOVE(); when it is negative, 
+ * AX_GROUP_WAIT() is used.
+ * 
+ * Ramped motions (see AX_MOVE()) change the shared EF clock, so they 
+ * cannot run at the same time.  If only one axis is moving, AX_MOVE() is
+ * used.  If WAIT_US is negative, and ramping the axes one after the 
+ * other would be faster than moving them together at the EFFREQUENCY, 
+ * they are moved one after the other.
+ * 
+ * Returns 0 on success and -1 on failure.
+ */
+int ax_group_move(AxisIterator_t *ax[], int steps[], int naxes, int wait_us){
+    int addr[AX_GROUP_MAX*AX_NREG], type[AX_GROUP_MAX*AX_NREG];
+    double values[AX_GROUP_MAX*AX_NREG];
+    double freq[AX_NSEG], tsim = 0., tseq = 0., ftemp;
+    int count[AX_NSEG];
+    int ii, n = 0, nmove = 0, nseg, settle_us = 0, errorAddress;
     
-    // Calculate the desired location
-    if(ax->_dir)
-        distance = ax->_index * ax->steps;
-    else
-        distance = (ax->niter - ax->_index) * ax->steps;
-    // Adjust to find the distance required
-    distance -= ax->state;
+    if(naxes > AX_GROUP_MAX){
+        fprintf(stderr, "AX_GROUP_MOVE: Only %d axes are allowed in a group.\n", AX_GROUP_MAX);
+        return -1;
+    }
+    for(ii=0; ii<naxes; ii++){
+        if(ax[ii]->dconf != ax[0]->dconf){
+            fprintf(stderr, "AX_GROUP_MOVE: The axes must share the same device.\n");
+            return -1;
+        }else if(steps[ii] == 0)
+            continue;
+        nmove++;
+        // Estimate the time to move together and one at a time
+        ftemp = abs(steps[ii]) * 1e6 / ax[ii]->dconf->effrequency;
+        tsim = ftemp > tsim ? ftemp : tsim;
+        settle_us = ax[ii]->settle_us > settle_us ? ax[ii]->settle_us : settle_us;
+        nseg = ax_profile(ax[ii], abs(steps[ii]), freq, count);
+        tseq += nseg * AX_TRAIN_US + ax[ii]->_tmove_us + ax[ii]->settle_us;
+    }
+    tsim += settle_us;
     
-    return ax_move(ax, distance, wait_us);
+    // One axis or ramps one at a time
+    if(nmove <= 1 || (wait_us < 0 && tseq < tsim)){
+        for(ii=0; ii<naxes; ii++)
+            if(steps[ii] && ax_move(ax[ii], steps[ii], wait_us))
+                return -1;
+        return 0;
+    }
+    
+    // All together
+    for(ii=0; ii<naxes; ii++)
+        if(steps[ii])
+            n += ax_queue(ax[ii], steps[ii], &addr[n], &type[n], &values[n]);
+    if(LJM_eWriteAddresses(ax[0]->dconf->handle, n, addr, type, values, 
+            &errorAddress)){
+        fprintf(stderr, "AX_GROUP_MOVE: Failed to transmit the motion (address %d)\n", 
+                errorAddress);
+        return -1;
+    }
+    for(ii=0; ii<naxes; ii++)
+        if(steps[ii])
+            ax_sent(ax[ii], steps[ii]);
+    if(wait_us < 0)
+        return ax_group_wait(ax, naxes);
+    else if(wait_us > 0)
+        usleep(wait_us);
+    return 0;
 }
 
+
 /* AX_GET_POS   - Return the position in length units
  * AX_GET_INDEX - Return the current index in the iteration
  * 